@@ -2,306 +2,1888 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 
 #include "internal.h"
 #include "lib/log.h"
 #include "lib/error.h"
 #include "lib/misc.h"
+#include "lib/math.h"
 
 /*
  * A couple function prototypes
  */ 
 static void _evsql_pump (struct evsql *evsql, struct evsql_conn *conn);
+static void _evsql_pool_lost (struct evsql *evsql);
+static int _evsql_trans_conn_ready (struct evsql *evsql, struct evsql_trans *trans);
+static struct evsql_conn *_evsql_conn_new (struct evsql *evsql);
+static int _evsql_pool_open (struct evsql *evsql);
+static void _evsql_pool_fill (struct evsql *evsql);
+
+const struct evsql_query_params _evsql_no_params = {
+    EVSQL_FMT_BINARY,
+    {
+        // just the terminating item, whose type is EVSQL_TYPE_INVALID
+        { { EVSQL_FMT_BINARY, EVSQL_TYPE_INVALID, { false } }, NULL, 0, { 0 }, { false } }
+    }
+};
 
 /*
- * Actually execute the given query.
+ * Can the conn take on any more transactionless queries?
  *
- * The backend should be able to accept the query at this time.
+ * Pipelined conns can take up to pipeline_depth queries at once, others just one. Conns that are going to be closed
+ * shouldn't take on any more.
+ */
+static int _evsql_conn_full (struct evsql_conn *conn) {
+    const struct evsql_config *config = &conn->evsql->config;
+
+    if (conn->retire || (config->max_queries && conn->query_count >= config->max_queries))
+        return 1;
+
+    // a cancel for this conn may still be on its way to the server
+    if (conn->cancel || conn->cancelling)
+        return 1;
+
+    // streamed queries get the conn to themselves
+    if (!TAILQ_EMPTY(&conn->queries) && TAILQ_FIRST(&conn->queries)->row_fn)
+        return 1;
+
+    return conn->query_depth >= (conn->pipeline ? MAX(config->pipeline_depth, 1) : 1);
+}
+
+/*
+ * Move the conn to the list for the state that it is now in, based on its trans/queries/connected.
  *
- * You should assume that if trying to execute a query fails, then the connection should also be considred as failed.
+ * This must be called whenever those change, except when the conn is about to be released anyways.
  */
-static int _evsql_query_exec (struct evsql_conn *conn, struct evsql_query *query, const char *command) {
-    int err;
+static void _evsql_conn_update (struct evsql_conn *conn) {
+    struct evsql *evsql = conn->evsql;
+    enum evsql_conn_state state;
+    
+    if (conn->trans)
+        state = EVSQL_CONN_TRANS;
 
-    DEBUG("evsql.%p: exec query=%p on trans=%p on conn=%p:", conn->evsql, query, conn->trans, conn);
+    else if ((conn->query_depth && _evsql_conn_full(conn)) || conn->cancel || conn->cancelling)
+        state = EVSQL_CONN_BUSY;
 
-    switch (conn->evsql->type) {
-        case EVSQL_EVPQ:
-            // got params?
-            if (query->params.count) {
-                err = evpq_query_params(conn->engine.evpq, command,
-                    query->params.count, 
-                    query->params.types, 
-                    query->params.values, 
-                    query->params.lengths, 
-                    query->params.formats, 
-                    query->params.result_format
-                );
+    else if (conn->query_depth)
+        state = EVSQL_CONN_PIPELINE;
 
-            } else {
-                // plain 'ole query
-                err = evpq_query(conn->engine.evpq, command);
-            }
+    else if (!conn->connected)
+        state = EVSQL_CONN_CONNECTING;
 
-            if (err) {
-                if (PQstatus(evpq_pgconn(conn->engine.evpq)) != CONNECTION_OK)
-                    WARNING("conn failed");
-                else
-                    WARNING("query failed, dropping conn as well");
-            }
+    else
+        state = EVSQL_CONN_IDLE;
 
-            break;
-        
-        default:
-            FATAL("evsql->type");
-    }
+    if (state == conn->state)
+        return;
 
-    if (!err)
-        // assign the query
-        conn->query = query;
+    TAILQ_REMOVE(&evsql->conn_lists[conn->state], conn, entry);
+    evsql->conn_counts[conn->state]--;
 
-    return err;
+    // most-recently-used first
+    TAILQ_INSERT_HEAD(&evsql->conn_lists[state], conn, entry);
+    evsql->conn_counts[state]++;
+
+    conn->state = state;
+
+    if (state == EVSQL_CONN_IDLE)
+        // XXX: errors?
+        event_base_gettimeofday_cached(evsql->ev_base, &conn->idle_since);
 }
 
-void _evsql_query_free (struct evsql_query *query) {
-    if (!query)
+/*
+ * Two-way-associate the given trans and conn.
+ */
+static void _evsql_conn_attach (struct evsql_conn *conn, struct evsql_trans *trans) {
+    assert(conn->trans == NULL && trans->conn == NULL);
+
+    trans->conn = conn; conn->trans = trans;
+
+    _evsql_conn_update(conn);
+}
+
+/*
+ * Check the queue depth and the number of queries in flight against the watermarks, and have ev_pressure tell the
+ * pressure_fn about any change, as this is called from all over the place.
+ */
+static void _evsql_pressure_update (struct evsql *evsql) {
+    const struct evsql_config *config = &evsql->config;
+    int high;
+
+    if (!evsql->pressure_high)
+        high = (config->queue_high && evsql->queue_len >= config->queue_high)
+            || (config->in_flight_high && evsql->query_depth >= config->in_flight_high);
+    else
+        // both must be back down
+        high = (config->queue_high && evsql->queue_len > config->queue_low)
+            || (config->in_flight_high && evsql->query_depth > config->in_flight_low);
+
+    if (high == evsql->pressure_high)
         return;
-        
-    assert(query->command == NULL);
-    
-    // free params if present
-    free(query->params.types);
-    free(query->params.values);
-    free(query->params.lengths);
-    free(query->params.formats);
-    free(query->params.item_vals);
 
-    // free the query itself
-    free(query);
+    evsql->pressure_high = high;
+
+    if (evsql->ev_pressure)
+        event_active(evsql->ev_pressure, EV_TIMEOUT, 1);
 }
 
 /*
- * Execute the callback if res is given, and free the query.
- *
- * The query has been aborted, it will simply be freed
+ * Tell the pressure_fn about the change in pressure, unless it already changed back.
  */
-static void _evsql_query_done (struct evsql_query *query, struct evsql_result *res) {
-    if (res) {
-        if (query->cb_fn) {
-            // call the callback
-            query->cb_fn(res, query->cb_arg);
+static void _evsql_pressure_event (evutil_socket_t fd, short what, void *arg) {
+    struct evsql *evsql = arg;
 
-        } else {
-            WARNING("supressing cb_fn because query was aborted");
-            
-            // free the results
-            evsql_result_free(res);
-        }
-    }
+    (void) fd;
+    (void) what;
 
-    // free
-    _evsql_query_free(query);
+    if (evsql->pressure_high == evsql->pressure_reported)
+        return;
+
+    evsql->pressure_reported = evsql->pressure_high;
+
+    evsql->config.pressure_fn(evsql, evsql->pressure_high, evsql->cb_arg);
 }
 
 /*
- * XXX:
- * /
-static void _evsql_destroy (struct evsql *evsql, const struct evsql_result *res) {
+ * The order that the priority queues are served in
+ */
+static const enum evsql_priority _evsql_queue_order[EVSQL_PRIORITY_MAX] = {
+    EVSQL_PRIORITY_HIGH,
+    EVSQL_PRIORITY_NORMAL,
+    EVSQL_PRIORITY_LOW,
+};
+
+/*
+ * Add the query to the end of the queue for its priority.
+ */
+static void _evsql_queue_push (struct evsql *evsql, struct evsql_query *query) {
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &query->queued);
+
+    TAILQ_INSERT_TAIL(&evsql->query_queues[query->priority], query, entry);
+    evsql->queue_len++;
+    evsql->queue_stats.queued++;
+
+    _evsql_pressure_update(evsql);
+}
+
+/*
+ * Remove the query from its queue.
+ */
+static void _evsql_queue_remove (struct evsql *evsql, struct evsql_query *query) {
+    TAILQ_REMOVE(&evsql->query_queues[query->priority], query, entry);
+    evsql->queue_len--;
+
+    _evsql_pressure_update(evsql);
+}
+
+/*
+ * May new queries be added to the queue, as far as max_queue and max_queue_wait are concerned?
+ */
+static int _evsql_queue_admit (struct evsql *evsql) {
+    const struct evsql_config *config = &evsql->config;
     struct evsql_query *query;
-    
-    // clear the queue
-    while ((query = TAILQ_FIRST(&evsql->query_queue)) != NULL) {
-        _evsql_query_done(query, res);
-        
-        TAILQ_REMOVE(&evsql->query_queue, query, entry);
+    struct timeval now, waited;
+    enum evsql_priority priority;
+
+    if (config->max_queue && evsql->queue_len >= config->max_queue)
+        return 0;
+
+    if (!timerisset(&config->max_queue_wait) || !evsql->queue_len)
+        return 1;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &now);
+
+    // the oldest query is at the head of one of the queues
+    for (priority = 0; priority < EVSQL_PRIORITY_MAX; priority++) {
+        if ((query = TAILQ_FIRST(&evsql->query_queues[priority])) == NULL)
+            continue;
+
+        timersub(&now, &query->queued, &waited);
+
+        if (!timercmp(&waited, &config->max_queue_wait, <))
+            return 0;
     }
-    
-    // free
-    free(evsql);
+
+    return 1;
 }
-*/
 
 /*
- * Free the transaction, it should already be deassociated from the query and conn.
+ * May the given query be sent on the given conn, as far as low_priority_conns is concerned?
  */
-static void _evsql_trans_free (struct evsql_trans *trans) {
-    // ensure we don't leak anything
-    assert(trans->query == NULL);
-    assert(trans->conn == NULL);
-    
-    // free
-    free(trans);
+static int _evsql_queue_allowed (struct evsql *evsql, struct evsql_conn *conn, struct evsql_query *query) {
+    if (query->priority != EVSQL_PRIORITY_LOW || !evsql->config.low_priority_conns || !conn)
+        return 1;
+
+    // a conn that is already occupied by them can take more
+    return conn->low_depth || evsql->low_conns < evsql->config.low_priority_conns;
 }
 
 /*
- * Release a connection. It should already be deassociated from the trans and query.
+ * Pick the queued query that should be sent next on the given conn, leaving it in its queue, or NULL if there are none
+ * that may be sent on it.
  *
- * Releases the engine, removes from the conn_list and frees this.
+ * With priority_weights, the queues take turns, with each one getting its weight's worth of queries. Otherwise, the
+ * highest priority always goes first.
  */
-static void _evsql_conn_release (struct evsql_conn *conn) {
-    // ensure we don't leak anything
-    assert(conn->trans == NULL);
-    assert(conn->query == NULL);
+static struct evsql_query *_evsql_queue_next (struct evsql *evsql, struct evsql_conn *conn) {
+    const unsigned int *weights = evsql->config.priority_weights;
+    struct evsql_query *query;
+    size_t i;
 
-    // release the engine
-    switch (conn->evsql->type) {
-        case EVSQL_EVPQ:
-            evpq_release(conn->engine.evpq);
-            break;
-        
-        default:
-            FATAL("evsql->type");
+    if (!evsql->queue_len)
+        return NULL;
+
+    if (!weights[EVSQL_PRIORITY_NORMAL] && !weights[EVSQL_PRIORITY_HIGH] && !weights[EVSQL_PRIORITY_LOW]) {
+        // strict priority
+        for (i = 0; i < EVSQL_PRIORITY_MAX; i++) {
+            if ((query = TAILQ_FIRST(&evsql->query_queues[_evsql_queue_order[i]])) && _evsql_queue_allowed(evsql, conn, query))
+                return query;
+        }
+
+        return NULL;
     }
-    
-    // remove from list
-    LIST_REMOVE(conn, entry);
-    
-    // catch deadlocks
-    // XXX: still just assert?
-    assert(!LIST_EMPTY(&conn->evsql->conn_list) || TAILQ_EMPTY(&conn->evsql->query_queue));
 
-    // free
-    free(conn);
+    // weighted, going all the way around back to the current queue, in case it still has credit left
+    for (i = 0; i <= EVSQL_PRIORITY_MAX; i++) {
+        query = TAILQ_FIRST(&evsql->query_queues[_evsql_queue_order[evsql->queue_turn]]);
+
+        if (evsql->queue_credit && query && _evsql_queue_allowed(evsql, conn, query)) {
+            evsql->queue_credit--;
+
+            return query;
+        }
+
+        // the next queue's turn
+        evsql->queue_turn = (evsql->queue_turn + 1) % EVSQL_PRIORITY_MAX;
+        evsql->queue_credit = MAX(weights[_evsql_queue_order[evsql->queue_turn]], 1);
+    }
+
+    return NULL;
 }
 
 /*
- * Release a transaction, it should already be deassociated from the query.
- *
- * Perform a two-way-deassociation with the conn, and then free the trans.
+ * The query was sent on the conn, so account for it in low_priority_conns.
  */
-static void _evsql_trans_release (struct evsql_trans *trans) {
-    assert(trans->query == NULL);
-    assert(trans->conn != NULL);
+static void _evsql_conn_low_add (struct evsql_conn *conn, struct evsql_query *query) {
+    if (query->priority == EVSQL_PRIORITY_LOW && !conn->low_depth++)
+        conn->evsql->low_conns++;
+}
 
-    // deassociate the conn
-    trans->conn->trans = NULL; trans->conn = NULL;
+/*
+ * The query is done with the conn.
+ */
+static void _evsql_conn_low_del (struct evsql_conn *conn, struct evsql_query *query) {
+    if (query->priority == EVSQL_PRIORITY_LOW && !--conn->low_depth)
+        conn->evsql->low_conns--;
+}
 
-    // free the trans
-    _evsql_trans_free(trans);
+/*
+ * Some conn stopped being occupied by EVSQL_PRIORITY_LOW queries, so if any are still queued, send them on some idle
+ * conn, as the conn that was occupied might not pump the queue itself.
+ */
+static void _evsql_queue_low_kick (struct evsql *evsql) {
+    struct evsql_conn *conn;
+
+    if (!evsql->config.low_priority_conns || TAILQ_EMPTY(&evsql->query_queues[EVSQL_PRIORITY_LOW]))
+        return;
+
+    if ((conn = TAILQ_FIRST(&evsql->conn_lists[EVSQL_CONN_IDLE])) != NULL)
+        _evsql_pump(evsql, conn);
 }
 
 /*
- * Fail a single query, this will trigger the callback and free it.
- *
- * NOTE: Only for *TRANSACTIONLESS* queries.
+ * Hash bucket index for the given query_info's statement
  */
-static void _evsql_query_fail (struct evsql* evsql, struct evsql_query *query) {
-    struct evsql_result res; ZINIT(res);
-    
-    // set up the result_info
-    res.evsql = evsql;
-    res.error = 1;
-    
-    // finish off the query
-    _evsql_query_done(query, &res);
+static size_t _evsql_stmt_hash (const struct evsql_query_info *info) {
+    return ((uintptr_t) info / sizeof(void *)) % EVSQL_STMT_BUCKETS;
 }
 
 /*
- * Fail a transaction, this will silently drop any query, trigger the error callback, two-way-deassociate/release the
- * conn, and then free the trans.
- */ 
-static void _evsql_trans_fail (struct evsql_trans *trans) {
-    if (trans->query) {
-        // free the query silently
-        _evsql_query_free(trans->query); trans->query = NULL;
+ * Look up the statement prepared on the conn for the given query_info, if any
+ */
+static struct evsql_stmt *_evsql_stmt_find (struct evsql_conn *conn, const struct evsql_query_info *info) {
+    struct evsql_stmt *stmt;
 
-        // also deassociate it from the conn!
-        trans->conn->query = NULL;
+    LIST_FOREACH(stmt, &conn->stmts[_evsql_stmt_hash(info)], hash_entry) {
+        if (stmt->info == info)
+            return stmt;
     }
 
-    // tell the user
-    // XXX: trans is in a bad state during this call
-    if (trans->error_fn)
-        trans->error_fn(trans, trans->cb_arg);
-    else
-        WARNING("supressing error because error_fn was NULL");
- 
-    // deassociate and release the conn
-    trans->conn->trans = NULL; _evsql_conn_release(trans->conn); trans->conn = NULL;
+    return NULL;
+}
 
-    // pump the queue for requests that were waiting for this connection
-    _evsql_pump(trans->evsql, NULL);
+/*
+ * Is the query_info registered using evsql_prepare?
+ */
+static int _evsql_prepared (struct evsql *evsql, const struct evsql_query_info *info) {
+    struct evsql_prepared *prepared;
 
-    // free the trans
-    _evsql_trans_free(trans);
+    LIST_FOREACH(prepared, &evsql->prepared[_evsql_stmt_hash(info)], entry) {
+        if (prepared->info == info)
+            return 1;
+    }
+
+    return 0;
 }
 
 /*
- * Fail a connection. If the connection is transactional, this will just call _evsql_trans_fail, but otherwise it will
- * fail any ongoing query, and then release the connection.
+ * Remove the statement from the conn's hash and LRU list, list of pinned statements or stmt_dealloc.
  */
-static void _evsql_conn_fail (struct evsql_conn *conn) {
-    if (conn->trans) {
-        // let transactions handle their connection failures
-        _evsql_trans_fail(conn->trans);
+static void _evsql_stmt_unlink (struct evsql_conn *conn, struct evsql_stmt *stmt) {
+    if (stmt->dealloc) {
+        // not hashed anymore
+        TAILQ_REMOVE(&conn->stmt_dealloc, stmt, lru_entry);
 
-    } else {
-        if (conn->query) {
-            // fail the in-progress query
-            _evsql_query_fail(conn->evsql, conn->query); conn->query = NULL;
-        }
+    } else if (stmt->pinned) {
+        LIST_REMOVE(stmt, hash_entry);
+        TAILQ_REMOVE(&conn->stmt_pinned, stmt, lru_entry);
 
-        // finish off the whole connection
-        _evsql_conn_release(conn);
+    } else {
+        LIST_REMOVE(stmt, hash_entry);
+        TAILQ_REMOVE(&conn->stmt_lru, stmt, lru_entry);
+        conn->stmt_count--;
     }
 }
 
 /*
- * Processes enqueued non-transactional queries until the queue is empty, or we managed to exec a query.
- *
- * If execing a query on a connection fails, both the query and the connection are failed (in that order).
- *
- * Any further queries will then also be failed, because there's no reconnection/retry logic yet.
+ * Forget about the prepared statement, this does not deallocate it on the server.
+ */
+static void _evsql_stmt_free (struct evsql_conn *conn, struct evsql_stmt *stmt) {
+    _evsql_stmt_unlink(conn, stmt);
+
+    _evsql_free(&conn->evsql->allocator, stmt->sql, strlen(stmt->sql) + 1);
+    _evsql_free(&conn->evsql->allocator, stmt, sizeof(*stmt));
+}
+
+/*
+ * Deallocate the statement on the server and forget about it. A DEALLOCATE within a transaction fails if the
+ * transaction has aborted, so there it is deferred until the conn is outside of it again, see _evsql_stmt_flush.
  *
- * This means that if conn is NULL, all queries are failed.
+ * Returns nonzero on failure, in which case the conn should be considered as failed.
  */
-static void _evsql_pump (struct evsql *evsql, struct evsql_conn *conn) {
-    struct evsql_query *query;
-    int err;
-    
-    // look for waiting queries
-    while ((query = TAILQ_FIRST(&evsql->query_queue)) != NULL) {
-        // zero err
-        err = 0;
+static int _evsql_stmt_evict (struct evsql_conn *conn, struct evsql_stmt *stmt) {
+    if (conn->trans) {
+        // it can't be used anymore, but must still be deallocated later
+        _evsql_stmt_unlink(conn, stmt);
 
-        // dequeue
-        TAILQ_REMOVE(&evsql->query_queue, query, entry);
-        
-        if (conn) {
-            // try and execute it
-            err = _evsql_query_exec(conn, query, query->command);
-        }
+        stmt->dealloc = 1;
+        TAILQ_INSERT_TAIL(&conn->stmt_dealloc, stmt, lru_entry);
 
-        // free the command buf
-        free(query->command); query->command = NULL;
+        return 0;
+    }
 
-        if (err || !conn) {
-            if (!conn) {
-                // warn when dropping queries
-                WARNING("failing query becuse there are no conns");
-            }
+    if (evpq_deallocate(conn->engine.evpq, stmt->name))
+        return -1;
 
-            // fail the query
-            _evsql_query_fail(evsql, query);
-            
-            if (conn) {
-                // fail the connection
-                WARNING("failing the connection because a query-exec failed");
+    _evsql_stmt_free(conn, stmt);
 
-                _evsql_conn_fail(conn); conn = NULL;
-            }
+    return 0;
+}
+
+/*
+ * Deallocate any statements that were evicted while the conn was in a transaction, which it no longer is.
+ *
+ * Returns nonzero on failure, in which case the conn should be considered as failed.
+ */
+static int _evsql_stmt_flush (struct evsql_conn *conn) {
+    struct evsql_stmt *stmt;
+
+    assert(conn->trans == NULL);
+
+    while ((stmt = TAILQ_FIRST(&conn->stmt_dealloc)) != NULL) {
+        if (evpq_deallocate(conn->engine.evpq, stmt->name))
+            return -1;
+
+        _evsql_stmt_free(conn, stmt);
+    }
+
+    return 0;
+}
+
+/*
+ * Prepare the query_info's statement on the conn. Unless pinned, the least-recently-used statement is evicted if the
+ * cache is full. Pinned statements are those registered using evsql_prepare, and are never evicted.
+ *
+ * Returns NULL on failure, in which case the conn should be considered as failed.
+ */
+static struct evsql_stmt *_evsql_stmt_prepare (struct evsql_conn *conn, const struct evsql_query_info *info, int pinned) {
+    struct evsql_stmt *stmt = NULL;
+    int ret;
+
+    if (!pinned && conn->stmt_count && conn->stmt_count >= conn->evsql->config.stmt_cache) {
+        // evict the least-recently-used one, the queries already sent using it are executed first
+        if (_evsql_stmt_evict(conn, TAILQ_LAST(&conn->stmt_lru, evsql_stmt_list)))
+            goto error;
+    }
+
+    // allocate
+    if ((stmt = _evsql_alloc(&conn->evsql->allocator, sizeof(*stmt))) == NULL)
+        ERROR("_evsql_alloc");
+
+    stmt->info = info;
+    stmt->pinned = pinned;
+
+    if ((stmt->sql = _evsql_strdup(&conn->evsql->allocator, info->sql)) == NULL)
+        ERROR("_evsql_strdup");
+
+    if ((ret = snprintf(stmt->name, sizeof(stmt->name), "evsql_%u", ++conn->stmt_seq)) >= (int) sizeof(stmt->name))
+        ERROR("stmt name overflow: %d", ret);
+
+    // the param types are left for the server to infer, see evsql_config::stmt_cache. evsql_query_info only gives the
+    // binary encoding, not the SQL type, and the NULL params' arbitrary type must not be fixed for later executions
+    if (evpq_prepare(conn->engine.evpq, stmt->name, info->sql, 0, NULL))
+        goto error;
+
+    LIST_INSERT_HEAD(&conn->stmts[_evsql_stmt_hash(info)], stmt, hash_entry);
+
+    if (pinned) {
+        TAILQ_INSERT_TAIL(&conn->stmt_pinned, stmt, lru_entry);
+
+    } else {
+        TAILQ_INSERT_HEAD(&conn->stmt_lru, stmt, lru_entry);
+        conn->stmt_count++;
+    }
+
+    // ok
+    return stmt;
+
+error:
+    if (stmt) {
+        if (stmt->sql)
+            _evsql_free(&conn->evsql->allocator, stmt->sql, strlen(stmt->sql) + 1);
+
+        _evsql_free(&conn->evsql->allocator, stmt, sizeof(*stmt));
+    }
+
+    return NULL;
+}
+
+/*
+ * Get the statement for the query's query_info on the conn, preparing it first if it's registered or the statement
+ * cache is enabled, otherwise *stmt_ptr is left NULL and the query should be sent as-is.
+ *
+ * Returns nonzero on failure, in which case the conn should be considered as failed.
+ */
+static int _evsql_stmt_get (struct evsql_conn *conn, struct evsql_query *query, struct evsql_stmt **stmt_ptr) {
+    const struct evsql_query_info *info = query->info;
+    struct evsql_stmt *stmt;
+    int pinned;
+
+    if ((stmt = _evsql_stmt_find(conn, info)) != NULL) {
+        if (strcmp(stmt->sql, info->sql) == 0) {
+            if (!stmt->pinned) {
+                // most-recently-used first
+                TAILQ_REMOVE(&conn->stmt_lru, stmt, lru_entry);
+                TAILQ_INSERT_HEAD(&conn->stmt_lru, stmt, lru_entry);
+            }
+
+            *stmt_ptr = stmt;
+
+            return 0;
+        }
+
+        // the query_info was reused for some other query
+        if (_evsql_stmt_evict(conn, stmt))
+            goto error;
+    }
+
+    pinned = _evsql_prepared(conn->evsql, info);
+
+    if (!pinned && !conn->evsql->config.stmt_cache) {
+        // not for us
+        *stmt_ptr = NULL;
+
+        return 0;
+    }
+
+    if ((*stmt_ptr = _evsql_stmt_prepare(conn, info, pinned)) == NULL)
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * Prepare all of the statements registered using evsql_prepare on the newly connected conn. These are pipelined, so
+ * any queries sent on the conn afterwards are executed after them.
+ *
+ * Returns nonzero on failure, in which case the conn should be considered as failed.
+ */
+static int _evsql_conn_prepare (struct evsql_conn *conn) {
+    struct evsql *evsql = conn->evsql;
+    struct evsql_prepared *prepared;
+    size_t bucket;
+
+    for (bucket = 0; bucket < EVSQL_STMT_BUCKETS; bucket++) {
+        LIST_FOREACH(prepared, &evsql->prepared[bucket], entry) {
+            if (_evsql_stmt_prepare(conn, prepared->info, 1) == NULL)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Actually execute the given query.
+ *
+ * The backend should be able to accept the query at this time.
+ *
+ * You should assume that if trying to execute a query fails, then the connection should also be considred as failed.
+ */
+static int _evsql_query_exec (struct evsql_conn *conn, struct evsql_query *query, const char *command) {
+    struct evsql_stmt *stmt = NULL;
+    int err;
+
+    DEBUG("evsql.%p: exec query=%p on trans=%p on conn=%p:", conn->evsql, query, conn->trans, conn);
+
+    switch (conn->evsql->type) {
+        case EVSQL_EVPQ:
+            // statements evicted during some earlier transaction can be deallocated now
+            if (!conn->trans && (err = _evsql_stmt_flush(conn)) != 0) {
+                // fail
+
+            // use a prepared statement? streamed queries must be the only ones in flight
+            } else if (query->info && conn->pipeline && !query->row_fn && (err = _evsql_stmt_get(conn, query, &stmt)) != 0) {
+                // fail
+
+            } else if (stmt) {
+                err = evpq_query_prepared(conn->engine.evpq, stmt->name,
+                        query->params.count, 
+                        query->params.values, 
+                        query->params.lengths, 
+                        query->params.formats, 
+                        query->params.result_format
+                    );
+
+            // got params, or want binary results?
+            } else if (query->params.count || query->params.result_format) {
+                err = evpq_query_params(conn->engine.evpq, command,
+                    query->params.count, 
+                    query->params.types, 
+                    query->params.values, 
+                    query->params.lengths, 
+                    query->params.formats, 
+                    query->params.result_format
+                );
+
+            } else {
+                // plain 'ole query
+                err = evpq_query(conn->engine.evpq, command);
+            }
+
+            if (!err && query->row_fn && evpq_query_rows(conn->engine.evpq, query->chunk_rows))
+                // _evsql_evpq_result hands the whole result to row_fn instead
+                WARNING("failed to stream query results, they will be returned all at once");
+
+            if (err) {
+                if (PQstatus(evpq_pgconn(conn->engine.evpq)) != CONNECTION_OK)
+                    WARNING("conn failed");
+                else
+                    WARNING("query failed, dropping conn as well");
+            }
+
+            break;
+        
+        default:
+            FATAL("evsql->type");
+    }
+
+    if (!err) {
+        // assign the query
+        TAILQ_INSERT_TAIL(&conn->queries, query, entry);
+        query->conn = conn;
+        conn->query_depth++;
+        conn->query_count++;
+        conn->evsql->query_depth++;
+
+        _evsql_conn_low_add(conn, query);
+        _evsql_pressure_update(conn->evsql);
+
+        _evsql_conn_update(conn);
+
+        if (conn->state == EVSQL_CONN_PIPELINE && TAILQ_NEXT(conn, entry)) {
+            // round-robin, so that queries get spread out across the pipelined conns
+            TAILQ_REMOVE(&conn->evsql->conn_lists[EVSQL_CONN_PIPELINE], conn, entry);
+            TAILQ_INSERT_TAIL(&conn->evsql->conn_lists[EVSQL_CONN_PIPELINE], conn, entry);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Length of the given param's value, text values are NUL-terminated
+ */
+static size_t _evsql_param_length (const struct evsql_query_params_pq *params, int idx) {
+    if (!params->values[idx])
+        return 0;
+
+    return params->formats[idx] ? (size_t) params->lengths[idx] : strlen(params->values[idx]);
+}
+
+/*
+ * Hash the given query_info and param values for the coalesce table, using FNV-1a
+ */
+static unsigned int _evsql_coalesce_hash (const struct evsql_query_info *query_info, const struct evsql_query_params_pq *params) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *ptr, *end;
+    uintptr_t info = (uintptr_t) query_info;
+    int idx;
+
+    for (ptr = (const unsigned char *) &info, end = ptr + sizeof(info); ptr < end; ptr++)
+        hash = (hash ^ *ptr) * 16777619u;
+
+    for (idx = 0; idx < params->count; idx++) {
+        // NULLs hash differently from empty values
+        hash = (hash ^ (params->values[idx] != NULL)) * 16777619u;
+
+        if (!params->values[idx])
+            continue;
+
+        for (ptr = (const unsigned char *) params->values[idx], end = ptr + _evsql_param_length(params, idx); ptr < end; ptr++)
+            hash = (hash ^ *ptr) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Do the two queries have the same param values?
+ */
+static int _evsql_params_equal (const struct evsql_query_params_pq *a, const struct evsql_query_params_pq *b) {
+    int idx;
+
+    if (a->count != b->count || a->result_format != b->result_format)
+        return 0;
+
+    for (idx = 0; idx < a->count; idx++) {
+        if (a->types[idx] != b->types[idx] || a->formats[idx] != b->formats[idx])
+            return 0;
+
+        if (!a->values[idx] || !b->values[idx]) {
+            if (a->values[idx] != b->values[idx])
+                return 0;
+
+        } else if (_evsql_param_length(a, idx) != _evsql_param_length(b, idx)) {
+            return 0;
+
+        } else if (memcmp(a->values[idx], b->values[idx], _evsql_param_length(a, idx))) {
+            return 0;
+
+        }
+    }
+
+    return 1;
+}
+
+int _evsql_query_coalesce (struct evsql *evsql, struct evsql_query *query, const struct evsql_query_info *query_info) {
+    unsigned int hash = _evsql_coalesce_hash(query_info, &query->params);
+    struct evsql_coalesce_bucket *bucket = &evsql->coalesce[hash % EVSQL_COALESCE_BUCKETS];
+    struct evsql_query *leader;
+
+    LIST_FOREACH(leader, bucket, coalesce_entry) {
+        if (leader->coalesce_hash != hash || leader->coalesce_info != query_info)
+            continue;
+
+        if (!_evsql_params_equal(&leader->params, &query->params))
+            continue;
+
+        DEBUG("evsql.%p: coalescing query=%p with query=%p", evsql, query, leader);
+
+        // wait for its results
+        TAILQ_INSERT_TAIL(&leader->waiters, query, entry);
+        query->leader = leader;
+
+        return 1;
+    }
+
+    // we are the one that others will wait for
+    query->coalesce_info = query_info;
+    query->coalesce_hash = hash;
+
+    LIST_INSERT_HEAD(bucket, query, coalesce_entry);
+
+    return 0;
+}
+
+void _evsql_query_uncoalesce (struct evsql_query *query) {
+    if (!query->coalesce_info)
+        return;
+
+    LIST_REMOVE(query, coalesce_entry);
+    query->coalesce_info = NULL;
+}
+
+int _evsql_query_command_set (struct evsql_query *query, const char *command) {
+    if (query->info && command == query->info->sql) {
+        // static
+        query->command = command;
+
+    } else {
+        // the caller may free it once we return
+        if ((query->command_buf = _evsql_strdup(&query->evsql->allocator, command)) == NULL)
+            ERROR("_evsql_strdup");
+
+        query->command = query->command_buf;
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+void _evsql_query_command_free (struct evsql_query *query) {
+    if (query->command_buf)
+        _evsql_free(&query->evsql->allocator, query->command_buf, strlen(query->command_buf) + 1);
+
+    query->command_buf = NULL;
+
+    query->command = NULL;
+}
+
+void _evsql_query_free (struct evsql_query *query) {
+    struct evsql_query *waiter;
+
+    if (!query)
+        return;
+        
+    assert(query->command == NULL);
+
+    // it can't expire anymore
+    wheel_del(&query->timer);
+
+    // nothing can wait for it anymore
+    _evsql_query_uncoalesce(query);
+
+    // free any identical queries that were waiting for it
+    while ((waiter = TAILQ_FIRST(&query->waiters)) != NULL) {
+        TAILQ_REMOVE(&query->waiters, waiter, entry);
+
+        _evsql_query_free(waiter);
+    }
+    
+    // free params if they didn't fit inline
+    _evsql_free(&query->evsql->allocator, query->params.storage, EVSQL_QUERY_PARAMS_STORAGE(query->params.count));
+
+    // free the batch along with the last query
+    if (query->batch && --query->batch->pending == 0)
+        _evsql_free(&query->evsql->allocator, query->batch, sizeof(*query->batch));
+
+    // free the query itself
+    _evsql_slab_free(&query->evsql->query_slab, query);
+}
+
+/*
+ * One of the batch's queries is done, call the batch's done_fn and free it if this was the last one.
+ */
+static void _evsql_batch_query_done (struct evsql_batch *batch) {
+    if (--batch->pending)
+        return;
+
+    if (batch->done_fn)
+        batch->done_fn(batch, batch->cb_arg);
+
+    _evsql_free(&batch->evsql->allocator, batch, sizeof(*batch));
+}
+
+/*
+ * Execute the callback if res is given, and free the query.
+ *
+ * The query has been aborted, it will simply be freed
+ */
+static void _evsql_query_done (struct evsql_query *query, struct evsql_result *res) {
+    struct evsql_batch *batch = query->batch;
+    struct evsql_query_queue waiters;
+    struct evsql_query *waiter;
+    struct evsql_result shared; ZINIT(shared);
+
+    // we handle the batch and waiters here instead of _evsql_query_free
+    query->batch = NULL;
+
+    TAILQ_INIT(&waiters);
+    TAILQ_CONCAT(&waiters, &query->waiters, entry);
+
+    // they can't be cancelled anymore, but still get the results
+    TAILQ_FOREACH(waiter, &waiters, entry)
+        waiter->leader = NULL;
+
+    // any identical queries from here on will need to be sent again
+    _evsql_query_uncoalesce(query);
+
+    if (res && !TAILQ_EMPTY(&waiters)) {
+        if (res->result.pq) {
+            // share the result
+            if ((res->ref = _evsql_alloc(&query->evsql->allocator, sizeof(*res->ref))) == NULL) {
+                WARNING("_evsql_alloc: failing coalesced queries");
+
+            } else {
+                res->ref->refs = 1;
+
+                TAILQ_FOREACH(waiter, &waiters, entry)
+                    res->ref->refs++;
+            }
+        }
+
+        // the waiters get the result as it was before query_fn got its hands on it
+        shared = *res;
+    }
+
+    if (res) {
+        if (query->cb_fn) {
+            // call the callback
+            query->cb_fn(res, query->cb_arg);
 
         } else {
+            WARNING("supressing cb_fn because query was aborted");
+            
+            // free the results
+            evsql_result_free(res);
+        }
+    }
+
+    // free
+    _evsql_query_free(query);
+
+    // hand the result to each of the waiters
+    while ((waiter = TAILQ_FIRST(&waiters)) != NULL) {
+        TAILQ_REMOVE(&waiters, waiter, entry);
+
+        if (res && shared.result.pq && !shared.ref) {
+            // couldn't share it
+            struct evsql_result failed = { .evsql = shared.evsql, .error = ENOMEM };
+
+            _evsql_query_done(waiter, &failed);
+
+        } else {
+            struct evsql_result copy = shared;
+
+            _evsql_query_done(waiter, res ? &copy : NULL);
+        }
+    }
+
+    if (batch)
+        _evsql_batch_query_done(batch);
+}
+
+/*
+ * XXX:
+ * /
+static void _evsql_destroy (struct evsql *evsql, const struct evsql_result *res) {
+    struct evsql_query *query;
+    
+    // clear the queue
+    while ((query = TAILQ_FIRST(&evsql->query_queue)) != NULL) {
+        _evsql_query_done(query, res);
+        
+        TAILQ_REMOVE(&evsql->query_queue, query, entry);
+    }
+    
+    // free
+    free(evsql);
+}
+*/
+
+/*
+ * The transaction, which has been retried, is now done, so account for it in the retry_stats.
+ */
+static void _evsql_trans_retry_done (struct evsql_trans *trans, int committed) {
+    struct evsql_retry_stats *stats = &trans->evsql->retry_stats;
+    struct timeval now, elapsed;
+
+    if (committed)
+        stats->committed++;
+    else
+        stats->failed++;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(trans->evsql->ev_base, &now);
+
+    timersub(&now, &trans->retry_start, &elapsed);
+    timeradd(&stats->time, &elapsed, &stats->time);
+
+    // only once
+    trans->retries = 0;
+}
+
+/*
+ * Silently drop the queries waiting in the transaction's queue, they were never sent.
+ */
+static void _evsql_trans_drop (struct evsql_trans *trans) {
+    struct evsql_query *query;
+
+    while ((query = TAILQ_FIRST(&trans->queries)) != NULL) {
+        TAILQ_REMOVE(&trans->queries, query, entry);
+        query->trans = NULL;
+
+        _evsql_query_command_free(query);
+        _evsql_query_free(query);
+    }
+}
+
+/*
+ * Free the transaction, it should already be deassociated from the query and conn.
+ */
+static void _evsql_trans_free (struct evsql_trans *trans) {
+    // ensure we don't leak anything
+    assert(trans->conn == NULL);
+    assert(TAILQ_EMPTY(&trans->queries));
+
+    // it can't expire anymore
+    wheel_del(&trans->timer);
+
+    if (trans->ready_pending)
+        // it won't be ready anymore either
+        TAILQ_REMOVE(&trans->evsql->trans_ready, trans, entry);
+
+    if (trans->ev_retry)
+        event_free(trans->ev_retry);
+
+    if (trans->retries)
+        // retried, but not commited
+        _evsql_trans_retry_done(trans, 0);
+    
+    // free
+    _evsql_slab_free(&trans->evsql->trans_slab, trans);
+}
+
+/*
+ * Forget about the conn's cancel query, dropping it from the queue if it hasn't been sent yet.
+ */
+static void _evsql_conn_cancel_drop (struct evsql_conn *conn) {
+    struct evsql_query *cancel = conn->cancel;
+
+    conn->cancel = NULL;
+
+    if (!cancel->conn) {
+        // still queued
+        _evsql_queue_remove(conn->evsql, cancel);
+
+        _evsql_query_command_free(cancel);
+        _evsql_query_free(cancel);
+
+    } else {
+        // it's harmless once the conn is gone
+        cancel->cb_fn = NULL;
+    }
+}
+
+/*
+ * Release a connection. It should already be deassociated from the trans and queries.
+ *
+ * Releases the engine, removes from the conn list and frees this.
+ */
+static void _evsql_conn_release (struct evsql_conn *conn) {
+    // ensure we don't leak anything
+    assert(conn->trans == NULL);
+    assert(TAILQ_EMPTY(&conn->queries));
+
+    if (conn->low_depth)
+        // its queries were taken over by _evsql_conn_fail
+        conn->evsql->low_conns--;
+
+    if (conn->cancel)
+        _evsql_conn_cancel_drop(conn);
+
+    // the statements go along with the conn
+    while (!TAILQ_EMPTY(&conn->stmt_lru))
+        _evsql_stmt_free(conn, TAILQ_FIRST(&conn->stmt_lru));
+
+    while (!TAILQ_EMPTY(&conn->stmt_pinned))
+        _evsql_stmt_free(conn, TAILQ_FIRST(&conn->stmt_pinned));
+
+    while (!TAILQ_EMPTY(&conn->stmt_dealloc))
+        _evsql_stmt_free(conn, TAILQ_FIRST(&conn->stmt_dealloc));
+
+    // it can't expire anymore
+    wheel_del(&conn->timer);
+
+    // release the engine
+    switch (conn->evsql->type) {
+        case EVSQL_EVPQ:
+            evpq_release(conn->engine.evpq);
+            break;
+        
+        default:
+            FATAL("evsql->type");
+    }
+    
+    // remove from list
+    TAILQ_REMOVE(&conn->evsql->conn_lists[conn->state], conn, entry);
+    conn->evsql->conn_counts[conn->state]--;
+    conn->evsql->conn_count--;
+
+    if (!conn->connected)
+        conn->evsql->conn_connecting--;
+
+    // free
+    _evsql_slab_free(&conn->evsql->conn_slab, conn);
+}
+
+/*
+ * Release a transaction, it should already be deassociated from the query.
+ *
+ * Perform a two-way-deassociation with the conn, and then free the trans.
+ */
+static void _evsql_trans_release (struct evsql_trans *trans) {
+    struct evsql_conn *conn = trans->conn;
+
+    assert(conn != NULL);
+    assert(TAILQ_EMPTY(&conn->queries));
+
+    // deassociate the conn
+    conn->trans = NULL; trans->conn = NULL;
+
+    _evsql_conn_update(conn);
+
+    // free the trans
+    _evsql_trans_free(trans);
+}
+
+/*
+ * Fail a single query with the given error code, this will trigger the callback and free it.
+ *
+ * NOTE: Only for *TRANSACTIONLESS* queries.
+ */
+static void _evsql_query_fail (struct evsql* evsql, struct evsql_query *query, err_t err) {
+    struct evsql_result res; ZINIT(res);
+    
+    // set up the result_info
+    res.evsql = evsql;
+    res.error = err;
+    
+    // finish off the query
+    _evsql_query_done(query, &res);
+}
+
+/*
+ * Remove a transaction from the trans_queue, it will not have a conn yet.
+ */
+static void _evsql_trans_dequeue (struct evsql_trans *trans) {
+    assert(trans->conn == NULL);
+
+    TAILQ_REMOVE(&trans->evsql->trans_queue, trans, entry);
+    trans->evsql->trans_queue_len--;
+}
+
+/*
+ * Fail a transaction, this will silently drop any queries, trigger the error callback, two-way-deassociate/release the
+ * conn, and then free the trans.
+ *
+ * A transaction that is still waiting for a conn must already have been removed from the trans_queue.
+ */ 
+static void _evsql_trans_fail (struct evsql_trans *trans) {
+    struct evsql_query *query;
+
+    _evsql_trans_drop(trans);
+
+    while (trans->conn && (query = TAILQ_FIRST(&trans->conn->queries)) != NULL) {
+        // deassociate it from the conn
+        TAILQ_REMOVE(&trans->conn->queries, query, entry);
+        trans->conn->query_depth--;
+        trans->evsql->query_depth--;
+
+        // and free the query silently
+        _evsql_query_free(query);
+    }
+
+    _evsql_pressure_update(trans->evsql);
+
+    // tell the user
+    // XXX: trans is in a bad state during this call
+    if (trans->error_fn)
+        trans->error_fn(trans, trans->cb_arg);
+    else
+        WARNING("supressing error because error_fn was NULL");
+ 
+    if (trans->conn) {
+        // deassociate and release the conn
+        trans->conn->trans = NULL; _evsql_conn_release(trans->conn); trans->conn = NULL;
+
+        // make sure nothing was left waiting for this connection
+        _evsql_pool_lost(trans->evsql);
+    }
+
+    // free the trans
+    _evsql_trans_free(trans);
+}
+
+/*
+ * Fail a connection. If the connection is transactional, this will just call _evsql_trans_fail, but otherwise it will
+ * release the connection, and then fail any queries that were in flight on it.
+ *
+ * If we are reconnecting, and the connection failed before it was established, then a transaction waiting for it is
+ * put back into the trans_queue instead, as it hasn't sent anything yet.
+ */
+static void _evsql_conn_fail (struct evsql_conn *conn) {
+    struct evsql *evsql = conn->evsql;
+
+    if (!conn->connected)
+        // back off further
+        evsql->reconnect_attempt++;
+
+    if (conn->trans && !conn->connected && evsql->ev_reconnect) {
+        struct evsql_trans *trans = conn->trans;
+
+        // deassociate and requeue the trans, in front of the others
+        trans->conn = NULL; conn->trans = NULL;
+
+        TAILQ_INSERT_HEAD(&evsql->trans_queue, trans, entry);
+        evsql->trans_queue_len++;
+
+        // finish off the whole connection
+        _evsql_conn_release(conn);
+
+        // and wait for a new one
+        _evsql_pool_lost(evsql);
+
+    } else if (conn->trans) {
+        // let transactions handle their connection failures
+        _evsql_trans_fail(conn->trans);
+
+    } else {
+        struct evsql_conn_queries queries;
+        struct evsql_query *query;
+
+        // take over the in-progress queries, so that their callbacks won't see this conn
+        TAILQ_INIT(&queries);
+        TAILQ_CONCAT(&queries, &conn->queries, entry);
+        evsql->query_depth -= conn->query_depth;
+        conn->query_depth = 0;
+
+        _evsql_pressure_update(evsql);
+
+        // finish off the whole connection
+        _evsql_conn_release(conn);
+
+        // fail the in-progress queries
+        while ((query = TAILQ_FIRST(&queries)) != NULL) {
+            TAILQ_REMOVE(&queries, query, entry);
+
+            _evsql_query_fail(evsql, query, query->timed_out ? ETIMEDOUT : EIO);
+        }
+
+        // make sure nothing was left waiting for this connection
+        _evsql_pool_lost(evsql);
+
+        _evsql_queue_low_kick(evsql);
+    }
+}
+
+/*
+ * Has the given queued query's deadline passed?
+ */
+static int _evsql_query_expired (struct evsql *evsql, struct evsql_query *query) {
+    struct timeval now;
+
+    if (!timerisset(&query->deadline))
+        return 0;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &now);
+
+    return !timercmp(&now, &query->deadline, <);
+}
+
+/*
+ * Fail any queued queries whose deadline has passed.
+ */
+static void _evsql_queue_expire (struct evsql *evsql) {
+    struct evsql_query *query, *next;
+    enum evsql_priority priority;
+
+    for (priority = 0; priority < EVSQL_PRIORITY_MAX; priority++) for (query = TAILQ_FIRST(&evsql->query_queues[priority]); query; query = next) {
+        next = TAILQ_NEXT(query, entry);
+
+        if (!_evsql_query_expired(evsql, query))
+            continue;
+
+        _evsql_queue_remove(evsql, query);
+
+        // free the command buf
+        _evsql_query_command_free(query);
+        
+        WARNING("failing query because it waited in the queue for too long");
+
+        evsql->queue_stats.expired++;
+
+        _evsql_query_fail(evsql, query, ETIMEDOUT);
+    }
+}
+
+int _evsql_query_deadline (struct evsql_query *query, const struct timeval *deadline) {
+    struct evsql *evsql = query->evsql;
+    const struct timeval *timeout = timerisset(&query->timeout) ? &query->timeout : &evsql->config.query_timeout;
+    struct timeval now, left;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &now);
+
+    if (!timercmp(&now, deadline, <)) {
+        // no point in even trying
+        errno = ETIMEDOUT;
+
+        return -1;
+    }
+
+    // for the queue
+    query->deadline = *deadline;
+
+    // and once sent
+    timersub(deadline, &now, &left);
+
+    if (!timerisset(timeout) || timercmp(&left, timeout, <))
+        query->timeout = left;
+
+    return 0;
+}
+
+/*
+ * The query's query_timeout expired.
+ *
+ * Queued queries are simply failed. Otherwise, the query can't be cancelled without blocking, so its conn, or its
+ * transaction, is failed instead.
+ */
+static void _evsql_query_timeout (struct wheel_timer *timer, void *arg) {
+    struct evsql_query *query = arg;
+    struct evsql *evsql = query->evsql;
+
+    (void) timer;
+
+    if (query->trans) {
+        WARNING("failing transaction because its query timed out");
+
+        _evsql_trans_fail(query->trans);
+
+    } else if (!query->conn) {
+        // still in the queue
+        _evsql_queue_remove(evsql, query);
+
+        // free the command buf
+        _evsql_query_command_free(query);
+
+        WARNING("failing query because it timed out in the queue");
+
+        evsql->queue_stats.expired++;
+
+        _evsql_query_fail(evsql, query, ETIMEDOUT);
+
+    } else if (query->conn->trans) {
+        WARNING("failing transaction because its query timed out");
+
+        _evsql_trans_fail(query->conn->trans);
+
+    } else {
+        WARNING("failing the connection because a query timed out");
+
+        // the other queries in flight on it get EIO
+        query->timed_out = 1;
+
+        _evsql_conn_fail(query->conn);
+    }
+}
+
+/*
+ * Start the query's query_timeout, if it has one, now that it has been sent or queued.
+ */
+static void _evsql_query_timer_start (struct evsql *evsql, struct evsql_query *query) {
+    const struct timeval *timeout = timerisset(&query->timeout) ? &query->timeout : &evsql->config.query_timeout;
+
+    if (!timerisset(timeout))
+        return;
+
+    if (wheel_add(evsql->wheel, &query->timer, timeout))
+        WARNING("wheel_add: query will not time out");
+}
+
+/*
+ * The transaction's trans_timeout expired, so fail it, whether it has a conn yet or not.
+ */
+static void _evsql_trans_timeout (struct wheel_timer *timer, void *arg) {
+    struct evsql_trans *trans = arg;
+
+    (void) timer;
+
+    WARNING("failing transaction because it timed out");
+
+    if (!trans->conn)
+        // still waiting for a conn
+        _evsql_trans_dequeue(trans);
+
+    _evsql_trans_fail(trans);
+}
+
+/*
+ * The conn's connect_timeout expired before it was connected, so fail it as if the connection attempt had failed.
+ */
+static void _evsql_conn_timeout (struct wheel_timer *timer, void *arg) {
+    struct evsql_conn *conn = arg;
+
+    (void) timer;
+
+    WARNING("failing the connection because connecting timed out");
+
+    _evsql_conn_fail(conn);
+}
+
+/*
+ * Put the idle conn into pipeline mode, so that queries can be sent without waiting for the earlier ones to complete.
+ *
+ * Returns nonzero if this isn't possible, in which case the conn can still be used one query at a time.
+ */
+static int _evsql_conn_pipeline (struct evsql_conn *conn) {
+    if (conn->pipeline)
+        return 0;
+
+    switch (conn->evsql->type) {
+        case EVSQL_EVPQ:
+#ifdef LIBPQ_HAS_PIPELINING
+            if (evpq_pipeline(conn->engine.evpq))
+                return -1;
+
+            conn->pipeline = 1;
+
+            return 0;
+#else
+            return -1;
+#endif
+
+        default:
+            FATAL("evsql->type");
+    }
+}
+
+/*
+ * Hold back queries sent on the pipelined conn, or send all of the held back queries at once.
+ *
+ * Returns nonzero on failure, in which case the connection should be considered as failed.
+ */
+static int _evsql_conn_cork (struct evsql_conn *conn, int cork) {
+    switch (conn->evsql->type) {
+        case EVSQL_EVPQ:
+            return cork ? evpq_cork(conn->engine.evpq) : evpq_uncork(conn->engine.evpq);
+
+        default:
+            FATAL("evsql->type");
+    }
+}
+
+/*
+ * Have the next query share its pipeline sync with the query after it, so that it isn't executed if the first fails.
+ *
+ * Returns nonzero on failure.
+ */
+static int _evsql_conn_chain (struct evsql_conn *conn) {
+    switch (conn->evsql->type) {
+        case EVSQL_EVPQ:
+            return evpq_chain(conn->engine.evpq);
+
+        default:
+            FATAL("evsql->type");
+    }
+}
+
+/*
+ * Processes enqueued non-transactional queries until the queue is empty, or the conn can't take any more queries.
+ *
+ * The queries are taken from the priority queues as given by _evsql_queue_next. The queries of a batch are sent
+ * together on a pipelined conn, even if they go past the pipeline_depth.
+ *
+ * If execing a query on a connection fails, both the query and the connection are failed (in that order). The rest of
+ * the queue is left in place, for _evsql_pool_lost to hand to some other conn, or to the reconnect timer.
+ *
+ * If conn is NULL, all queries are failed. This is used once there is no conn left that could pump
+ * the queue, and reconnecting is disabled.
+ *
+ * Queries whose deadline has passed are failed without being sent.
+ *
+ * Waiting transactions are not handled here, see _evsql_conn_idle.
+ */
+static void _evsql_pump (struct evsql *evsql, struct evsql_conn *conn) {
+    struct evsql_query *query;
+    struct evsql_batch *batch = NULL;
+    enum evsql_priority priority = EVSQL_PRIORITY_NORMAL;
+    int corked = 0;
+    int err;
+    
+    // look for waiting queries, the rest of a corked batch goes first
+    while ((query = corked ? TAILQ_FIRST(&evsql->query_queues[priority]) : _evsql_queue_next(evsql, conn)) != NULL) {
+        // zero err
+        err = 0;
+
+        if (corked && query->batch != batch) {
+            // that was the end of the batch, so send it off, and go back to the usual order
+            corked = 0;
+
+            if (_evsql_conn_cork(conn, 0)) {
+                // the batch was already handed to the conn, so it fails with it
+                WARNING("failing the connection because sending a batch failed");
+
+                _evsql_conn_fail(conn);
+
+                return;
+            }
+
+            if (conn->state != EVSQL_CONN_PIPELINE)
+                // no room left
+                break;
+
+            continue;
+        }
+
+        if (conn && query->row_fn && conn->query_depth)
+            // wait for the conn to finish its other queries first
+            break;
+
+        // dequeue
+        _evsql_queue_remove(evsql, query);
+
+        if (_evsql_query_expired(evsql, query)) {
+            // don't bother sending it anymore
+            _evsql_query_command_free(query);
+            
+            WARNING("failing query because it waited in the queue for too long");
+
+            evsql->queue_stats.expired++;
+
+            _evsql_query_fail(evsql, query, ETIMEDOUT);
+
+            continue;
+        }
+        
+        if (conn && query->batch && conn->pipeline && !corked) {
+            // send the whole batch at once
+            err = _evsql_conn_cork(conn, 1);
+            corked = 1;
+            batch = query->batch;
+            priority = query->priority;
+        }
+
+        if (conn && !err) {
+            // try and execute it
+            err = _evsql_query_exec(conn, query, query->command);
+        }
+
+        // free the command buf
+        _evsql_query_command_free(query);
+
+        if (err || !conn) {
+            if (!conn) {
+                // warn when dropping queries
+                WARNING("failing query becuse there are no conns");
+            }
+
+            // fail the query
+            _evsql_query_fail(evsql, query, EIO);
+            
+            if (conn) {
+                // fail the connection, the rest of the queue is handled by _evsql_pool_lost
+                WARNING("failing the connection because a query-exec failed");
+
+                _evsql_conn_fail(conn);
+
+                return;
+            }
+
+        } else if (corked) {
+            // keep the batch together, it is sent off once the next query isn't part of it
+            continue;
+
+        } else if (conn->state != EVSQL_CONN_PIPELINE) {
             // we have succesfully enqueued a query, and we can wait for this connection to complete
             break;
 
-        }
+        }
+
+        // handle the rest of the queue
+    }
+
+    if (corked && _evsql_conn_cork(conn, 0)) {
+        // the batch was at the end of its queue
+        WARNING("failing the connection because sending a batch failed");
+
+        _evsql_conn_fail(conn);
+    }
+    
+    // ok
+    return;
+}
+
+/*
+ * Is the connection pool at its max_conns limit?
+ */
+static int _evsql_pool_full (struct evsql *evsql) {
+    return evsql->config.max_conns && evsql->conn_count >= evsql->config.max_conns;
+}
+
+/*
+ * Should the given connection be closed once it's idle, because it's too old or has executed too many queries?
+ */
+static int _evsql_conn_expired (struct evsql_conn *conn, const struct timeval *now) {
+    const struct evsql_config *config = &conn->evsql->config;
+    struct timeval expire;
+    
+    if (conn->retire)
+        return 1;
+
+    if (config->max_queries && conn->query_count >= config->max_queries)
+        return 1;
+
+    if (timerisset(&config->max_lifetime)) {
+        timeradd(&conn->created, &config->max_lifetime, &expire);
+
+        if (!timercmp(now, &expire, <))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The idle connection is being closed, because it's expired or has been idle for too long. Make sure that anything
+ * that was waiting for it gets a new one.
+ */
+static void _evsql_conn_retire (struct evsql_conn *conn) {
+    struct evsql *evsql = conn->evsql;
+
+    assert(conn->state == EVSQL_CONN_IDLE);
+
+    DEBUG("evsql.%p: retiring conn=%p after %zu queries", evsql, conn, conn->query_count);
+
+    _evsql_conn_release(conn);
+
+    // replace it, if something is waiting
+    if (_evsql_pool_open(evsql))
+        _evsql_pool_lost(evsql);
+
+    else if (evsql->config.min_idle)
+        _evsql_pool_fill(evsql);
+}
+
+/*
+ * The given connection is ready and no longer used by any trans/query, so hand it to whatever is waiting for a
+ * connection.
+ *
+ * Waiting transactions are admitted first, in the order that they were created. Otherwise, pump any waiting
+ * transactionless queries. A pipelined conn that still has queries in flight can't take a transaction, but can pump
+ * queries.
+ *
+ * The conn may already have been taken into use again by some callback, in which case this does nothing. Expired
+ * conns are closed here instead, now that they have finished whatever they were doing.
+ */
+static void _evsql_conn_idle (struct evsql_conn *conn) {
+    struct evsql *evsql = conn->evsql;
+    struct evsql_trans *trans;
+
+    if (conn->state == EVSQL_CONN_PIPELINE) {
+        // fill up the pipeline again
+        _evsql_pump(evsql, conn);
+
+        return;
+    }
+
+    if (conn->state != EVSQL_CONN_IDLE)
+        return;
+
+    if (_evsql_conn_expired(conn, &conn->idle_since)) {
+        _evsql_conn_retire(conn);
+
+        return;
+    }
+
+    if ((trans = TAILQ_FIRST(&evsql->trans_queue)) != NULL) {
+        // admit the transaction
+        _evsql_trans_dequeue(trans);
+
+        // associate the conn
+        _evsql_conn_attach(conn, trans);
+
+        // send the BEGIN, this will handle failures itself
+        (void) _evsql_trans_conn_ready(evsql, trans);
+
+    } else {
+        // pump any waiting transactionless queries
+        _evsql_pump(evsql, conn);
+
+    }
+}
+
+/*
+ * Does the query queue have some connection that will pump it at some point?
+ *
+ * That's either some non-transaction conn, or a transaction conn once it is released, as long as the pool is full.
+ */
+static int _evsql_queue_pumpable (struct evsql *evsql) {
+    if (evsql->conn_count > evsql->conn_counts[EVSQL_CONN_TRANS])
+        return 1;
+
+    return evsql->conn_count && _evsql_pool_full(evsql);
+}
+
+/*
+ * Returns the number of new conns that must still be opened for the prewarm set to be established, taking into account
+ * the conns that are still connecting.
+ */
+static size_t _evsql_warm_missing (struct evsql *evsql) {
+    size_t count = evsql->warm_count + evsql->conn_connecting;
+
+    if (evsql->warm_done)
+        return 0;
+
+    return count < evsql->config.prewarm_ready ? evsql->config.prewarm_ready - count : 0;
+}
+
+/*
+ * A new conn was established, call the ready_fn once enough of them have been.
+ */
+static void _evsql_warm_connected (struct evsql *evsql) {
+    if (evsql->warm_done || ++evsql->warm_count < evsql->config.prewarm_ready)
+        return;
+
+    evsql->warm_done = 1;
+
+    if (evsql->config.ready_fn)
+        evsql->config.ready_fn(evsql, evsql->cb_arg);
+}
+
+/*
+ * Open new conns for waiting transactions, and for the query queue if needed, as far as the pool has room for them.
+ *
+ * Returns nonzero if some new conn could not be opened, the transaction that it was for is left in the trans_queue.
+ */
+static int _evsql_pool_open (struct evsql *evsql) {
+    struct evsql_trans *trans;
+    struct evsql_conn *conn;
+
+    // open new conns for waiting transactions
+    while ((trans = TAILQ_FIRST(&evsql->trans_queue)) != NULL && !_evsql_pool_full(evsql)) {
+        if ((conn = _evsql_conn_new(evsql)) == NULL)
+            return -1;
+        
+        // associate the conn, the BEGIN is sent once it's connected
+        _evsql_trans_dequeue(trans);
+
+        _evsql_conn_attach(conn, trans);
+    }
+
+    // and one for the query queue
+    if (evsql->queue_len && !_evsql_queue_pumpable(evsql)) {
+        if (_evsql_conn_new(evsql) == NULL)
+            return -1;
+    }
+
+    // and replacements for failed prewarm conns
+    while (_evsql_warm_missing(evsql) && !_evsql_pool_full(evsql)) {
+        if (_evsql_conn_new(evsql) == NULL)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Schedule the reconnect timer, unless it's already pending. The delay grows exponentially with the number of failed
+ * attempts, with some random jitter to avoid all clients reconnecting at the same time.
+ */
+static void _evsql_reconnect_schedule (struct evsql *evsql) {
+    const struct timeval *tv_min = &evsql->config.reconnect_min, *tv_max = &evsql->config.reconnect_max;
+    uint64_t delay_min, delay_max, delay;
+    struct timeval tv;
+
+    if (evtimer_pending(evsql->ev_reconnect, NULL))
+        return;
+
+    delay_min = (uint64_t) tv_min->tv_sec * 1000000 + tv_min->tv_usec;
+    delay_max = timerisset(tv_max) ? (uint64_t) tv_max->tv_sec * 1000000 + tv_max->tv_usec : delay_min;
+
+    // exponential backoff
+    delay = delay_min << MIN(evsql->reconnect_attempt, 24);
+    delay = MIN(delay, MAX(delay_min, delay_max));
+
+    // jitter
+    delay = delay / 2 + random() % (delay / 2 + 1);
+
+    tv.tv_sec = delay / 1000000;
+    tv.tv_usec = delay % 1000000;
+
+    DEBUG("evsql.%p: reconnect attempt %u in %lu.%06lus", evsql, evsql->reconnect_attempt, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_usec);
+
+    if (evtimer_add(evsql->ev_reconnect, &tv))
+        WARNING("evtimer_add: failed to schedule reconnect");
+}
+
+/*
+ * The reconnect timer has expired, so fail any queries that have waited for too long, and try opening new conns for
+ * whatever is still waiting.
+ */
+static void _evsql_reconnect_event (evutil_socket_t fd, short what, void *arg) {
+    struct evsql *evsql = arg;
+
+    (void) fd;
+    (void) what;
+
+    _evsql_queue_expire(evsql);
+
+    if (_evsql_pool_open(evsql)) {
+        WARNING("failed to open a new conn, retrying later");
+
+        evsql->reconnect_attempt++;
+
+        _evsql_reconnect_schedule(evsql);
+    }
+}
+
+/*
+ * A connection was released after failing, so make sure that nothing that was waiting for it will deadlock.
+ *
+ * Queued queries are first handed to any idle conn.
+ *
+ * If reconnecting is enabled, then anything left waiting without a conn will wait for the reconnect timer, including
+ * the prewarm set.
+ *
+ * Otherwise, waiting transactions get new connections if the pool now has room for them, and queued queries that
+ * can't be pumped anymore are failed. If the prewarm set can't be established anymore, the evsql's error_fn is called.
+ */
+static void _evsql_pool_lost (struct evsql *evsql) {
+    struct evsql_trans *trans;
+    struct evsql_conn *conn;
+
+    if (evsql->queue_len && (conn = TAILQ_FIRST(&evsql->conn_lists[EVSQL_CONN_IDLE])) != NULL)
+        // some other conn can take over the queue right away
+        _evsql_pump(evsql, conn);
+
+    if (evsql->ev_reconnect) {
+        // is anything left waiting?
+        if ((!TAILQ_EMPTY(&evsql->trans_queue) && !_evsql_pool_full(evsql))
+            || (evsql->queue_len && !_evsql_queue_pumpable(evsql))
+            || _evsql_warm_missing(evsql)
+        )
+            _evsql_reconnect_schedule(evsql);
+
+        return;
+    }
+
+    if (_evsql_warm_missing(evsql)) {
+        // give up on it
+        evsql->warm_done = 1;
+
+        if (evsql->error_fn)
+            evsql->error_fn(evsql, evsql->cb_arg);
+        else
+            WARNING("supressing error because error_fn was NULL");
+    }
+
+    // open new conns for waiting transactions, failing them if we can't
+    while ((trans = TAILQ_FIRST(&evsql->trans_queue)) != NULL && !_evsql_pool_full(evsql)) {
+        _evsql_trans_dequeue(trans);
+
+        if ((conn = _evsql_conn_new(evsql)) == NULL) {
+            WARNING("failing waiting transaction because a new conn could not be opened");
+
+            _evsql_trans_fail(trans);
+
+            continue;
+        }
+        
+        // associate the conn, the BEGIN is sent once it's connected
+        _evsql_conn_attach(conn, trans);
+    }
+    
+    if (evsql->queue_len && !_evsql_queue_pumpable(evsql))
+        // fail them all
+        _evsql_pump(evsql, NULL);
+}
+
+/*
+ * Open new connections until there are at least min_idle idle ones, or the pool is full.
+ */
+static void _evsql_pool_fill (struct evsql *evsql) {
+    // count the idle conns, including those that are still connecting
+    size_t idle = evsql->conn_counts[EVSQL_CONN_IDLE] + evsql->conn_counts[EVSQL_CONN_CONNECTING];
+    
+    for (; idle < evsql->config.min_idle && !_evsql_pool_full(evsql); idle++) {
+        if (_evsql_conn_new(evsql) == NULL) {
+            WARNING("failed to open a new conn for the pool");
+
+            break;
+        }
+    }
+}
+
+/*
+ * Periodic maintenance for the pool. Conns that have been idle for longer than idle_timeout are closed, starting from
+ * the least-recently-used ones, as long as there are more than min_idle conns left. Idle conns that have expired are
+ * also closed, and busy ones will be closed once they become idle.
+ */
+static void _evsql_maintain_event (evutil_socket_t fd, short what, void *arg) {
+    struct evsql *evsql = arg;
+    struct evsql_conn *conn, *next, *prev;
+    enum evsql_conn_state state;
+    struct timeval now, idle_until;
+
+    (void) fd;
+    (void) what;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &now);
+
+    // mark expired conns, pipelined ones will stop taking on new queries
+    for (state = 0; state < EVSQL_CONN_STATE_MAX; state++) {
+        for (conn = TAILQ_FIRST(&evsql->conn_lists[state]); conn; conn = next) {
+            next = TAILQ_NEXT(conn, entry);
+
+            if (!conn->retire && _evsql_conn_expired(conn, &now)) {
+                conn->retire = 1;
+
+                _evsql_conn_update(conn);
+            }
+        }
+    }
+
+    // close idle ones, oldest first
+    for (conn = TAILQ_LAST(&evsql->conn_lists[EVSQL_CONN_IDLE], evsql_conn_list); conn; conn = prev) {
+        prev = TAILQ_PREV(conn, evsql_conn_list, entry);
+
+        if (!conn->retire) {
+            if (!timerisset(&evsql->config.idle_timeout))
+                continue;
+
+            if (evsql->conn_counts[EVSQL_CONN_IDLE] + evsql->conn_counts[EVSQL_CONN_CONNECTING] <= evsql->config.min_idle)
+                continue;
+
+            timeradd(&conn->idle_since, &evsql->config.idle_timeout, &idle_until);
+
+            if (timercmp(&now, &idle_until, <))
+                continue;
+        }
+
+        _evsql_conn_retire(conn);
+
+        // callbacks for failed queries may have taken conns into use
+        if (prev && prev->state != EVSQL_CONN_IDLE)
+            break;
+    }
+}
+
+/*
+ * The transaction is now ready for use, so call its ready_fn, or the replay_fn if it's being retried.
+ */
+static void _evsql_trans_call_ready (struct evsql_trans *trans) {
+    if (trans->replaying) {
+        trans->replaying = 0;
 
-        // handle the rest of the queue
+        trans->replay_fn(trans, trans->cb_arg);
+
+    } else {
+        trans->ready_fn(trans, trans->cb_arg);
     }
-    
-    // ok
-    return;
 }
 
 /*
@@ -316,23 +1898,48 @@ static void _evsql_trans_ready (struct evsql_result *res, void *arg) {
     if (res->error)
         ERROR("transaction 'BEGIN' failed: %s", evsql_result_error(res));
     
+    evsql_result_free(res);
+
     // transaction is now ready for use
-    trans->ready_fn(trans, trans->cb_arg);
+    _evsql_trans_call_ready(trans);
     
     // good
     return;
 
 error:
+    evsql_result_free(res);
+
     _evsql_trans_fail(trans);
 }
 
 /*
- * The transaction's connection is ready, send the 'BEGIN' query.
+ * Callback for a trans's 'BEGIN' query that was sent along with its first query. The query was not executed if this
+ * failed.
+ */
+static void _evsql_trans_begun (struct evsql_result *res, void *arg) {
+    struct evsql_trans *trans = arg;
+
+    // check for errors
+    if (res->error)
+        ERROR("transaction 'BEGIN' failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    // the query's results are next
+    return;
+
+error:
+    evsql_result_free(res);
+
+    _evsql_trans_fail(trans);
+}
+
+/*
+ * Build the 'BEGIN' query for the given transaction into the given EVSQL_QUERY_BEGIN_BUF-sized buffer.
  *
- * If anything fails, calls _evsql_trans_fail and returns nonzero, zero on success
+ * Returns zero on success, nonzero on error.
  */
-static int _evsql_trans_conn_ready (struct evsql *evsql, struct evsql_trans *trans) {
-    char trans_sql[EVSQL_QUERY_BEGIN_BUF];
+static int _evsql_trans_begin_sql (struct evsql_trans *trans, char *trans_sql) {
     const char *isolation_level;
     int ret;
     
@@ -366,6 +1973,169 @@ static int _evsql_trans_conn_ready (struct evsql *evsql, struct evsql_trans *tra
     // make sure it wasn't truncated
     if (ret >= EVSQL_QUERY_BEGIN_BUF)
         ERROR("trans_sql overflow: %d >= %d", ret, EVSQL_QUERY_BEGIN_BUF);
+
+    // success
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * Send a query for the transaction on its conn.
+ *
+ * If the 'BEGIN' query is still pending, it is sent first, in the same pipeline sync as the query, so that the query
+ * won't be executed if the BEGIN fails.
+ *
+ * Returns nonzero on failure, in which case the trans must be failed. The query is then left to the caller.
+ */
+static int _evsql_trans_send (struct evsql_trans *trans, struct evsql_query *query, const char *command) {
+    struct evsql_conn *conn = trans->conn;
+    struct evsql_query *begin = NULL;
+    char trans_sql[EVSQL_QUERY_BEGIN_BUF];
+
+    if (trans->begin_pending) {
+        if (_evsql_trans_begin_sql(trans, trans_sql))
+            goto error;
+
+        if ((begin = _evsql_query_new(trans->evsql, NULL, _evsql_trans_begun, trans)) == NULL)
+            goto error;
+
+        // hold it back until the query has been sent as well, and don't run the query outside of the transaction if
+        // the BEGIN fails
+        if (_evsql_conn_cork(conn, 1) || _evsql_conn_chain(conn))
+            ERROR("failed to cork the conn for 'BEGIN'");
+
+        if (_evsql_query_exec(conn, begin, trans_sql))
+            goto error;
+
+        // _evsql_trans_fail takes care of it from here on
+        begin = NULL;
+        trans->begin_pending = 0;
+
+        if (_evsql_query_exec(conn, query, command))
+            goto error;
+
+        if (_evsql_conn_cork(conn, 0)) {
+            // leave it to the caller
+            TAILQ_REMOVE(&conn->queries, query, entry);
+            conn->query_depth--;
+            conn->evsql->query_depth--;
+            query->conn = NULL;
+
+            _evsql_pressure_update(conn->evsql);
+
+            ERROR("failed to send 'BEGIN'");
+        }
+
+    } else if (_evsql_query_exec(conn, query, command)) {
+        goto error;
+
+    }
+
+    // success
+    return 0;
+
+error:
+    _evsql_query_free(begin);
+
+    return -1;
+}
+
+/*
+ * Execute a query for the transaction. On a pipelined conn, it is sent right away, behind any earlier queries,
+ * otherwise it waits in the transaction's queue until the earlier ones have completed, see _evsql_trans_pump.
+ *
+ * Returns nonzero on failure, in which case the trans must be failed. The query is then left to the caller.
+ */
+static int _evsql_trans_exec (struct evsql_trans *trans, struct evsql_query *query, const char *command) {
+    if (trans->conn->pipeline || (!trans->conn->query_depth && TAILQ_EMPTY(&trans->queries)))
+        return _evsql_trans_send(trans, query, command);
+
+    // keep the command for later execution
+    if (_evsql_query_command_set(query, command))
+        return -1;
+
+    TAILQ_INSERT_TAIL(&trans->queries, query, entry);
+    query->trans = trans;
+
+    return 0;
+}
+
+/*
+ * The transaction's conn has completed its query, so send the next one waiting in the transaction's queue, if any.
+ *
+ * Returns nonzero on failure, in which case the trans must be failed.
+ */
+static int _evsql_trans_pump (struct evsql_trans *trans) {
+    struct evsql_query *query;
+    int err;
+
+    if ((query = TAILQ_FIRST(&trans->queries)) == NULL)
+        return 0;
+
+    TAILQ_REMOVE(&trans->queries, query, entry);
+    query->trans = NULL;
+
+    err = _evsql_trans_send(trans, query, query->command);
+
+    // free the command buf
+    _evsql_query_command_free(query);
+
+    if (err)
+        // it's not in flight, so nobody else will
+        _evsql_query_free(query);
+
+    return err;
+}
+
+/*
+ * Call ready_fn for the transactions that were given a pipelined conn.
+ */
+static void _evsql_trans_ready_event (evutil_socket_t fd, short what, void *arg) {
+    struct evsql *evsql = arg;
+    struct evsql_trans *trans;
+
+    (void) fd;
+    (void) what;
+
+    // ready_fn may start new transactions, these will be handled as well
+    while ((trans = TAILQ_FIRST(&evsql->trans_ready)) != NULL) {
+        TAILQ_REMOVE(&evsql->trans_ready, trans, entry);
+        trans->ready_pending = 0;
+
+        _evsql_trans_call_ready(trans);
+    }
+}
+
+/*
+ * The transaction's connection is ready, send the 'BEGIN' query.
+ *
+ * If the conn is in pipeline mode, as configured using pipeline_depth or the statement cache, the transaction's queries
+ * can be sent without waiting for the earlier ones. The BEGIN is then instead sent along with the transaction's first
+ * query, so the transaction is ready for use right away. Its ready_fn is still called from the event loop, as the
+ * transaction may not even have been returned to the user yet.
+ *
+ * If anything fails, calls _evsql_trans_fail and returns nonzero, zero on success
+ */
+static int _evsql_trans_conn_ready (struct evsql *evsql, struct evsql_trans *trans) {
+    char trans_sql[EVSQL_QUERY_BEGIN_BUF];
+
+    // conns are never taken out of pipeline mode, so only use the ones that already are, as multi-statement queries
+    // can't be sent in pipeline mode
+    if (trans->conn->pipeline) {
+        trans->begin_pending = 1;
+
+        TAILQ_INSERT_TAIL(&evsql->trans_ready, trans, entry);
+        trans->ready_pending = 1;
+
+        event_active(evsql->ev_trans_ready, EV_TIMEOUT, 1);
+
+        return 0;
+    }
+
+    if (_evsql_trans_begin_sql(trans, trans_sql))
+        goto error;
     
     // execute the query
     if (evsql_query(evsql, trans, trans_sql, _evsql_trans_ready, trans) == NULL)
@@ -386,15 +2156,175 @@ error:
  */ 
 static void _evsql_evpq_connected (struct evpq_conn *_conn, void *arg) {
     struct evsql_conn *conn = arg;
+    struct evsql *evsql = conn->evsql;
+
+    if (evsql->config.pipeline_depth > 1 || evsql->config.stmt_cache || evsql->prepared_count) {
+        // send transactionless queries without waiting for earlier ones
+        if (_evsql_conn_pipeline(conn))
+            WARNING("failed to enter pipeline mode, running one query at a time");
+    }
+
+    if (conn->pipeline && _evsql_conn_prepare(conn)) {
+        // as if the connection attempt had failed
+        WARNING("failing the connection because preparing statements failed");
+
+        _evsql_conn_fail(conn);
+
+        return;
+    }
+
+    // the server is reachable again
+    conn->connected = 1;
+    wheel_del(&conn->timer);
+    evsql->conn_connecting--;
+    evsql->reconnect_attempt = 0;
+
+    _evsql_conn_update(conn);
 
     if (conn->trans)
         // notify the transaction
         // don't care about errors
-        (void) _evsql_trans_conn_ready(conn->evsql, conn->trans);
+        (void) _evsql_trans_conn_ready(evsql, conn->trans);
     
     else
-        // pump any waiting transactionless queries
-        _evsql_pump(conn->evsql, conn);
+        // hand it to any waiting transaction or transactionless queries
+        _evsql_conn_idle(conn);
+
+    // the conn may be gone by now
+    _evsql_warm_connected(evsql);
+}
+
+/*
+ * Should the given result of a streamed query be given to its row_fn?
+ */
+static int _evsql_evpq_streamed (const PGresult *result) {
+    switch (PQresultStatus(result)) {
+        case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK:
+#endif
+            return 1;
+
+        case PGRES_TUPLES_OK:
+            // the rows were not streamed after all, if evpq_query_rows failed
+            return PQntuples(result) > 0;
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Did the query fail because its prepared statement does not exist?
+ */
+static int _evsql_stmt_missing (const PGresult *result) {
+    const char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+
+    // invalid_sql_statement_name
+    return sqlstate && strcmp(sqlstate, "26000") == 0;
+}
+
+/*
+ * Should the transaction be replayed because of the given failed result?
+ */
+static int _evsql_trans_retryable (struct evsql_trans *trans, const PGresult *result) {
+    const char *sqlstate;
+
+    if (!trans->replay_fn || trans->retries >= trans->evsql->config.trans_retries)
+        return 0;
+
+    if (!result || (sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE)) == NULL)
+        return 0;
+
+    // serialization_failure, deadlock_detected
+    return strcmp(sqlstate, "40001") == 0 || strcmp(sqlstate, "40P01") == 0;
+}
+
+/*
+ * The retry delay for the transaction has passed, so start it again on the same conn, calling replay_fn once ready.
+ */
+static void _evsql_trans_retry_event (evutil_socket_t fd, short what, void *arg) {
+    struct evsql_trans *trans = arg;
+
+    (void) fd;
+    (void) what;
+
+    // ready_fn is kept as-is for any later abort notifications
+    trans->replaying = 1;
+
+    // this will handle failures itself
+    (void) _evsql_trans_conn_ready(trans->evsql, trans);
+}
+
+/*
+ * The transaction has been rolled back, so wait a while before retrying it.
+ */
+static void _evsql_trans_retry_res (struct evsql_result *res, void *arg) {
+    struct evsql_trans *trans = arg;
+    struct evsql *evsql = trans->evsql;
+    const struct timeval *tv_min = &evsql->config.trans_retry_min, *tv_max = &evsql->config.trans_retry_max;
+    uint64_t delay_min, delay_max, delay;
+    struct timeval tv;
+
+    if (res->error)
+        ERROR("transaction 'ROLLBACK' failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    delay_min = (uint64_t) tv_min->tv_sec * 1000000 + tv_min->tv_usec;
+    delay_max = timerisset(tv_max) ? (uint64_t) tv_max->tv_sec * 1000000 + tv_max->tv_usec : delay_min;
+
+    // exponential backoff
+    delay = delay_min << MIN(trans->retries - 1, 24);
+    delay = MIN(delay, MAX(delay_min, delay_max));
+
+    // jitter
+    delay = delay / 2 + random() % (delay / 2 + 1);
+
+    tv.tv_sec = delay / 1000000;
+    tv.tv_usec = delay % 1000000;
+
+    DEBUG("evsql.%p: retry %u of trans=%p in %lu.%06lus", evsql, trans->retries, trans, (unsigned long) tv.tv_sec, (unsigned long) tv.tv_usec);
+
+    if (!trans->ev_retry && (trans->ev_retry = evtimer_new(evsql->ev_base, _evsql_trans_retry_event, trans)) == NULL)
+        ERROR("evtimer_new");
+
+    if (evtimer_add(trans->ev_retry, &tv))
+        ERROR("evtimer_add");
+
+    // ok
+    return;
+
+error:
+    evsql_result_free(res);
+
+    _evsql_trans_fail(trans);
+}
+
+/*
+ * The transaction failed in a way that can be retried, and nothing is in flight anymore, so roll it back.
+ */
+static void _evsql_trans_retry (struct evsql_trans *trans) {
+    static const char *sql = "ROLLBACK TRANSACTION";
+    struct evsql *evsql = trans->evsql;
+
+    trans->retry = 0;
+
+    // start over
+    trans->has_commit = 0;
+    trans->failed = 0;
+
+    if (!trans->retries++)
+        // XXX: errors?
+        event_base_gettimeofday_cached(evsql->ev_base, &trans->retry_start);
+
+    evsql->retry_stats.retries++;
+
+    WARNING("retrying transaction after serialization failure or deadlock, attempt %u", trans->retries);
+
+    if (evsql_query(evsql, trans, sql, _evsql_trans_retry_res, trans) == NULL)
+        // tell the user
+        _evsql_trans_fail(trans);
 }
 
 /*
@@ -402,10 +2332,25 @@ static void _evsql_evpq_connected (struct evpq_conn *_conn, void *arg) {
  */
 static void _evsql_evpq_result (struct evpq_conn *_conn, PGresult *result, void *arg) {
     struct evsql_conn *conn = arg;
-    struct evsql_query *query = conn->query;
+    struct evsql_query *query = TAILQ_FIRST(&conn->queries);
 
     assert(query != NULL);
 
+    if (query->row_fn && _evsql_evpq_streamed(result)) {
+        struct evsql_result res; ZINIT(res);
+
+        res.evsql = conn->evsql;
+        res.result.pq = result;
+
+        // the query may have been aborted
+        if (query->cb_fn)
+            query->row_fn(&res, query->cb_arg);
+
+        evsql_result_free(&res);
+
+        return;
+    }
+
     // if we get multiple results, only return the first one
     if (query->result.pq) {
         WARNING("[evsql] evpq query returned multiple results, discarding previous one");
@@ -422,7 +2367,7 @@ static void _evsql_evpq_result (struct evpq_conn *_conn, PGresult *result, void
  */
 static void _evsql_evpq_done (struct evpq_conn *_conn, void *arg) {
     struct evsql_conn *conn = arg;
-    struct evsql_query *query = conn->query;
+    struct evsql_query *query = TAILQ_FIRST(&conn->queries);
     struct evsql_result res; ZINIT(res);
     
     assert(query != NULL);
@@ -435,11 +2380,24 @@ static void _evsql_evpq_done (struct evpq_conn *_conn, void *arg) {
         // if a query didn't return any results (bug?), warn and fail the query
         WARNING("[evsql] evpq query didn't return any results");
 
-        res.error = 1;
+        res.error = EIO;
     
+#ifdef LIBPQ_HAS_PIPELINING
+    } else if (PQresultStatus(query->result.pq) == PGRES_PIPELINE_ABORTED) {
+        // an earlier query in the same batch failed, so this one wasn't executed
+        PQclear(query->result.pq); query->result.pq = NULL;
+        res.result.pq = NULL;
+
+        res.error = ECANCELED;
+
+#endif
     } else if (strcmp(PQresultErrorMessage(query->result.pq), "") != 0) {
         // the query failed with some error
-        res.error = 1;
+        res.error = EIO;
+
+        if (query->info && _evsql_stmt_find(conn, query->info) && _evsql_stmt_missing(query->result.pq))
+            // preparing it failed, or the statement was deallocated behind our back, so prepare it again next time
+            _evsql_stmt_free(conn, _evsql_stmt_find(conn, query->info));
 
     } else {
         // the query succeeded \o/
@@ -448,27 +2406,91 @@ static void _evsql_evpq_done (struct evpq_conn *_conn, void *arg) {
     }
 
     // de-associate the query from the connection
-    conn->query = NULL;
+    TAILQ_REMOVE(&conn->queries, query, entry);
+    conn->query_depth--;
+    conn->evsql->query_depth--;
+
+    _evsql_conn_low_del(conn, query);
+    _evsql_pressure_update(conn->evsql);
+
+    if (conn->cancel && !conn->query_depth && !conn->cancel->conn)
+        // the aborted query completed before the cancel could even be sent
+        _evsql_conn_cancel_drop(conn);
+
+    _evsql_conn_update(conn);
     
     // how we handle query completion depends on if we're a transaction or not
     if (conn->trans) {
-        // we can deassign the trans's query
-        conn->trans->query = NULL;
+        struct evsql_trans *trans = conn->trans;
+
+        if (res.error && !trans->failed && !trans->retry && _evsql_trans_retryable(trans, res.result.pq)) {
+            struct evsql_query *next;
+
+            // the queries will be sent again, so none of them get their results, including any COMMIT
+            trans->retry = 1;
+            query->cb_fn = NULL;
+
+            TAILQ_FOREACH(next, &conn->queries, entry)
+                next->cb_fn = NULL;
+
+            // and the queued ones don't need to be sent at all
+            _evsql_trans_drop(trans);
+        }
+
+        if (trans->retry && !conn->query_depth) {
+            // the last one is done, so roll back and start over
+            _evsql_query_done(query, &res);
+            _evsql_trans_retry(trans);
+
+            return;
+        }
+
+        if (res.error && trans->failed) {
+            // the transaction was already aborted by an earlier query, so this one wasn't executed
+            if (query->result.pq)
+                PQclear(query->result.pq);
+
+            query->result.pq = NULL;
+            res.result.pq = NULL;
+
+            res.error = ECANCELED;
+
+        } else if (res.error) {
+            // any queries after this one will fail
+            trans->failed = 1;
+        }
+
+        if (!conn->query_depth && _evsql_trans_pump(trans)) {
+            // the result goes along with the rest of the transaction
+            evsql_result_free(&res);
+            _evsql_query_done(query, NULL);
+
+            _evsql_trans_fail(trans);
 
-        // was an abort?
-        if (!query->cb_fn)
+            return;
+        }
+
+        // was an abort, with nothing left after it?
+        if (!query->cb_fn && !conn->query_depth && !trans->has_commit)
             // notify the user that the transaction query has been aborted
-            conn->trans->ready_fn(conn->trans, conn->trans->cb_arg);
+            trans->ready_fn(trans, trans->cb_arg);
 
         // then hand the query to the user
         _evsql_query_done(query, &res);
         
     } else {
+        struct evsql *evsql = conn->evsql;
+        int low = query->priority == EVSQL_PRIORITY_LOW;
+
         // a transactionless query, so just finish it off and pump any other waiting ones
         _evsql_query_done(query, &res);
 
-        // pump the next one
-        _evsql_pump(conn->evsql, conn);
+        // pump the next ones
+        _evsql_conn_idle(conn);
+
+        if (low)
+            // the conn may have gone to some transaction instead
+            _evsql_queue_low_kick(evsql);
     }
 }
 
@@ -482,6 +2504,23 @@ static void _evsql_evpq_failure (struct evpq_conn *_conn, void *arg) {
     _evsql_conn_fail(conn);
 }
 
+/*
+ * The cancel request for the conn's aborted query was sent, so the conn can take on new queries again.
+ */
+static void _evsql_evpq_cancelled (struct evpq_conn *_conn, int err, void *arg) {
+    struct evsql_conn *conn = arg;
+
+    if (err)
+        WARNING("cancelling aborted query failed, it will run to completion");
+
+    conn->cancelling = 0;
+
+    _evsql_conn_update(conn);
+
+    // pump any waiting queries
+    _evsql_conn_idle(conn);
+}
+
 /*
  * Our evpq behaviour
  */
@@ -490,26 +2529,60 @@ static struct evpq_callback_info _evsql_evpq_cb_info = {
     .fn_result          = _evsql_evpq_result,
     .fn_done            = _evsql_evpq_done,
     .fn_failure         = _evsql_evpq_failure,
+    .fn_cancelled       = _evsql_evpq_cancelled,
 };
 
 /*
- * Allocate the generic evsql context.
+ * Allocate the generic evsql context, using the allocator from the given config, which is also copied.
  */
-static struct evsql *_evsql_new_base (struct event_base *ev_base, evsql_error_cb error_fn, void *cb_arg) {
+static struct evsql *_evsql_new_base (struct event_base *ev_base, const struct evsql_config *config, evsql_error_cb error_fn, void *cb_arg) {
+    struct evsql_allocator allocator;
     struct evsql *evsql = NULL;
+    enum evsql_conn_state state;
+    enum evsql_priority priority;
+    size_t bucket;
+
+    _evsql_allocator_get(&allocator, config);
     
     // allocate it
-    if ((evsql = calloc(1, sizeof(*evsql))) == NULL)
-        ERROR("calloc");
+    if ((evsql = _evsql_alloc(&allocator, sizeof(*evsql))) == NULL)
+        ERROR("alloc_fn");
 
     // store
     evsql->ev_base = ev_base;
     evsql->error_fn = error_fn;
     evsql->cb_arg = cb_arg;
+    evsql->allocator = allocator;
+
+    if (config)
+        evsql->config = *config;
+
+    if (!evsql->config.slab_max_free)
+        evsql->config.slab_max_free = EVSQL_SLAB_MAX_FREE;
+
+    // object allocation
+    _evsql_slab_init(&evsql->conn_slab, &evsql->allocator, sizeof(struct evsql_conn), evsql->config.slab_max_free);
+    _evsql_slab_init(&evsql->trans_slab, &evsql->allocator, sizeof(struct evsql_trans), evsql->config.slab_max_free);
+    _evsql_slab_init(&evsql->query_slab, &evsql->allocator, sizeof(struct evsql_query), evsql->config.slab_max_free);
 
     // init
-    LIST_INIT(&evsql->conn_list);
-    TAILQ_INIT(&evsql->query_queue);
+    for (state = 0; state < EVSQL_CONN_STATE_MAX; state++)
+        TAILQ_INIT(&evsql->conn_lists[state]);
+
+    for (priority = 0; priority < EVSQL_PRIORITY_MAX; priority++)
+        TAILQ_INIT(&evsql->query_queues[priority]);
+
+    // the first queue's turn
+    evsql->queue_credit = MAX(evsql->config.priority_weights[_evsql_queue_order[0]], 1);
+
+    TAILQ_INIT(&evsql->trans_queue);
+    TAILQ_INIT(&evsql->trans_ready);
+
+    for (bucket = 0; bucket < EVSQL_COALESCE_BUCKETS; bucket++)
+        LIST_INIT(&evsql->coalesce[bucket]);
+
+    for (bucket = 0; bucket < EVSQL_STMT_BUCKETS; bucket++)
+        LIST_INIT(&evsql->prepared[bucket]);
 
     // done
     return evsql;
@@ -523,13 +2596,26 @@ error:
  */
 static struct evsql_conn *_evsql_conn_new (struct evsql *evsql) {
     struct evsql_conn *conn = NULL;
+    size_t bucket;
     
     // allocate
-    if ((conn = calloc(1, sizeof(*conn))) == NULL)
-        ERROR("calloc");
+    if ((conn = _evsql_slab_alloc(&evsql->conn_slab)) == NULL)
+        goto error;
+
+    // init
+    conn->evsql = evsql;
+    TAILQ_INIT(&conn->queries);
+    TAILQ_INIT(&conn->stmt_lru);
+    TAILQ_INIT(&conn->stmt_pinned);
+    TAILQ_INIT(&conn->stmt_dealloc);
+
+    for (bucket = 0; bucket < EVSQL_STMT_BUCKETS; bucket++)
+        LIST_INIT(&conn->stmts[bucket]);
+
+    wheel_timer_init(&conn->timer, _evsql_conn_timeout, conn);
 
-    // init
-    conn->evsql = evsql;
+    // XXX: errors?
+    event_base_gettimeofday_cached(evsql->ev_base, &conn->created);
     
     // connect the engine
     switch (evsql->type) {
@@ -544,137 +2630,164 @@ static struct evsql_conn *_evsql_conn_new (struct evsql *evsql) {
     }
 
     // add it to the list
-    LIST_INSERT_HEAD(&evsql->conn_list, conn, entry);
+    conn->state = EVSQL_CONN_CONNECTING;
+    TAILQ_INSERT_HEAD(&evsql->conn_lists[EVSQL_CONN_CONNECTING], conn, entry);
+    evsql->conn_counts[EVSQL_CONN_CONNECTING]++;
+    evsql->conn_count++;
+    evsql->conn_connecting++;
+
+    // don't wait forever
+    if (timerisset(&evsql->config.connect_timeout) && wheel_add(evsql->wheel, &conn->timer, &evsql->config.connect_timeout))
+        WARNING("wheel_add: connection will not time out");
 
     // success
     return conn;
 
 error:
-    free(conn);
+    _evsql_slab_free(&evsql->conn_slab, conn);
 
     return NULL;
 }
 
-struct evsql *evsql_new_pq (struct event_base *ev_base, const char *pq_conninfo, evsql_error_cb error_fn, void *cb_arg) {
+struct evsql *evsql_new_pq_config (struct event_base *ev_base, const char *pq_conninfo, const struct evsql_config *config, evsql_error_cb error_fn, void *cb_arg) {
     struct evsql *evsql = NULL;
+    size_t count;
     
     // base init
-    if ((evsql = _evsql_new_base (ev_base, error_fn, cb_arg)) == NULL)
+    if ((evsql = _evsql_new_base (ev_base, config, error_fn, cb_arg)) == NULL)
         goto error;
 
     // store conf
     evsql->engine_conf.evpq = pq_conninfo;
 
-    // pre-create one connection
-    if (_evsql_conn_new(evsql) == NULL)
+    // timeouts
+    if (!timerisset(&evsql->config.timer_resolution))
+        evsql->config.timer_resolution.tv_usec = 100000;
+
+    if ((evsql->wheel = wheel_alloc(ev_base, &evsql->config.timer_resolution)) == NULL)
         goto error;
 
+    if (evsql->config.trans_retries && !timerisset(&evsql->config.trans_retry_min))
+        evsql->config.trans_retry_min.tv_usec = 10000;
+
+    // ready_fn for transactions on pipelined conns
+    if ((evsql->ev_trans_ready = event_new(ev_base, -1, 0, _evsql_trans_ready_event, evsql)) == NULL)
+        ERROR("event_new");
+
+    // backpressure
+    if (evsql->config.queue_high && evsql->config.queue_low >= evsql->config.queue_high)
+        evsql->config.queue_low = evsql->config.queue_high - 1;
+
+    if (evsql->config.in_flight_high && evsql->config.in_flight_low >= evsql->config.in_flight_high)
+        evsql->config.in_flight_low = evsql->config.in_flight_high - 1;
+
+    if (evsql->config.pressure_fn && (evsql->ev_pressure = event_new(ev_base, -1, 0, _evsql_pressure_event, evsql)) == NULL)
+        ERROR("event_new");
+
+    // reconnect timer
+    if (timerisset(&evsql->config.reconnect_min) && (evsql->ev_reconnect = evtimer_new(ev_base, _evsql_reconnect_event, evsql)) == NULL)
+        ERROR("evtimer_new");
+
+    // maintenance timer
+    if (timerisset(&evsql->config.idle_timeout) || timerisset(&evsql->config.max_lifetime) || evsql->config.max_queries) {
+        if (!timerisset(&evsql->config.maintain_interval))
+            evsql->config.maintain_interval.tv_sec = 1;
+
+        if ((evsql->ev_maintain = event_new(ev_base, -1, EV_PERSIST, _evsql_maintain_event, evsql)) == NULL)
+            ERROR("event_new");
+
+        if (event_add(evsql->ev_maintain, &evsql->config.maintain_interval))
+            ERROR("event_add");
+    }
+
+    // the pool can't keep more idle conns open than it may have in total
+    if (evsql->config.max_conns && evsql->config.min_idle > evsql->config.max_conns)
+        evsql->config.min_idle = evsql->config.max_conns;
+
+    // figure out how many conns to prewarm, and how many of those we need
+    evsql->config.prewarm = MAX(MAX(evsql->config.prewarm, evsql->config.min_idle), 1);
+
+    if (evsql->config.max_conns && evsql->config.prewarm > evsql->config.max_conns)
+        evsql->config.prewarm = evsql->config.max_conns;
+
+    // by default, a single conn is enough, so that one failed prewarm conn doesn't make the whole evsql unusable
+    if (!evsql->config.prewarm_ready)
+        evsql->config.prewarm_ready = 1;
+
+    if (evsql->config.prewarm_ready > evsql->config.prewarm)
+        evsql->config.prewarm_ready = evsql->config.prewarm;
+
+    // pre-create the connections, these will all connect concurrently
+    for (count = 0; count < evsql->config.prewarm; count++) {
+        if (_evsql_conn_new(evsql) == NULL)
+            goto error;
+    }
+
     // done
     return evsql;
 
 error:
-    // there's no other state yet
-    free(evsql); 
+    if (evsql)
+        evsql_destroy(evsql);
 
     return NULL;
 }
 
-/*
- * Checks if the connection is already allocated for some other trans/query.
- *
- * Returns:
- *      0       connection idle, can be allocated
- *      >1      connection busy
- */
-static int _evsql_conn_busy (struct evsql_conn *conn) {
-    // transactions get the connection to themselves
-    if (conn->trans)
-        return 1;
-    
-    // if it has a query assigned, it's busy
-    if (conn->query)
-        return 1;
-
-    // otherwise, it's all idle
-    return 0;
+struct evsql *evsql_new_pq (struct event_base *ev_base, const char *pq_conninfo, evsql_error_cb error_fn, void *cb_arg) {
+    return evsql_new_pq_config(ev_base, pq_conninfo, NULL, error_fn, cb_arg);
 }
 
 /*
  * Checks if the connection is ready for use (i.e. _evsql_evpq_connected was called).
  *
- * The connection should not already have a query running.
+ * The connection should be one returned by _evsql_conn_get, so either idle, or pipelined with room for more queries.
+ * Failed connections are released immediately, so they are never seen here.
  *
  * Returns 
- *  <0  the connection is not valid (failed, query in progress)
  *  0   the connection is still pending, and will become ready at some point
  *  >0  it's ready
  */
 static int _evsql_conn_ready (struct evsql_conn *conn) {
-    switch (conn->evsql->type) {
-        case EVSQL_EVPQ: {
-            enum evpq_state state = evpq_state(conn->engine.evpq);
-            
-            switch (state) {
-                case EVPQ_CONNECT:
-                    return 0;
-                
-                case EVPQ_CONNECTED:
-                    return 1;
-
-                case EVPQ_QUERY:
-                case EVPQ_INIT:
-                case EVPQ_FAILURE:
-                    return -1;
-                
-                default:
-                    FATAL("evpq_state: %d", state);
-            }
-
-        }
-        
-        default:
-            FATAL("evsql->type: %d", conn->evsql->type);
-    }
+    return conn->connected ? 1 : 0;
 }
 
 /*
  * Allocate a connection for use and return it via *conn_ptr, or if may_queue is nonzero and the connection pool is
  * getting full, return NULL (query should be queued).
  *
+ * If may_queue is nonzero, a pipelined conn that still has room for more queries may also be returned.
+ *
+ * If the pool has reached max_conns, NULL is also returned if may_queue is zero, and the caller must wait for a
+ * connection to be released (see _evsql_conn_idle).
+ *
  * Note that the returned connection might not be ready for use yet (if we created a new one, see _evsql_conn_ready).
  *
  * Returns zero if a connection was found or the request should be queued, or nonzero if something failed and the
  * request should be dropped.
  */
 static int _evsql_conn_get (struct evsql *evsql, struct evsql_conn **conn_ptr, int may_queue) {
-    int have_nontrans = 0;
-    *conn_ptr = NULL;
+    // use the most-recently-used idle conn, as its backend will be the warmest
+    if ((*conn_ptr = TAILQ_FIRST(&evsql->conn_lists[EVSQL_CONN_IDLE])) != NULL)
+        return 0;
     
-    // find a connection that isn't busy and is ready (unless the query queue is empty).
-    LIST_FOREACH(*conn_ptr, &evsql->conn_list, entry) {
-        // we can only have a query enqueue itself if there is a non-trans conn it can later use
-        if (!(*conn_ptr)->trans)
-            have_nontrans = 1;
-
-        // skip busy conns always
-        if (_evsql_conn_busy(*conn_ptr))
-            continue;
-        
-        // accept pending conns as long as there are NO enqueued queries (might cause deadlock otherwise)
-        if (_evsql_conn_ready(*conn_ptr) == 0 && TAILQ_EMPTY(&evsql->query_queue))
-            break;
+    // transactionless queries can go into a pipeline, these are kept in round-robin order
+    if (may_queue && (*conn_ptr = TAILQ_FIRST(&evsql->conn_lists[EVSQL_CONN_PIPELINE])) != NULL)
+        return 0;
 
-        // accept conns that are in a fully ready state
-        if (_evsql_conn_ready(*conn_ptr) > 0)
-            break;
-    }
-    
-    // if we found an idle connection, we can just return that right away
-    if (*conn_ptr)
+    // accept pending conns as long as there are NO enqueued queries (might cause deadlock otherwise)
+    if (!evsql->queue_len && (*conn_ptr = TAILQ_FIRST(&evsql->conn_lists[EVSQL_CONN_CONNECTING])) != NULL)
         return 0;
 
     // return NULL if may_queue and we have a non-trans conn that we can, at some point, use
-    if (may_queue && have_nontrans)
+    if (may_queue && evsql->conn_count > evsql->conn_counts[EVSQL_CONN_TRANS])
+        return 0;
+
+    // return NULL if we may not open any more conns, one will be released at some point
+    if (_evsql_pool_full(evsql))
+        return 0;
+
+    // return NULL if we are waiting to reconnect, a conn will be opened for us then
+    if (evsql->ev_reconnect && evtimer_pending(evsql->ev_reconnect, NULL))
         return 0;
     
     // we need to open a new connection
@@ -689,10 +2802,11 @@ error:
 
 struct evsql_trans *evsql_trans (struct evsql *evsql, enum evsql_trans_type type, evsql_trans_error_cb error_fn, evsql_trans_ready_cb ready_fn, evsql_trans_done_cb done_fn, void *cb_arg) {
     struct evsql_trans *trans = NULL;
+    struct evsql_conn *conn;
 
     // allocate it
-    if ((trans = calloc(1, sizeof(*trans))) == NULL)
-        ERROR("calloc");
+    if ((trans = _evsql_slab_alloc(&evsql->trans_slab)) == NULL)
+        goto error;
 
     // store
     trans->evsql = evsql;
@@ -700,13 +2814,33 @@ struct evsql_trans *evsql_trans (struct evsql *evsql, enum evsql_trans_type type
     trans->done_fn = done_fn;
     trans->cb_arg = cb_arg;
     trans->type = type;
+    TAILQ_INIT(&trans->queries);
+    wheel_timer_init(&trans->timer, _evsql_trans_timeout, trans);
 
     // find a connection
-    if (_evsql_conn_get(evsql, &trans->conn, 0))
+    if (_evsql_conn_get(evsql, &conn, 0))
         ERROR("_evsql_conn_get");
 
+    if (!conn) {
+        // the pool is full, so wait for a connection to be released
+        if (evsql->config.max_trans_waiting && evsql->trans_queue_len >= evsql->config.max_trans_waiting)
+            ERROR("too many transactions waiting for a connection: %zu", evsql->trans_queue_len);
+
+        TAILQ_INSERT_TAIL(&evsql->trans_queue, trans, entry);
+        evsql->trans_queue_len++;
+
+        // _evsql_conn_idle will take care of the rest
+        trans->error_fn = error_fn;
+
+        goto timeout;
+    }
+
     // associate the conn
-    trans->conn->trans = trans;
+    _evsql_conn_attach(conn, trans);
+
+    // keep enough idle conns around for the next ones
+    if (evsql->config.min_idle)
+        _evsql_pool_fill(evsql);
 
     // is it already ready?
     if (_evsql_conn_ready(trans->conn) > 0) {
@@ -724,11 +2858,16 @@ struct evsql_trans *evsql_trans (struct evsql *evsql, enum evsql_trans_type type
     // and let it pass errors to the user
     trans->error_fn = error_fn;
 
+timeout:
+    // don't take forever
+    if (timerisset(&evsql->config.trans_timeout) && wheel_add(evsql->wheel, &trans->timer, &evsql->config.trans_timeout))
+        WARNING("wheel_add: transaction will not time out");
+
     // ok
     return trans;
 
 error:
-    free(trans);
+    _evsql_slab_free(&evsql->trans_slab, trans);
 
     return NULL;
 }
@@ -739,18 +2878,25 @@ error:
 struct evsql_query *_evsql_query_new (struct evsql *evsql, struct evsql_trans *trans, evsql_query_cb query_fn, void *cb_arg) {
     struct evsql_query *query = NULL;
     
-    // if it's part of a trans, then make sure the trans is idle
-    if (trans && trans->query)
-        ERROR("transaction is busy");
+    // if it's part of a trans, then make sure the trans is ready, any earlier queries are sent first
+    if (trans && !trans->conn)
+        ERROR("transaction is still waiting for a connection");
+
+    if (trans && trans->has_commit)
+        ERROR("transaction was already commited");
 
     // allocate it
-    if ((query = calloc(1, sizeof(*query))) == NULL)
-        ERROR("calloc");
+    if ((query = _evsql_slab_alloc(&evsql->query_slab)) == NULL)
+        goto error;
 
     // store
+    query->evsql = evsql;
     query->cb_fn = query_fn;
     query->cb_arg = cb_arg;
 
+    TAILQ_INIT(&query->waiters);
+    wheel_timer_init(&query->timer, _evsql_query_timeout, query);
+
     // success
     return query;
 
@@ -761,15 +2907,9 @@ error:
 int _evsql_query_enqueue (struct evsql *evsql, struct evsql_trans *trans, struct evsql_query *query, const char *command) {
     // transaction queries are handled differently
     if (trans) {
-        // it's an in-transaction query
-        assert(trans->query == NULL);
-        
-        // assign the query
-        trans->query = query;
-
-        // execute directly
-        if (_evsql_query_exec(trans->conn, query, command)) {
-            // ack, fail the transaction
+        // execute behind any earlier queries
+        if (_evsql_trans_exec(trans, query, command)) {
+            // ack, fail the transaction, but leave the query to the caller
             _evsql_trans_fail(trans);
             
             // caller frees query
@@ -783,31 +2923,59 @@ int _evsql_query_enqueue (struct evsql *evsql, struct evsql_trans *trans, struct
         if ((_evsql_conn_get(evsql, &conn, 1)))
             ERROR("couldn't allocate a connection for the query");
 
-        // we must enqueue if no idle conn or the conn is not yet ready
-        if (conn && _evsql_conn_ready(conn) > 0) {
+        // we must enqueue if no idle conn or the conn is not yet ready, streamed queries can't go into a pipeline, and
+        // low-priority ones may have to wait for their turn
+        if (conn && _evsql_conn_ready(conn) > 0 && !(query->row_fn && conn->query_depth) && _evsql_queue_allowed(evsql, conn, query)) {
             // execute directly
             if (_evsql_query_exec(conn, query, command)) {
                 // ack, fail the connection
                 _evsql_conn_fail(conn);
                 
-                // make sure we don't deadlock any queries, but if this query got a conn directly, then we shouldn't
-                // have any queries enqueued anyways
-                assert(TAILQ_EMPTY(&evsql->query_queue));
+                // _evsql_conn_fail takes care of anything that the callbacks of other pipelined queries on the conn
+                // may have enqueued
                 
                 // caller frees query
                 goto error;
             }
+            
+            // keep enough idle conns around for the next ones
+            if (evsql->config.min_idle)
+                _evsql_pool_fill(evsql);
+
+        } else if (!query->internal && !_evsql_queue_admit(evsql)) {
+            // shed the load instead of letting the queue grow
+            evsql->queue_stats.rejected++;
+
+            DEBUG("evsql.%p: rejecting query=%p, %zu queries already queued", evsql, query, evsql->queue_len);
+
+            errno = EAGAIN;
+
+            goto error;
 
         } else {
-            // copy the command for later execution
-            if ((query->command = strdup(command)) == NULL)
-                ERROR("strdup");
+            // keep the command for later execution
+            if (_evsql_query_command_set(query, command))
+                goto error;
+
+            if (timerisset(&evsql->config.queue_timeout)) {
+                struct timeval now, deadline;
+
+                // don't wait forever, or past the query's own deadline
+                event_base_gettimeofday_cached(evsql->ev_base, &now);
+                timeradd(&now, &evsql->config.queue_timeout, &deadline);
+
+                if (!timerisset(&query->deadline) || timercmp(&deadline, &query->deadline, <))
+                    query->deadline = deadline;
+            }
             
             // enqueue until some connection pumps the queue
-            TAILQ_INSERT_TAIL(&evsql->query_queue, query, entry);
+            _evsql_queue_push(evsql, query);
         }
     }
 
+    // the query is now in flight or queued
+    _evsql_query_timer_start(evsql, query);
+
     // ok, good
     return 0;
 
@@ -815,36 +2983,300 @@ error:
     return -1;
 }
 
+int _evsql_batch_enqueue (struct evsql_batch *batch) {
+    struct evsql *evsql = batch->evsql;
+    struct evsql_query *query;
+    struct evsql_conn *conn;
+    struct timeval deadline;
+
+    // find a connection, like for a single query
+    if (_evsql_conn_get(evsql, &conn, 1))
+        ERROR("couldn't allocate a connection for the batch");
+
+    if (!(conn && _evsql_conn_ready(conn) > 0) && !_evsql_queue_admit(evsql)) {
+        // it would have to wait in the queue, so shed it as a whole
+        evsql->queue_stats.rejected++;
+
+        DEBUG("evsql.%p: rejecting batch=%p, %zu queries already queued", evsql, batch, evsql->queue_len);
+
+        errno = EAGAIN;
+
+        goto error;
+    }
+
+    timerclear(&deadline);
+
+    if (timerisset(&evsql->config.queue_timeout)) {
+        struct timeval now;
+
+        // don't wait forever
+        event_base_gettimeofday_cached(evsql->ev_base, &now);
+        timeradd(&now, &evsql->config.queue_timeout, &deadline);
+    }
+
+    // enqueue them all together, _evsql_pump keeps them that way
+    while ((query = TAILQ_FIRST(&batch->queries)) != NULL) {
+        TAILQ_REMOVE(&batch->queries, query, entry);
+
+        query->deadline = deadline;
+
+        _evsql_queue_push(evsql, query);
+
+        _evsql_query_timer_start(evsql, query);
+    }
+
+    // and send off as many as we can right away
+    while (conn && _evsql_conn_ready(conn) > 0) {
+        size_t queue_len = evsql->queue_len;
+
+        _evsql_pump(evsql, conn);
+
+        if (!evsql->queue_len || evsql->queue_len == queue_len)
+            // the rest may not be sent on any conn yet
+            break;
+
+        // without pipelining, each conn only takes one of them
+        if (_evsql_conn_get(evsql, &conn, 1)) {
+            WARNING("couldn't allocate a connection for the rest of the batch");
+
+            // make sure they don't get stuck in the queue
+            _evsql_pool_lost(evsql);
+
+            break;
+        }
+    }
+            
+    // keep enough idle conns around for the next ones
+    if (evsql->config.min_idle)
+        _evsql_pool_fill(evsql);
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * The cancel query for the conn's aborted query completed, so the conn can take on new queries again.
+ */
+static void _evsql_conn_cancel_res (struct evsql_result *res, void *arg) {
+    struct evsql_conn *conn = arg;
+
+    if (res->error)
+        WARNING("cancelling aborted query failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    conn->cancel = NULL;
+
+    _evsql_conn_update(conn);
+
+    // pump any waiting queries
+    _evsql_conn_idle(conn);
+}
+
+int _evsql_query_cancel (struct evsql_query *query) {
+    struct evsql *evsql = query->evsql;
+    struct evsql_conn *conn = query->conn;
+    struct evsql_query *cancel = NULL;
+    char sql[EVSQL_QUERY_CANCEL_BUF];
+    int pid;
+
+    if (query->leader) {
+        // just stop waiting for the identical query
+        TAILQ_REMOVE(&query->leader->waiters, query, entry);
+        query->leader = NULL;
+
+        _evsql_query_free(query);
+
+        return 1;
+    }
+
+    if (!TAILQ_EMPTY(&query->waiters))
+        // identical queries still want the results
+        return 0;
+
+    if (!conn && query->command && !(query->batch && !TAILQ_EMPTY(&query->batch->queries))) {
+        // still in the queue, so it doesn't need to be sent at all
+        _evsql_queue_remove(evsql, query);
+
+        _evsql_query_command_free(query);
+
+        // this may complete the batch
+        _evsql_query_done(query, NULL);
+
+        return 1;
+    }
+
+    if (!conn || conn->trans || conn->cancel || conn->cancelling)
+        // not sent yet as part of a batch, or already being cancelled
+        return 0;
+
+    if (conn->query_depth != 1 || TAILQ_FIRST(&conn->queries) != query)
+        // the cancel might hit some other pipelined query instead
+        return 0;
+
+    switch (evsql->type) {
+        case EVSQL_EVPQ:
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+            // libpq can send the cancel request without blocking, on a connection of its own
+            if (evpq_cancel(conn->engine.evpq) == 0) {
+                DEBUG("evsql.%p: cancelling query=%p on conn=%p", evsql, query, conn);
+
+                // the conn is held until the request has been sent, so that it can't hit the conn's next query
+                conn->cancelling = 1;
+                _evsql_conn_update(conn);
+
+                return 0;
+            }
+
+            WARNING("evpq_cancel failed, using pg_cancel_backend instead");
+#endif
+            pid = PQbackendPID(evpq_pgconn(conn->engine.evpq));
+            break;
+
+        default:
+            FATAL("evsql->type");
+    }
+
+    // PQcancel would block, so ask the server to do it for us
+    if (snprintf(sql, sizeof(sql), "SELECT pg_cancel_backend(%d)", pid) >= (int) sizeof(sql))
+        ERROR("cancel sql overflow");
+
+    DEBUG("evsql.%p: cancelling query=%p on conn=%p, backend %d", evsql, query, conn, pid);
+
+    if ((cancel = _evsql_query_new(evsql, NULL, _evsql_conn_cancel_res, conn)) == NULL)
+        ERROR("_evsql_query_new");
+
+    // it shouldn't wait behind the load that the query was aborted for, or be shed along with it
+    cancel->priority = EVSQL_PRIORITY_HIGH;
+    cancel->internal = 1;
+
+    // the conn is held until this completes, so that the cancel can't hit its next query, and it mustn't be sent on
+    // the same conn either
+    conn->cancel = cancel;
+    _evsql_conn_update(conn);
+
+    if (_evsql_query_enqueue(evsql, NULL, cancel, sql)) {
+        conn->cancel = NULL;
+        _evsql_conn_update(conn);
+
+        ERROR("failed to send pg_cancel_backend");
+    }
+
+    return 0;
+
+error:
+    _evsql_query_free(cancel);
+
+    WARNING("failed to cancel aborted query, it will run to completion");
+
+    return 0;
+}
+
+int evsql_prepare (struct evsql *evsql, const struct evsql_query_info *query_info) {
+    struct evsql_prepared *prepared;
+
+    if (_evsql_prepared(evsql, query_info))
+        // already registered
+        return 0;
+
+    if ((prepared = _evsql_alloc(&evsql->allocator, sizeof(*prepared))) == NULL)
+        ERROR("_evsql_alloc");
+
+    prepared->info = query_info;
+
+    LIST_INSERT_HEAD(&evsql->prepared[_evsql_stmt_hash(query_info)], prepared, entry);
+    evsql->prepared_count++;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+void evsql_trans_replay (struct evsql_trans *trans, evsql_trans_ready_cb replay_fn) {
+    trans->replay_fn = replay_fn;
+}
 
 void _evsql_trans_commit_res (struct evsql_result *res, void *arg) {
     struct evsql_trans *trans = arg;
+    struct evsql_conn *conn = trans->conn;
 
     // check for errors
     if (res->error)
         ERROR("transaction 'COMMIT' failed: %s", evsql_result_error(res));
+
+    // committing a transaction that has already failed rolls it back instead, which happens if the COMMIT was sent
+    // right behind a query that failed
+    if (strcmp(PQcmdStatus(res->result.pq), "ROLLBACK") == 0) {
+        WARNING("transaction 'COMMIT' was rolled back");
+
+        evsql_result_free(res);
+
+        // the conn itself is fine, so just tell the user
+        if (trans->error_fn)
+            trans->error_fn(trans, trans->cb_arg);
+        else
+            WARNING("supressing error because error_fn was NULL");
+
+        // and then reuse the conn
+        _evsql_trans_release(trans);
+        _evsql_conn_idle(conn);
+
+        return;
+    }
     
+    evsql_result_free(res);
+
+    if (trans->retries)
+        // it took a while, but it went through
+        _evsql_trans_retry_done(trans, 1);
+
     // transaction is now done
     trans->done_fn(trans, trans->cb_arg);
     
     // release it
     _evsql_trans_release(trans);
 
+    // and then reuse the conn
+    _evsql_conn_idle(conn);
+
     // success
     return;
 
 error:
+    evsql_result_free(res);
+
     _evsql_trans_fail(trans);
 }
 
 int evsql_trans_commit (struct evsql_trans *trans) {
     static const char *sql = "COMMIT TRANSACTION";
+    struct evsql_query *query;
+
+    if (!trans->conn)
+        ERROR("transaction is still waiting for a connection");
+
+    if (trans->has_commit)
+        ERROR("transaction was already commited");
 
-    if (trans->query)
-        ERROR("cannot COMMIT because transaction is still busy");
-    
     // query
-    if (evsql_query(trans->evsql, trans, sql, _evsql_trans_commit_res, trans) == NULL)
+    if ((query = _evsql_query_new(trans->evsql, NULL, _evsql_trans_commit_res, trans)) == NULL)
+        goto error;
+
+    if (_evsql_trans_exec(trans, query, sql)) {
+        _evsql_query_free(query);
+
+        // errors go to error_fn
+        _evsql_trans_fail(trans);
+
         goto error;
+    }
+
+    _evsql_query_timer_start(trans->evsql, query);
     
     // mark it as commited in case someone wants to abort it
     trans->has_commit = 1;
@@ -858,18 +3290,26 @@ error:
 
 void _evsql_trans_rollback_res (struct evsql_result *res, void *arg) {
     struct evsql_trans *trans = arg;
+    struct evsql_conn *conn = trans->conn;
 
     // fail the connection on errors
     if (res->error)
         ERROR("transaction 'ROLLBACK' failed: %s", evsql_result_error(res));
 
+    evsql_result_free(res);
+
     // release it
     _evsql_trans_release(trans);
 
+    // and then reuse the conn
+    _evsql_conn_idle(conn);
+
     // success
     return;
 
 error:
+    evsql_result_free(res);
+
     // fail the connection too, errors are supressed
     _evsql_trans_fail(trans);
 }
@@ -882,6 +3322,18 @@ void _evsql_trans_rollback (struct evsql_trans *trans, void *arg) {
 
     (void) arg;
 
+    if (trans->begin_pending) {
+        struct evsql_conn *conn = trans->conn;
+
+        // nothing was sent yet, so there is nothing to roll back
+        _evsql_trans_release(trans);
+
+        // and then reuse the conn
+        _evsql_conn_idle(conn);
+
+        return;
+    }
+
     // query
     if (evsql_query(trans->evsql, trans, sql, _evsql_trans_rollback_res, trans) == NULL) {
         // fail the transaction/connection, errors are supressed
@@ -899,15 +3351,34 @@ void evsql_trans_abort (struct evsql_trans *trans) {
         FATAL("transaction was already commited");
     }
 
-    if (trans->query) {
-        // gah, some query is running
-        WARNING("aborting pending query");
+    // and don't retry it either
+    trans->replay_fn = NULL;
+    trans->retry = 0;
+    trans->replaying = 0;
+
+    if (trans->ev_retry)
+        evtimer_del(trans->ev_retry);
+
+    if (!trans->conn) {
+        // still waiting for a conn, so just forget about it
+        _evsql_trans_dequeue(trans);
+        _evsql_trans_free(trans);
+
+    } else if (trans->conn->query_depth) {
+        struct evsql_query *query;
+
+        // gah, some queries are running
+        WARNING("aborting pending queries");
         
-        // prepare to rollback once complete by hijacking ready_fn
+        // prepare to rollback once the last one is complete by hijacking ready_fn
         trans->ready_fn = _evsql_trans_rollback;
+
+        // the queued ones don't need to be sent at all
+        _evsql_trans_drop(trans);
         
-        // abort
-        evsql_query_abort(trans, trans->query);
+        // abort them all, including any BEGIN, so that they complete silently
+        TAILQ_FOREACH(query, &trans->conn->queries, entry)
+            evsql_query_abort(trans, query);
 
     } else {
         // just rollback directly
@@ -917,38 +3388,101 @@ void evsql_trans_abort (struct evsql_trans *trans) {
 }
 
 void evsql_destroy (struct evsql *evsql) {
+    struct evsql_prepared *prepared;
+    size_t bucket;
     struct evsql_query *query;
+    struct evsql_trans *trans;
     struct evsql_conn *conn;
+    enum evsql_conn_state state;
+    enum evsql_priority priority;
+
+    // the cancel queries are freed along with the others
+    for (state = 0; state < EVSQL_CONN_STATE_MAX; state++) TAILQ_FOREACH(conn, &evsql->conn_lists[state], entry)
+        conn->cancel = NULL;
 
     // kill off all queued queries
-    while ((query = TAILQ_FIRST(&evsql->query_queue)) != NULL) {
+    for (priority = 0; priority < EVSQL_PRIORITY_MAX; priority++) while ((query = TAILQ_FIRST(&evsql->query_queues[priority])) != NULL) {
+        _evsql_queue_remove(evsql, query);
+
         // just free it, command first
-        free(query->command); query->command = NULL;
+        _evsql_query_command_free(query);
         _evsql_query_free(query);
     }
+
+    // kill off all waiting transactions
+    while ((trans = TAILQ_FIRST(&evsql->trans_queue)) != NULL) {
+        _evsql_trans_dequeue(trans);
+        _evsql_trans_free(trans);
+    }
     
     // kill off all connections
-    while ((conn = LIST_FIRST(&evsql->conn_list)) != NULL) {
-        // kill off the query
-        if (conn->query) {
-            free(query->command); query->command = NULL;
-            _evsql_query_free(query);
+    for (state = 0; state < EVSQL_CONN_STATE_MAX; state++) while ((conn = TAILQ_FIRST(&evsql->conn_lists[state])) != NULL) {
+        // kill off the queries
+        while ((query = TAILQ_FIRST(&conn->queries)) != NULL) {
+            TAILQ_REMOVE(&conn->queries, query, entry);
 
-            conn->query = NULL;
+            _evsql_query_command_free(query);
+            _evsql_query_free(query);
         }
 
         // kill off the transaction
-        if (conn->trans) {
-            conn->trans->query = NULL;
+        if (conn->trans)
             _evsql_trans_release(conn->trans);
-        }
 
         // kill it off
         _evsql_conn_release(conn);
     }
 
+    if (evsql->ev_reconnect)
+        event_free(evsql->ev_reconnect);
+
+    if (evsql->ev_maintain)
+        event_free(evsql->ev_maintain);
+
+    if (evsql->ev_trans_ready)
+        event_free(evsql->ev_trans_ready);
+
+    if (evsql->ev_pressure)
+        event_free(evsql->ev_pressure);
+
+    // forget the registered statements
+    for (bucket = 0; bucket < EVSQL_STMT_BUCKETS; bucket++) while ((prepared = LIST_FIRST(&evsql->prepared[bucket])) != NULL) {
+        LIST_REMOVE(prepared, entry);
+
+        _evsql_free(&evsql->allocator, prepared, sizeof(*prepared));
+    }
+
+    // everything that had a timer is gone by now
+    if (evsql->wheel)
+        wheel_free(evsql->wheel);
+
+    // release the cached objects
+    _evsql_slab_deinit(&evsql->conn_slab);
+    _evsql_slab_deinit(&evsql->trans_slab);
+    _evsql_slab_deinit(&evsql->query_slab);
+
     // then free the evsql itself
-    free(evsql);
+    evsql->allocator.free_fn(evsql, sizeof(*evsql), evsql->allocator.arg);
+}
+
+void evsql_stats (struct evsql *evsql, struct evsql_stats *stats) {
+    stats->conns = evsql->conn_slab.stats;
+    stats->trans = evsql->trans_slab.stats;
+    stats->queries = evsql->query_slab.stats;
+    stats->queue = evsql->queue_stats;
+    stats->retries = evsql->retry_stats;
+}
+
+bool evsql_pressure (struct evsql *evsql, struct evsql_pressure *pressure) {
+    if (pressure) {
+        pressure->queued = evsql->queue_len;
+        pressure->in_flight = evsql->query_depth;
+        pressure->trans_waiting = evsql->trans_queue_len;
+        pressure->conns = evsql->conn_count;
+        pressure->idle = evsql->conn_counts[EVSQL_CONN_IDLE];
+    }
+
+    return evsql->pressure_high;
 }
 
 void _evsql_destroy_handler (int fd, short what, void *arg)
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internal.h"
+#include "lib/log.h"
+#include "lib/error.h"
+#include "lib/misc.h"
+
+/*
+ * Free the cursor, the trans should already be taken care of
+ */
+static void _evsql_cursor_free (struct evsql_cursor *cursor) {
+    if (cursor->declare) {
+        // never sent
+        _evsql_query_free(cursor->declare);
+    }
+
+    if (cursor->declare_sql)
+        _evsql_free(&cursor->evsql->allocator, cursor->declare_sql, strlen(cursor->declare_sql) + 1);
+
+    _evsql_free(&cursor->evsql->allocator, cursor, sizeof(*cursor));
+}
+
+/*
+ * Something went wrong with the cursor, so roll back the transaction if it hasn't already failed, and tell the user
+ */
+static void _evsql_cursor_fail (struct evsql_cursor *cursor, err_t err) {
+    if (cursor->trans) {
+        // errors are supressed
+        evsql_trans_abort(cursor->trans); cursor->trans = NULL;
+    }
+
+    if (cursor->done_fn)
+        cursor->done_fn(cursor, err, cursor->cb_arg);
+
+    _evsql_cursor_free(cursor);
+}
+
+/*
+ * Fetch the next page
+ */
+static int _evsql_cursor_fetch (struct evsql_cursor *cursor);
+
+/*
+ * Got a page of rows, or an error
+ */
+static void _evsql_cursor_fetch_res (struct evsql_result *res, void *arg) {
+    struct evsql_cursor *cursor = arg;
+    size_t rows;
+    err_t err;
+
+    if ((err = evsql_result_check(res))) {
+        WARNING("cursor 'FETCH' failed: %s", evsql_result_error(res));
+
+        goto error;
+    }
+    
+    cursor->busy = 1;
+
+    if ((rows = evsql_result_rows(res)) < cursor->page_rows) {
+        // that was the last page, so we're done after this one
+        if ((err = evsql_trans_commit(cursor->trans) ? EIO : 0))
+            WARNING("evsql_trans_commit");
+        else
+            cursor->has_commit = 1;
+
+    } else {
+        // fetch the next page while the user handles this one
+        if ((err = _evsql_cursor_fetch(cursor) ? EIO : 0))
+            WARNING("_evsql_cursor_fetch");
+
+    }
+
+    cursor->busy = 0;
+
+    if (err)
+        goto error;
+
+    if (rows && cursor->page_fn)
+        // cursor may be aborted from here on
+        cursor->page_fn(cursor, res, cursor->cb_arg);
+    else
+        evsql_result_free(res);
+
+    return;
+
+error:
+    evsql_result_free(res);
+
+    _evsql_cursor_fail(cursor, err);
+}
+
+static int _evsql_cursor_fetch (struct evsql_cursor *cursor) {
+    return evsql_query_params(cursor->evsql, cursor->trans, cursor->fetch_sql, &_evsql_no_params, _evsql_cursor_fetch_res, cursor) ? 0 : -1;
+}
+
+/*
+ * The cursor has been declared, fetch the first page
+ */
+static void _evsql_cursor_declare_res (struct evsql_result *res, void *arg) {
+    struct evsql_cursor *cursor = arg;
+    err_t err;
+
+    if ((err = evsql_result_check(res))) {
+        WARNING("cursor 'DECLARE' failed: %s", evsql_result_error(res));
+
+        goto error;
+    }
+
+    evsql_result_free(res);
+
+    cursor->busy = 1;
+    err = _evsql_cursor_fetch(cursor) ? EIO : 0;
+    cursor->busy = 0;
+
+    if (err) {
+        WARNING("_evsql_cursor_fetch");
+
+        _evsql_cursor_fail(cursor, err);
+    }
+
+    return;
+
+error:
+    evsql_result_free(res);
+
+    _evsql_cursor_fail(cursor, err);
+}
+
+/*
+ * The cursor's transaction is ready, send the DECLARE
+ */
+static void _evsql_cursor_trans_ready (struct evsql_trans *trans, void *arg) {
+    struct evsql_cursor *cursor = arg;
+    struct evsql_query *query = cursor->declare;
+
+    (void) trans;
+
+    cursor->declare = NULL;
+    
+    cursor->busy = 1;
+
+    if (_evsql_query_enqueue(cursor->evsql, cursor->trans, query, cursor->declare_sql)) {
+        cursor->busy = 0;
+
+        WARNING("failed to send cursor 'DECLARE'");
+
+        _evsql_query_free(query);
+        _evsql_cursor_fail(cursor, EIO);
+
+        return;
+    }
+
+    cursor->busy = 0;
+}
+
+/*
+ * The cursor's transaction failed
+ */
+static void _evsql_cursor_trans_error (struct evsql_trans *trans, void *arg) {
+    struct evsql_cursor *cursor = arg;
+
+    (void) trans;
+
+    // the trans is freed by evsql
+    cursor->trans = NULL;
+
+    if (cursor->busy)
+        // our caller will handle it
+        return;
+
+    if (cursor->done_fn)
+        cursor->done_fn(cursor, EIO, cursor->cb_arg);
+
+    _evsql_cursor_free(cursor);
+}
+
+/*
+ * The cursor's transaction was commited, so all rows have been fetched
+ */
+static void _evsql_cursor_trans_done (struct evsql_trans *trans, void *arg) {
+    struct evsql_cursor *cursor = arg;
+
+    (void) trans;
+
+    cursor->trans = NULL;
+
+    if (cursor->done_fn)
+        cursor->done_fn(cursor, 0, cursor->cb_arg);
+
+    _evsql_cursor_free(cursor);
+}
+
+struct evsql_cursor *evsql_cursor (struct evsql *evsql, const struct evsql_query_info *query_info, size_t page_rows,
+    evsql_cursor_page_cb page_fn, evsql_cursor_done_cb done_fn, void *cb_arg,
+    ...
+) {
+    va_list vargs;
+    struct evsql_cursor *cursor = NULL;
+    size_t declare_len;
+    int ret;
+
+    // varargs
+    va_start(vargs, cb_arg);
+
+    if (!page_rows)
+        ERROR("page_rows must be given");
+
+    // allocate it
+    if ((cursor = _evsql_alloc(&evsql->allocator, sizeof(*cursor))) == NULL)
+        ERROR("_evsql_alloc");
+
+    // store
+    cursor->evsql = evsql;
+    cursor->page_fn = page_fn;
+    cursor->done_fn = done_fn;
+    cursor->cb_arg = cb_arg;
+    cursor->page_rows = page_rows;
+
+    // build the SQL
+    declare_len = strlen("DECLARE " EVSQL_CURSOR_NAME " NO SCROLL CURSOR FOR ") + strlen(query_info->sql) + 1;
+
+    if ((cursor->declare_sql = _evsql_alloc(&evsql->allocator, declare_len)) == NULL)
+        ERROR("_evsql_alloc");
+
+    snprintf(cursor->declare_sql, declare_len, "DECLARE " EVSQL_CURSOR_NAME " NO SCROLL CURSOR FOR %s", query_info->sql);
+
+    if ((ret = snprintf(cursor->fetch_sql, EVSQL_QUERY_FETCH_BUF, "FETCH FORWARD %zu FROM " EVSQL_CURSOR_NAME, page_rows)) >= EVSQL_QUERY_FETCH_BUF)
+        ERROR("fetch_sql overflow: %d >= %d", ret, EVSQL_QUERY_FETCH_BUF);
+
+    // the DECLARE query, with the params, sent once the trans is ready
+    if ((cursor->declare = _evsql_query_new(evsql, NULL, _evsql_cursor_declare_res, cursor)) == NULL)
+        goto error;
+
+    if (_evsql_query_info_fill(cursor->declare, query_info, vargs))
+        goto error;
+
+    // and the transaction for it
+    if ((cursor->trans = evsql_trans(evsql, EVSQL_TRANS_DEFAULT, _evsql_cursor_trans_error, _evsql_cursor_trans_ready, _evsql_cursor_trans_done, cursor)) == NULL)
+        goto error;
+
+    // end varargs
+    va_end(vargs);
+
+    // ok
+    return cursor;
+
+error:
+    if (cursor)
+        _evsql_cursor_free(cursor);
+
+    va_end(vargs);
+
+    return NULL;
+}
+
+void evsql_cursor_abort (struct evsql_cursor *cursor) {
+    if (cursor->has_commit) {
+        // too late to roll back, so just forget about the callbacks, and let the trans free the cursor
+        cursor->page_fn = NULL;
+        cursor->done_fn = NULL;
+
+        return;
+    }
+    
+    // roll back, the trans won't call us anymore
+    evsql_trans_abort(cursor->trans); cursor->trans = NULL;
+    
+    _evsql_cursor_free(cursor);
+}
@@ -1,11 +1,23 @@
 
 #include <event2/event.h>
+#include <sys/queue.h>
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "evpq.h"
 #include "lib/error.h"
 
+/*
+ * A command sent by evpq itself, whose results are not given to the user
+ */
+struct evpq_internal {
+    // the value of evpq_conn.sent when this was sent
+    size_t seq;
+
+    TAILQ_ENTRY(evpq_internal) entry;
+};
+
 struct evpq_conn {
     struct event_base *ev_base;
     struct evpq_callback_info user_cb;
@@ -16,8 +28,78 @@ struct evpq_conn {
     struct event *ev;
 
     enum evpq_state state;
+
+    // are we in pipeline mode?
+    int pipeline : 1;
+
+    // number of queries sent whose results have not yet been completely received
+    size_t queries;
+
+    // have we received a result for the first of those yet?
+    int have_result : 1;
+
+    // are we holding back queries until evpq_uncork, and how many have we held back?
+    int corked : 1;
+    size_t corked_queries;
+
+    // should the next queries share the sync of the next non-internal query, see evpq_chain?
+    int chained : 1;
+
+    // number of pipeline syncs sent whose results have not yet been received, and how many of those were sent before
+    // the last query
+    size_t syncs, syncs_before;
+
+    // row-by-row mode for the last query is waiting for this many earlier queries and syncs, see evpq_query_rows
+    int rows_pending : 1;
+    size_t rows_queries, rows_syncs;
+    size_t rows_chunk;
+
+    // number of queries sent and completed so far, including internal ones
+    size_t sent, done;
+
+    // internal queries that have not yet been completed, in the order that they were sent
+    TAILQ_HEAD(evpq_internal_queue, evpq_internal) internal;
+
+    // are we inside a fn_result/fn_done callback, and was evpq_release called from within it?
+    int in_cb : 1;
+    int released : 1;
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    // the cancel request in progress, see evpq_cancel
+    PGcancelConn *cancel_conn;
+    struct event *ev_cancel;
+#endif
 };
 
+/*
+ * Actually release the evpq_conn.
+ */
+static void _evpq_free (struct evpq_conn *conn) {
+    struct evpq_internal *internal;
+
+    while ((internal = TAILQ_FIRST(&conn->internal)) != NULL) {
+        TAILQ_REMOVE(&conn->internal, internal, entry);
+
+        free(internal);
+    }
+
+    if (conn->ev)
+        event_free(conn->ev);
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    if (conn->ev_cancel)
+        event_free(conn->ev_cancel);
+
+    if (conn->cancel_conn)
+        PQcancelFinish(conn->cancel_conn);
+#endif
+
+    if (conn->pg_conn)
+        PQfinish(conn->pg_conn);
+    
+    free(conn);
+}
+
 /*
  * This evpq_conn has experienced a GENERAL FAILURE.
  */
@@ -33,6 +115,15 @@ static void _evpq_failure (struct evpq_conn *conn) {
  * Initial connect was succesfull
  */
 static void _evpq_connect_ok (struct evpq_conn *conn) {
+    // don't let large queries block in libpq's send, see _evpq_query_schedule
+    if (PQsetnonblocking(conn->pg_conn, 1)) {
+        WARNING("PQsetnonblocking: %s", PQerrorMessage(conn->pg_conn));
+
+        _evpq_failure(conn);
+
+        return;
+    }
+
     // update state
     conn->state = EVPQ_CONNECTED;
 
@@ -48,32 +139,142 @@ static void _evpq_connect_fail (struct evpq_conn *conn) {
     _evpq_failure(conn);
 }
 
+/*
+ * Switch the current query into row-by-row mode
+ */
+static int _evpq_rows_mode (struct evpq_conn *conn) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    if (conn->rows_chunk > 1) {
+        if (PQsetChunkedRowsMode(conn->pg_conn, conn->rows_chunk) == 0)
+            ERROR("PQsetChunkedRowsMode: failed");
+
+        return 0;
+    }
+#endif
+
+    if (PQsetSingleRowMode(conn->pg_conn) == 0)
+        ERROR("PQsetSingleRowMode: failed");
+
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * Enter row-by-row mode for the query given to evpq_query_rows, once the results of the queries and syncs before it are
+ * out of the way.
+ */
+static void _evpq_rows_check (struct evpq_conn *conn) {
+    if (!conn->rows_pending || conn->rows_queries || conn->rows_syncs)
+        return;
+
+    conn->rows_pending = 0;
+
+    if (_evpq_rows_mode(conn))
+        // XXX: the results will just come in one go
+        WARNING("failed to enter row-by-row mode, returning all rows at once");
+}
+
+/*
+ * Are the results that we are receiving for an internal query?
+ */
+static int _evpq_internal (struct evpq_conn *conn) {
+    struct evpq_internal *internal = TAILQ_FIRST(&conn->internal);
+
+    return internal && internal->seq == conn->done;
+}
+
 /*
  * Receive a result and gives it to the user. If there was no more results, update state and tell the user.
  *
- * Returns zero if we got a result, 1 if there were/are no more results to handle.
+ * In pipeline mode, the results for each query are also terminated by a NULL result, and the results for the
+ * PQpipelineSync after each query are discarded, as are the results of internal queries.
+ *
+ * Returns zero if we got a result, 1 if there were/are no more results to handle, and -1 if evpq_release was called
+ * from the user callback, and the conn is now gone.
  */
 static int _evpq_query_result (struct evpq_conn *conn) {
     PGresult *result;
     
     // get the result
     if ((result = PQgetResult(conn->pg_conn)) == NULL) {
-        // no more results, update state
-        conn->state = EVPQ_CONNECTED;
+        if (conn->pipeline && !conn->have_result)
+            // not for any query, we need to wait for more data
+            return 1;
+
+        // no more results for this query, update state
+        conn->have_result = 0;
+
+        if (--conn->queries == 0)
+            conn->state = EVPQ_CONNECTED;
 
-        // tell the user the query is done
-        conn->user_cb.fn_done(conn, conn->user_cb_arg);
+        // the next query may be the row-by-row one
+        if (conn->rows_pending && conn->rows_queries) {
+            conn->rows_queries--;
 
-        // stop waiting for more results
-        return 1;
+            _evpq_rows_check(conn);
+        }
+
+        if (_evpq_internal(conn)) {
+            struct evpq_internal *internal = TAILQ_FIRST(&conn->internal);
+
+            // the user doesn't know about it
+            TAILQ_REMOVE(&conn->internal, internal, entry);
+            free(internal);
+
+        } else {
+            // tell the user the query is done
+            conn->in_cb = 1;
+            conn->user_cb.fn_done(conn, conn->user_cb_arg);
+            conn->in_cb = 0;
+        }
+
+        conn->done++;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    } else if (PQresultStatus(result) == PGRES_PIPELINE_SYNC) {
+        // just marks the end of a query
+        PQclear(result);
+
+        conn->syncs--;
+
+        // the row-by-row query may be next
+        if (conn->rows_pending && conn->rows_syncs) {
+            conn->rows_syncs--;
+
+            _evpq_rows_check(conn);
+        }
+
+#endif
+    } else if (_evpq_internal(conn)) {
+        conn->have_result = 1;
+
+        if (PQresultStatus(result) == PGRES_FATAL_ERROR)
+            // the user query that it was for will fail as well
+            WARNING("internal query failed: %s", PQresultErrorMessage(result));
+
+        PQclear(result);
 
     } else {
+        conn->have_result = 1;
+
         // got a result, give it to the user
+        conn->in_cb = 1;
         conn->user_cb.fn_result(conn, result, conn->user_cb_arg);
+        conn->in_cb = 0;
 
-        // great
-        return 0;
     }
+
+    if (conn->released) {
+        // evpq_release was deferred until now
+        _evpq_free(conn);
+
+        return -1;
+    }
+
+    // stop waiting for more results once all queries are done
+    return conn->queries ? 0 : 1;
 }
 
 /*
@@ -88,6 +289,10 @@ static int _evpq_schedule (struct evpq_conn *conn, short what, void (*handler)(e
 
     // reschedule with a new event
     if (conn->ev) {
+        // it may still be pending if we are sending more queries in pipeline mode
+        if (event_del(conn->ev))
+            PERROR("event_del");
+
         event_assign(conn->ev, conn->ev_base, PQsocket(conn->pg_conn), what, handler, conn);
 
     } else {
@@ -166,18 +371,122 @@ error:
     _evpq_failure(conn);
 }
 
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+static void _evpq_cancel_event (evutil_socket_t fd, short what, void *arg);
+
+/*
+ * Schedule a new _evpq_cancel_event for the cancel request.
+ */
+static int _evpq_cancel_schedule (struct evpq_conn *conn, short what) {
+    if (PQcancelSocket(conn->cancel_conn) < 0)
+        ERROR("PQcancelSocket gave invalid socket");
+
+    if (conn->ev_cancel) {
+        event_assign(conn->ev_cancel, conn->ev_base, PQcancelSocket(conn->cancel_conn), what, _evpq_cancel_event, conn);
+
+    } else {
+        if ((conn->ev_cancel = event_new(conn->ev_base, PQcancelSocket(conn->cancel_conn), what, _evpq_cancel_event, conn)) == NULL)
+            PERROR("event_new");
+
+    }
+
+    if (event_add(conn->ev_cancel, NULL))
+        PERROR("event_add");
+
+    // success
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * The cancel request is done, one way or another.
+ */
+static void _evpq_cancel_done (struct evpq_conn *conn, int err) {
+    if (err)
+        WARNING("PQcancelPoll: %s", PQcancelErrorMessage(conn->cancel_conn));
+
+    PQcancelFinish(conn->cancel_conn); conn->cancel_conn = NULL;
+
+    // notify
+    conn->user_cb.fn_cancelled(conn, err, conn->user_cb_arg);
+}
+
+/*
+ * Handle events on the cancel request's socket, like _evpq_connect_event
+ */
+static void _evpq_cancel_event (evutil_socket_t fd, short what, void *arg) {
+    struct evpq_conn *conn = arg;
+    PostgresPollingStatusType poll_status;
+
+    (void) fd;
+
+    switch ((poll_status = PQcancelPoll(conn->cancel_conn))) {
+        case PGRES_POLLING_READING:
+            what = EV_READ;
+            break;
+
+        case PGRES_POLLING_WRITING:
+            what = EV_WRITE;
+            break;
+
+        case PGRES_POLLING_OK:
+            _evpq_cancel_done(conn, 0);
+            return;
+
+        case PGRES_POLLING_FAILED:
+            _evpq_cancel_done(conn, -1);
+            return;
+
+        default:
+            FATAL("PQcancelPoll gave a weird value: %d", poll_status);
+    }
+
+    if (_evpq_cancel_schedule(conn, what))
+        _evpq_cancel_done(conn, -1);
+}
+#endif
+
+static void _evpq_query_event (evutil_socket_t fd, short what, void *arg);
+
+/*
+ * Flush as much of the outgoing query data as we can without blocking, and then wait for the rest of the results,
+ * and for the socket to become writeable again if there is still outgoing data left.
+ *
+ * libpq says that we must also wait for reads while flushing, as the server may block sending us results until we
+ * read them.
+ */
+static int _evpq_query_schedule (struct evpq_conn *conn) {
+    short what = EV_READ;
+    int ret;
+
+    if ((ret = PQflush(conn->pg_conn)) < 0)
+        ERROR("PQflush: %s", PQerrorMessage(conn->pg_conn));
+
+    if (ret > 0)
+        // not everything was sent yet
+        what |= EV_WRITE;
+
+    return _evpq_schedule(conn, what, _evpq_query_event);
+
+error:
+    return -1;
+}
+
 static void _evpq_query_event (evutil_socket_t fd, short what, void *arg) {
     struct evpq_conn *conn = arg;
+    int ret;
     
     // this is only for query events
     assert(conn->state == EVPQ_QUERY);
 
-    // XXX: PQflush, timeouts
-    assert(what == EV_READ);
-
-    // we're going to assume that all queries will *require* data for their results
-    // this would break otherwise (PQconsumeInput might block?)
-    assert(PQisBusy(conn->pg_conn) != 0);
+    // XXX: timeouts
+    
+    // writes are handled by _evpq_query_schedule below, as there might be more results coming before all the queries
+    // have been sent
+    if (!(what & EV_READ))
+        goto reschedule;
 
     // handle input
     if (PQconsumeInput(conn->pg_conn) == 0)
@@ -186,16 +495,26 @@ static void _evpq_query_event (evutil_socket_t fd, short what, void *arg) {
     // handle results
     while (PQisBusy(conn->pg_conn) == 0) {
         // handle the result
-        if (_evpq_query_result(conn) == 1) {
+        if ((ret = _evpq_query_result(conn)) < 0) {
+            // the conn is gone
+            return;
+
+        } else if (ret > 0 && conn->state != EVPQ_QUERY) {
             // no need to wait for anything anymore
             return;
+        
+        } else if (ret > 0) {
+            // wait for the results of the remaining queries, or a new query was sent from the callback
+            break;
+
         }
 
         // loop to handle the next result
     }
 
-    // still need to wait for a result, so reschedule
-    if (_evpq_schedule(conn, EV_READ, _evpq_query_event))
+reschedule:
+    // still need to wait for a result or flush the query, so reschedule
+    if (_evpq_query_schedule(conn))
         goto error;
         
     // done, wait for the next event
@@ -210,7 +529,7 @@ error:
 struct evpq_conn *evpq_connect (struct event_base *ev_base, const char *conninfo, const struct evpq_callback_info cb_info, void *cb_arg) {
     struct evpq_conn *conn = NULL;
     
-    // alloc our context
+    // alloc our context, not covered by the evsql_allocator
     if ((conn = calloc(1, sizeof(*conn))) == NULL)
         ERROR("calloc");
     
@@ -219,6 +538,7 @@ struct evpq_conn *evpq_connect (struct event_base *ev_base, const char *conninfo
     conn->user_cb = cb_info;
     conn->user_cb_arg = cb_arg;
     conn->state = EVPQ_INIT;
+    TAILQ_INIT(&conn->internal);
 
     // create our PGconn
     if ((conn->pg_conn = PQconnectStart(conninfo)) == NULL)
@@ -246,8 +566,8 @@ error:
 }
 
 static int _evpq_check_query (struct evpq_conn *conn) {
-    // just check the state
-    if (conn->state != EVPQ_CONNECTED)
+    // just check the state, pipelined queries may be sent at any time
+    if (conn->state != EVPQ_CONNECTED && !(conn->state == EVPQ_QUERY && conn->pipeline))
         ERROR("invalid evpq state: %d", conn->state);
     
     // ok
@@ -257,14 +577,73 @@ error:
     return -1;
 }
 
+/*
+ * The query that was just sent is an internal one, called before _evpq_handle_query.
+ */
+static int _evpq_handle_internal (struct evpq_conn *conn) {
+    struct evpq_internal *internal;
+
+    if ((internal = calloc(1, sizeof(*internal))) == NULL)
+        ERROR("calloc");
+
+    internal->seq = conn->sent;
+
+    TAILQ_INSERT_TAIL(&conn->internal, internal, entry);
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
 static int _evpq_handle_query (struct evpq_conn *conn) {
+    struct evpq_internal *internal = TAILQ_LAST(&conn->internal, evpq_internal_queue);
+    int chained = conn->chained;
+
+    // for evpq_query_rows
+    conn->syncs_before = conn->syncs;
+
+    if (chained && !(internal && internal->seq == conn->sent)) {
+        // this is the query that the chain ends with, so it gets the sync
+        conn->chained = 0;
+        chained = 0;
+    }
+
+#ifdef LIBPQ_HAS_SEND_PIPELINE_SYNC
+    // we can sync without flushing, so corked queries can still get their own syncs
+    if (conn->corked && !chained) {
+        if (PQsendPipelineSync(conn->pg_conn) == 0)
+            ERROR("PQsendPipelineSync: %s", PQerrorMessage(conn->pg_conn));
+
+        conn->syncs++;
+    }
+#endif
+
+#ifdef LIBPQ_HAS_PIPELINING
+    // each query gets its own sync, so that errors don't affect the following queries
+    if (conn->pipeline && !conn->corked && !chained) {
+        if (PQpipelineSync(conn->pg_conn) == 0)
+            ERROR("PQpipelineSync: %s", PQerrorMessage(conn->pg_conn));
+
+        conn->syncs++;
+    }
+#endif
+
     // update state
     conn->state = EVPQ_QUERY;
-    
-    // XXX: PQflush
+    conn->queries++;
+    conn->sent++;
 
-    // poll for read
-    if (_evpq_schedule(conn, EV_READ, _evpq_query_event))
+    if (conn->corked) {
+        // sent by evpq_uncork
+        conn->corked_queries++;
+
+        return 0;
+    }
+    
+    // send what we can, and poll for the rest
+    if (_evpq_query_schedule(conn))
         goto error;
 
     // and then we wait
@@ -279,9 +658,16 @@ int evpq_query (struct evpq_conn *conn, const char *command) {
     if (_evpq_check_query(conn))
         goto error;
     
-    // do the query
-    if (PQsendQuery(conn->pg_conn, command) == 0)
-        ERROR("PQsendQuery: %s", PQerrorMessage(conn->pg_conn));
+    // do the query, pipeline mode doesn't support the simple query protocol
+    if (conn->pipeline) {
+        if (PQsendQueryParams(conn->pg_conn, command, 0, NULL, NULL, NULL, NULL, 0) == 0)
+            ERROR("PQsendQueryParams: %s", PQerrorMessage(conn->pg_conn));
+
+    } else {
+        if (PQsendQuery(conn->pg_conn, command) == 0)
+            ERROR("PQsendQuery: %s", PQerrorMessage(conn->pg_conn));
+
+    }
     
     // handle it
     if (_evpq_handle_query(conn))
@@ -315,14 +701,240 @@ error:
 
 }
 
-void evpq_release (struct evpq_conn *conn) {
-    if (conn->ev)
-        event_free(conn->ev);
+/*
+ * Internal queries are only sent in pipeline mode, as they are followed by the user's query without waiting
+ */
+static int _evpq_check_internal (struct evpq_conn *conn) {
+    if (!conn->pipeline)
+        ERROR("not in pipeline mode");
 
-    if (conn->pg_conn)
-        PQfinish(conn->pg_conn);
+    return _evpq_check_query(conn);
+
+error:
+    return -1;
+}
+
+int evpq_prepare (struct evpq_conn *conn, const char *name, const char *command, int nParams, const Oid *paramTypes) {
+    // check state
+    if (_evpq_check_internal(conn))
+        goto error;
+
+    // prepare it
+    if (PQsendPrepare(conn->pg_conn, name, command, nParams, paramTypes) == 0)
+        ERROR("PQsendPrepare: %s", PQerrorMessage(conn->pg_conn));
+
+    // handle it
+    if (_evpq_handle_internal(conn) || _evpq_handle_query(conn))
+        goto error;
+
+    // success
+    return 0;
+
+error:
+    return -1;
+}
+
+int evpq_query_prepared (struct evpq_conn *conn, const char *name, int nParams, const char * const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat) {
+    // check state
+    if (_evpq_check_query(conn))
+        goto error;
     
-    free(conn);
+    // do the query
+    if (PQsendQueryPrepared(conn->pg_conn, name, nParams, paramValues, paramLengths, paramFormats, resultFormat) == 0)
+        ERROR("PQsendQueryPrepared: %s", PQerrorMessage(conn->pg_conn));
+    
+    // handle it
+    if (_evpq_handle_query(conn))
+        goto error;
+
+    // success
+    return 0;
+
+error:
+    return -1;
+}
+
+int evpq_deallocate (struct evpq_conn *conn, const char *name) {
+    char command[EVPQ_NAME_MAX + 16];
+
+    // check state
+    if (_evpq_check_internal(conn))
+        goto error;
+
+    // prepared statement names are identifiers
+    if (snprintf(command, sizeof(command), "DEALLOCATE \"%s\"", name) >= (int) sizeof(command))
+        ERROR("name too long: %s", name);
+
+    // do the query
+    if (PQsendQueryParams(conn->pg_conn, command, 0, NULL, NULL, NULL, NULL, 0) == 0)
+        ERROR("PQsendQueryParams: %s", PQerrorMessage(conn->pg_conn));
+
+    // handle it
+    if (_evpq_handle_internal(conn) || _evpq_handle_query(conn))
+        goto error;
+
+    // success
+    return 0;
+
+error:
+    return -1;
+}
+
+int evpq_pipeline (struct evpq_conn *conn) {
+#ifdef LIBPQ_HAS_PIPELINING
+    // can only enter pipeline mode while idle
+    if (conn->state != EVPQ_CONNECTED)
+        ERROR("invalid evpq state: %d", conn->state);
+
+    if (PQenterPipelineMode(conn->pg_conn) == 0)
+        ERROR("PQenterPipelineMode: %s", PQerrorMessage(conn->pg_conn));
+
+    conn->pipeline = 1;
+
+    // ok
+    return 0;
+#else
+    ERROR("libpq does not support pipeline mode");
+#endif
+
+error:
+    return -1;
+}
+
+int evpq_cancel (struct evpq_conn *conn) {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    if (conn->state != EVPQ_QUERY)
+        ERROR("invalid evpq state: %d", conn->state);
+
+    if (conn->cancel_conn)
+        ERROR("a cancel is already in progress");
+
+    if ((conn->cancel_conn = PQcancelCreate(conn->pg_conn)) == NULL)
+        ERROR("PQcancelCreate");
+
+    if (PQcancelStart(conn->cancel_conn) == 0)
+        ERROR("PQcancelStart: %s", PQcancelErrorMessage(conn->cancel_conn));
+
+    // assume PGRES_POLLING_WRITING
+    if (_evpq_cancel_schedule(conn, EV_WRITE))
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    if (conn->cancel_conn) {
+        PQcancelFinish(conn->cancel_conn); conn->cancel_conn = NULL;
+    }
+
+    return -1;
+#else
+    (void) conn;
+
+    ERROR("libpq does not support non-blocking cancels");
+
+error:
+    return -1;
+#endif
+}
+
+int evpq_pipelined (struct evpq_conn *conn) {
+    return conn->pipeline;
+}
+
+int evpq_query_rows (struct evpq_conn *conn, size_t chunk_rows) {
+    if (!conn->queries)
+        ERROR("no query was sent");
+
+    if (conn->rows_pending)
+        ERROR("row-by-row mode is still pending for an earlier query");
+    
+    conn->rows_chunk = chunk_rows;
+
+    // libpq only allows this for the query whose results are next, so the earlier queries and syncs must be out of
+    // the way first
+    conn->rows_queries = conn->queries - 1;
+    conn->rows_syncs = conn->syncs_before;
+
+    if (conn->rows_queries || conn->rows_syncs) {
+        conn->rows_pending = 1;
+
+        return 0;
+    }
+
+    return _evpq_rows_mode(conn);
+
+error:
+    return -1;
+}
+
+int evpq_cork (struct evpq_conn *conn) {
+    if (!conn->pipeline)
+        ERROR("not in pipeline mode");
+
+    conn->corked = 1;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+int evpq_chain (struct evpq_conn *conn) {
+    if (!conn->pipeline)
+        ERROR("not in pipeline mode");
+
+    conn->chained = 1;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+int evpq_uncork (struct evpq_conn *conn) {
+    if (!conn->corked)
+        return 0;
+
+    conn->corked = 0;
+
+    if (!conn->corked_queries)
+        return 0;
+
+    conn->corked_queries = 0;
+
+#if defined(LIBPQ_HAS_PIPELINING) && !defined(LIBPQ_HAS_SEND_PIPELINE_SYNC)
+    // one sync for all of the queries
+    if (PQpipelineSync(conn->pg_conn) == 0)
+        ERROR("PQpipelineSync: %s", PQerrorMessage(conn->pg_conn));
+
+    conn->syncs++;
+#endif
+    
+    // send them all, and poll for the results
+    if (_evpq_query_schedule(conn))
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+void evpq_release (struct evpq_conn *conn) {
+    if (conn->in_cb) {
+        // don't pull the conn out from under _evpq_query_result
+        conn->released = 1;
+
+        if (conn->ev)
+            event_del(conn->ev);
+
+    } else {
+        _evpq_free(conn);
+    }
 }
 
 enum evpq_state evpq_state (struct evpq_conn *conn) {
@@ -40,6 +40,11 @@ struct evpq_callback_info {
      * XXX: add a `what` arg?
      */
     void (*fn_failure)(struct evpq_conn *conn, void *arg);
+
+    /*
+     * The cancel request started using evpq_cancel has been sent, err is nonzero if that failed.
+     */
+    void (*fn_cancelled)(struct evpq_conn *conn, int err, void *arg);
 };
 
 /*
@@ -68,14 +73,76 @@ enum evpq_state {
  */
 struct evpq_conn *evpq_connect (struct event_base *ev_base, const char *conninfo, const struct evpq_callback_info cb_info, void *cb_arg);
 
+/*
+ * Switch the connection into pipeline mode, see PQenterPipelineMode. This evpq must be in the EVPQ_CONNECTED state.
+ *
+ * In pipeline mode, further queries can be sent while in the EVPQ_QUERY state, and their results will be received in
+ * order, each query's results followed by its own fn_done. The state returns to EVPQ_CONNECTED once all of them are
+ * done. Each query is followed by a PQpipelineSync, so an error in one query doesn't affect the others.
+ *
+ * Returns nonzero if pipeline mode is not supported by libpq, or it fails.
+ */
+int evpq_pipeline (struct evpq_conn *conn);
+
+/*
+ * Is the connection in pipeline mode?
+ */
+int evpq_pipelined (struct evpq_conn *conn);
+
+/*
+ * Receive the results of the query that was just sent using evpq_query/evpq_query_params row by row, see
+ * PQsetSingleRowMode. Each row is then given to fn_result as a separate PGRES_SINGLE_TUPLE result, followed by an empty
+ * PGRES_TUPLES_OK result.
+ *
+ * If libpq supports chunked rows mode, and chunk_rows is more than one, the rows are given in PGRES_TUPLES_CHUNK
+ * results of up to chunk_rows rows each instead.
+ *
+ * If earlier queries are still in flight in pipeline mode, for example internal ones, then row-by-row mode is only
+ * entered once their results have been received. Only one query at a time may be waiting for this.
+ *
+ * Returns nonzero on failure, in which case the query's results will be returned all at once.
+ */
+int evpq_query_rows (struct evpq_conn *conn, size_t chunk_rows);
+
+/*
+ * Hold back any further queries in pipeline mode, so that they can be sent together by evpq_uncork.
+ *
+ * If libpq does not have PQsendPipelineSync, then the corked queries all share a single PQpipelineSync, and so an error
+ * in one query will cause the following queries to return a PGRES_PIPELINE_ABORTED result.
+ *
+ * Returns nonzero if not in pipeline mode.
+ */
+int evpq_cork (struct evpq_conn *conn);
+
+/*
+ * Have the next query share its pipeline sync with the query sent after it, along with any internal queries sent in
+ * between. If the first query fails, the following ones are then not executed either, even if corked queries would
+ * otherwise get their own syncs.
+ *
+ * Returns nonzero if not in pipeline mode.
+ */
+int evpq_chain (struct evpq_conn *conn);
+
+/*
+ * Send all of the queries held back since evpq_cork, in as few writes as possible.
+ *
+ * Returns nonzero on failure, in which case the connection should be considered as failed.
+ */
+int evpq_uncork (struct evpq_conn *conn);
+
 /*
  * Execute a query.
  *
- * This corresponds directly to PQsendQuery. This evpq must be in the EVPQ_CONNECTED state, so you must wait after
- * calling evpq_connect, and you may not run two queries at the same time.
+ * This corresponds directly to PQsendQuery. The connection is in non-blocking mode, so the query is only sent as far as
+ * it can be without blocking, and the rest is flushed as the socket becomes writeable.
+ *
+ * This evpq must be in the EVPQ_CONNECTED state, so you must wait after calling evpq_connect, and you may not run two
+ * queries at the same time, unless in pipeline mode.
  *
  * The query will result in a series of fn_result (EVPQ_RESULT) calls (if multiple queries in the query string),
  * followed by a fn_done (EVPQ_CONNECTED).
+ *
+ * In pipeline mode, this uses PQsendQueryParams instead, so the command may only contain a single query.
  */
 int evpq_query (struct evpq_conn *conn, const char *command);
 
@@ -86,6 +153,46 @@ int evpq_query (struct evpq_conn *conn, const char *command);
  */
 int evpq_query_params (struct evpq_conn *conn, const char *command, int nParams, const Oid *paramTypes, const char * const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat);
 
+/*
+ * Maximum length of a prepared statement name
+ */
+#define EVPQ_NAME_MAX 63
+
+/*
+ * Prepare a statement with the given name, see PQsendPrepare. This evpq must be in pipeline mode, and the statement can
+ * then be executed using evpq_query_prepared right away, without waiting.
+ *
+ * This is an internal query, so its results are discarded, and fn_result/fn_done are not called for it. If it fails,
+ * then queries using the statement will fail as well.
+ */
+int evpq_prepare (struct evpq_conn *conn, const char *name, const char *command, int nParams, const Oid *paramTypes);
+
+/*
+ * Execute a prepared statement.
+ *
+ * See evpq_query and PQsendQueryPrepared
+ */
+int evpq_query_prepared (struct evpq_conn *conn, const char *name, int nParams, const char * const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat);
+
+/*
+ * Deallocate a prepared statement, once all the queries that were sent using it have been executed.
+ *
+ * Like evpq_prepare, this is an internal query, and the evpq must be in pipeline mode.
+ */
+int evpq_deallocate (struct evpq_conn *conn, const char *name);
+
+/*
+ * Ask the server to cancel the query that is currently being executed, without blocking, see PQcancelStart. This evpq
+ * must be in the EVPQ_QUERY state.
+ *
+ * The cancel request is sent using a separate connection, and fn_cancelled is called once that is done. The query
+ * itself still completes as usual, most likely with an error. If the query has already completed by the time the
+ * request reaches the server, it may hit the next query instead. Only one cancel may be in progress at a time.
+ *
+ * Returns nonzero if libpq does not support this (only libpq 17 and later do), or it fails to start.
+ */
+int evpq_cancel (struct evpq_conn *conn);
+
 /*
  * Connection state à la evpq.
  */
@@ -104,7 +211,8 @@ const PGconn *evpq_pgconn (struct evpq_conn *conn);
 /*
  * Release the evpq_conn, closing all connections and freeing all resources.
  *
- * You must call this yourself in all cases after evpq_connect returns an evpq_conn.
+ * You must call this yourself in all cases after evpq_connect returns an evpq_conn. This may also be called from
+ * within the fn_result/fn_done callbacks.
  */
 void evpq_release (struct evpq_conn *conn);
 
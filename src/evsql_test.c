@@ -7,6 +7,8 @@
 #include <event2/event.h>
 #include <event2/event_struct.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
 
 #define CONNINFO_DEFAULT ""
 
@@ -88,6 +90,44 @@ void query_send (struct evsql *db, struct evsql_trans *trans) {
     INFO("[evsql_test.query_send] enqueued query, trans=%p: %p: %d", trans, query, query_id);
 }
 
+/*
+ * The query used by most of the below scenarios
+ */
+static struct evsql_query_info add_query_info = {
+    .sql    = "SELECT $1::int4 + 5",
+
+    .params = {
+        {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+        {   0,                  0                   }
+    }
+};
+
+/*
+ * Read the single uint32 value from the given result, and release it
+ */
+uint32_t result_uint32 (struct evsql_result *res) {
+    uint32_t val;
+    err_t err;
+    int ret;
+
+    static struct evsql_result_info result_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    if ((err = evsql_result_begin(&result_info, res)))
+        EFATAL(err, "query failed: %s", err == EIO ? evsql_result_error(res) : "");
+
+    if ((ret = evsql_result_next(res, &val)) <= 0)
+        FATAL("evsql_result_next failed: %d", ret);
+
+    evsql_result_end(res);
+
+    return val;
+}
+
 void trans_commit (struct evsql_test_ctx *ctx) {
     if (evsql_trans_commit(ctx->trans))
         FATAL("evsql_trans_commit failed");
@@ -223,39 +263,1440 @@ void begin_transaction (struct evsql_test_ctx *ctx) {
     INFO("[evsql_test.begin_trans] created transaction");
  }
 
-int main (int argc, char **argv) {
-    struct evsql_test_ctx ctx;
-    struct event_base *ev_base = NULL;
-    struct signals *signals = NULL;
+/*
+ * Queued transaction queries: on a conn that isn't pipelined, the queries and COMMIT wait in the transaction's queue
+ */
+void queue_trans_error (struct evsql_trans *trans, void *arg) {
+    (void) arg;
 
-    const char *db_conninfo;
-    
-    // parse args
-    db_conninfo = CONNINFO_DEFAULT;
-    
-    // init libevent
-    if ((ev_base = event_base_new()) == NULL)
-        ERROR("event_base_new");
-    
-    // setup signals
-    if ((signals = signals_default(ev_base)) == NULL)
-        ERROR("signals_default");
+    FATAL("[evsql_test.queue_trans_error] failure: trans=%p: %s", trans, evsql_trans_error(trans));
+}
 
-    // setup evsql
-    if ((ctx.db = evsql_new_pq(ev_base, db_conninfo, NULL, NULL)) == NULL)
-        ERROR("evsql_new_pq");
+void queue_trans_ready (struct evsql_trans *trans, void *arg) {
+    struct evsql *db = arg;
+    int i;
 
-    // send query
-    query_send(ctx.db, NULL);
+    INFO("[evsql_test.queue_trans_ready] ready, queueing queries and COMMIT");
 
-    // being transaction
-    begin_transaction(&ctx);
+    for (i = 0; i < 3; i++)
+        query_send(db, trans);
 
-    // send query
-    query_send(ctx.db, NULL);
+    if (evsql_trans_commit(trans))
+        FATAL("evsql_trans_commit failed");
+}
 
-    // start query timer
-    query_start(ev_base, ctx.db);
+void queue_trans_done (struct evsql_trans *trans, void *arg) {
+    (void) arg;
+
+    INFO("[evsql_test.queue_trans_done] done: trans=%p", trans);
+}
+
+void queue_trans_start (struct evsql *db) {
+    assert(evsql_trans(db, EVSQL_TRANS_DEFAULT,
+        &queue_trans_error, &queue_trans_ready, &queue_trans_done,
+        db
+    ) != NULL);
+
+    INFO("[evsql_test.queue_trans_start] created transaction");
+}
+
+/*
+ * Pipelined transactions: the queries and COMMIT are all sent without waiting for the earlier ones
+ */
+void pipeline_trans_error (struct evsql_trans *trans, void *arg) {
+    (void) arg;
+
+    FATAL("[evsql_test.pipeline_trans_error] failure: trans=%p: %s", trans, evsql_trans_error(trans));
+}
+
+void pipeline_trans_ready (struct evsql_trans *trans, void *arg) {
+    struct evsql *db = arg;
+    int i;
+
+    INFO("[evsql_test.pipeline_trans_ready] ready, sending queries and COMMIT");
+
+    for (i = 0; i < 3; i++)
+        query_send(db, trans);
+
+    if (evsql_trans_commit(trans))
+        FATAL("evsql_trans_commit failed");
+}
+
+void pipeline_trans_done (struct evsql_trans *trans, void *arg) {
+    (void) arg;
+
+    INFO("[evsql_test.pipeline_trans_done] done: trans=%p", trans);
+}
+
+void pipeline_ready (struct evsql *db, void *arg) {
+    int i;
+
+    (void) arg;
+
+    // two of them on the same conn
+    for (i = 0; i < 2; i++) {
+        struct evsql_trans *trans;
+
+        assert((trans = evsql_trans(db, EVSQL_TRANS_DEFAULT,
+            &pipeline_trans_error, &pipeline_trans_ready, &pipeline_trans_done,
+            db
+        )) != NULL);
+    }
+
+    INFO("[evsql_test.pipeline_ready] created transactions");
+}
+
+struct evsql *pipeline_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    // a single pipelined conn
+    config.max_conns = 1;
+    config.pipeline_depth = 8;
+    config.ready_fn = &pipeline_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Reconnecting with a non-empty queue: the conn is killed while queries are queued behind it, and these must complete
+ * on the new conn
+ */
+void reconnect_kill_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    if (evsql_result_check(res))
+        INFO("[evsql_test.reconnect_kill_res] conn killed: %s", evsql_result_error(res));
+    else
+        WARNING("[evsql_test.reconnect_kill_res] conn survived pg_terminate_backend?");
+
+    evsql_result_free(res);
+}
+
+void reconnect_ready (struct evsql *db, void *arg) {
+    int i;
+
+    (void) arg;
+
+    assert(evsql_query(db, NULL, "SELECT pg_terminate_backend(pg_backend_pid())", reconnect_kill_res, db) != NULL);
+
+    // the only conn is busy, so these are queued
+    for (i = 0; i < 3; i++)
+        query_send(db, NULL);
+
+    INFO("[evsql_test.reconnect_ready] killing conn with queries queued");
+}
+
+struct evsql *reconnect_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    // a single conn, running one query at a time
+    config.max_conns = 1;
+    config.reconnect_min.tv_usec = 100000;
+    config.ready_fn = &reconnect_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Retrying on serialization failures: the first attempt fails with SQLSTATE 40001, and the replay then commits
+ */
+void retry_fail_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    FATAL("[evsql_test.retry_fail_res] got result for query that should have been retried: %s", evsql_result_error(res));
+}
+
+void retry_trans_error (struct evsql_trans *trans, void *arg) {
+    (void) arg;
+
+    FATAL("[evsql_test.retry_trans_error] failure: trans=%p: %s", trans, evsql_trans_error(trans));
+}
+
+void retry_trans_ready (struct evsql_trans *trans, void *arg) {
+    struct evsql *db = arg;
+
+    INFO("[evsql_test.retry_trans_ready] ready, failing with 40001");
+
+    assert(evsql_query(db, trans, "DO $$ BEGIN RAISE EXCEPTION USING ERRCODE = 'serialization_failure'; END $$", retry_fail_res, db) != NULL);
+}
+
+void retry_trans_replay (struct evsql_trans *trans, void *arg) {
+    struct evsql *db = arg;
+
+    INFO("[evsql_test.retry_trans_replay] replaying");
+
+    query_send(db, trans);
+
+    if (evsql_trans_commit(trans))
+        FATAL("evsql_trans_commit failed");
+}
+
+void retry_trans_done (struct evsql_trans *trans, void *arg) {
+    (void) arg;
+
+    INFO("[evsql_test.retry_trans_done] done after retry: trans=%p", trans);
+}
+
+void retry_ready (struct evsql *db, void *arg) {
+    struct evsql_trans *trans;
+
+    (void) arg;
+
+    assert((trans = evsql_trans(db, EVSQL_TRANS_SERIALIZABLE,
+        &retry_trans_error, &retry_trans_ready, &retry_trans_done,
+        db
+    )) != NULL);
+
+    evsql_trans_replay(trans, &retry_trans_replay);
+
+    INFO("[evsql_test.retry_ready] created transaction");
+}
+
+struct evsql *retry_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.trans_retries = 1;
+    config.ready_fn = &retry_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Batches: the queries are sent together, and their query_fn's are called in the order that they were added, followed
+ * by the batch's done_fn
+ */
+#define BATCH_QUERIES 4
+
+static uint32_t batch_seen;
+
+void batch_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    if (val != batch_seen + 5)
+        FATAL("[evsql_test.batch_res] got result %lu out of order, expected %lu", (unsigned long) val, (unsigned long) batch_seen + 5);
+
+    batch_seen++;
+}
+
+void batch_done (struct evsql_batch *batch, void *arg) {
+    (void) arg;
+
+    if (batch_seen != BATCH_QUERIES)
+        FATAL("[evsql_test.batch_done] done after %lu of %d queries", (unsigned long) batch_seen, BATCH_QUERIES);
+
+    INFO("[evsql_test.batch_done] done: batch=%p", batch);
+}
+
+void batch_ready (struct evsql *db, void *arg) {
+    struct evsql_batch *batch;
+    uint32_t i;
+
+    (void) arg;
+
+    assert((batch = evsql_batch(db, &batch_done, db)) != NULL);
+
+    for (i = 0; i < BATCH_QUERIES; i++)
+        assert(evsql_batch_exec(batch, &add_query_info, &batch_res, db, i) != NULL);
+
+    if (evsql_batch_submit(batch))
+        FATAL("evsql_batch_submit failed");
+
+    INFO("[evsql_test.batch_ready] submitted batch of %d queries", BATCH_QUERIES);
+}
+
+struct evsql *batch_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    // a single pipelined conn, so the batch is sent in one go
+    config.max_conns = 1;
+    config.pipeline_depth = 8;
+    config.ready_fn = &batch_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Coalescing: identical queries share the leader's result, which each query_fn releases on its own, so the later ones
+ * must still be able to read it once the earlier ones have released theirs
+ */
+#define COALESCE_QUERIES 3
+
+static int coalesce_seen;
+
+void coalesce_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    if (val != 7 + 5)
+        FATAL("[evsql_test.coalesce_res] got wrong shared result: %lu", (unsigned long) val);
+
+    INFO("[evsql_test.coalesce_res] got shared result %d of %d", ++coalesce_seen, COALESCE_QUERIES);
+}
+
+void coalesce_other_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    // different params, so not coalesced
+    if (val != 8 + 5)
+        FATAL("[evsql_test.coalesce_other_res] got some other query's result: %lu", (unsigned long) val);
+
+    INFO("[evsql_test.coalesce_other_res] got own result");
+}
+
+void coalesce_ready (struct evsql *db, void *arg) {
+    struct evsql_query_opts opts = { 0 };
+    int i;
+
+    (void) arg;
+
+    opts.coalesce = true;
+
+    // the first one is sent, and the others wait for it
+    for (i = 0; i < COALESCE_QUERIES; i++)
+        assert(evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &coalesce_res, db, (uint32_t) 7) != NULL);
+
+    assert(evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &coalesce_other_res, db, (uint32_t) 8) != NULL);
+
+    INFO("[evsql_test.coalesce_ready] sent coalesced queries");
+}
+
+struct evsql *coalesce_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    // a single conn, so the leader is still in flight
+    config.max_conns = 1;
+    config.ready_fn = &coalesce_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Streamed results: the rows are given to row_fn as they arrive, in order, and query_fn then gets an empty result
+ */
+#define STREAM_ROWS 10
+
+static uint32_t stream_rows;
+
+void stream_row (struct evsql_result *res, void *arg) {
+    uint32_t val;
+    err_t err;
+    int ret;
+
+    static struct evsql_result_info result_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    if ((err = evsql_result_begin(&result_info, res)))
+        EFATAL(err, "query failed: %s", err == EIO ? evsql_result_error(res) : "");
+
+    // one or more rows, the result is released for us
+    while ((ret = evsql_result_next(res, &val)) > 0) {
+        if (val != ++stream_rows)
+            FATAL("[evsql_test.stream_row] got row %lu, expected %lu", (unsigned long) val, (unsigned long) stream_rows);
+    }
+
+    if (ret)
+        FATAL("evsql_result_next failed: %d", ret);
+
+    INFO("[evsql_test.stream_row] got %zu rows, %lu so far", evsql_result_rows(res), (unsigned long) stream_rows);
+}
+
+void stream_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    if (evsql_result_check(res))
+        FATAL("[evsql_test.stream_res] query failed: %s", evsql_result_error(res));
+
+    if (evsql_result_rows(res) || stream_rows != STREAM_ROWS)
+        FATAL("[evsql_test.stream_res] got %zu rows at the end, after %lu streamed", evsql_result_rows(res), (unsigned long) stream_rows);
+
+    INFO("[evsql_test.stream_res] done");
+
+    evsql_result_free(res);
+}
+
+void stream_ready (struct evsql *db, void *arg) {
+    struct evsql_query_opts opts = { 0 };
+
+    static struct evsql_query_info query_info = {
+        .sql    = "SELECT generate_series(1, $1::int4)",
+
+        .params = {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    opts.row_fn = &stream_row;
+    opts.chunk_rows = 3;
+
+    assert(evsql_query_exec_opts(db, NULL, &query_info, &opts, &stream_res, db, (uint32_t) STREAM_ROWS) != NULL);
+
+    INFO("[evsql_test.stream_ready] sent streamed query");
+}
+
+struct evsql *stream_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.ready_fn = &stream_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Cursors: the rows are FETCH'd a page at a time, in order, and done_fn is called once the last page was handled
+ */
+#define CURSOR_ROWS 10
+#define CURSOR_PAGE_ROWS 4
+
+static uint32_t cursor_rows;
+
+void cursor_page (struct evsql_cursor *cursor, struct evsql_result *res, void *arg) {
+    uint32_t val;
+    err_t err;
+    int ret;
+
+    static struct evsql_result_info result_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    if ((err = evsql_result_begin(&result_info, res)))
+        EFATAL(err, "query failed: %s", err == EIO ? evsql_result_error(res) : "");
+
+    if (evsql_result_rows(res) > CURSOR_PAGE_ROWS)
+        FATAL("[evsql_test.cursor_page] got %zu rows in a page of %d", evsql_result_rows(res), CURSOR_PAGE_ROWS);
+
+    while ((ret = evsql_result_next(res, &val)) > 0) {
+        if (val != ++cursor_rows)
+            FATAL("[evsql_test.cursor_page] got row %lu, expected %lu", (unsigned long) val, (unsigned long) cursor_rows);
+    }
+
+    if (ret)
+        FATAL("evsql_result_next failed: %d", ret);
+
+    INFO("[evsql_test.cursor_page] cursor=%p: got %zu rows", cursor, evsql_result_rows(res));
+
+    evsql_result_end(res);
+}
+
+void cursor_done (struct evsql_cursor *cursor, evsql_err_t err, void *arg) {
+    (void) arg;
+
+    if (err)
+        EFATAL(err, "[evsql_test.cursor_done] cursor failed");
+
+    if (cursor_rows != CURSOR_ROWS)
+        FATAL("[evsql_test.cursor_done] done after %lu of %d rows", (unsigned long) cursor_rows, CURSOR_ROWS);
+
+    INFO("[evsql_test.cursor_done] done: cursor=%p", cursor);
+}
+
+void cursor_ready (struct evsql *db, void *arg) {
+    static struct evsql_query_info query_info = {
+        .sql    = "SELECT generate_series(1, $1::int4)",
+
+        .params = {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    assert(evsql_cursor(db, &query_info, CURSOR_PAGE_ROWS, &cursor_page, &cursor_done, db, (uint32_t) CURSOR_ROWS) != NULL);
+
+    INFO("[evsql_test.cursor_ready] opened cursor");
+}
+
+struct evsql *cursor_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.ready_fn = &cursor_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Timeouts: a running query that takes too long, and a query that waits in the queue behind it for too long, are both
+ * failed with ETIMEDOUT
+ */
+void timeout_res (struct evsql_result *res, void *arg) {
+    const char *what = arg;
+    err_t err;
+
+    if ((err = evsql_result_check(res)) != ETIMEDOUT)
+        FATAL("[evsql_test.timeout_res] %s query did not time out: %u: %s", what, err, evsql_result_error(res));
+
+    INFO("[evsql_test.timeout_res] %s query timed out", what);
+
+    evsql_result_free(res);
+}
+
+void timeout_ready (struct evsql *db, void *arg) {
+    struct evsql_query_opts opts = { 0 };
+
+    static struct evsql_query_info query_info = {
+        .sql    = "SELECT pg_sleep(2)",
+
+        .params = {
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    opts.timeout.tv_usec = 300000;
+
+    assert(evsql_query_exec_opts(db, NULL, &query_info, &opts, &timeout_res, "running") != NULL);
+
+    // the only conn is busy, so this waits for longer than the queue_timeout
+    assert(evsql_query(db, NULL, "SELECT 1", &timeout_res, "queued") != NULL);
+
+    INFO("[evsql_test.timeout_ready] sent queries that should time out");
+}
+
+struct evsql *timeout_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.max_conns = 1;
+    config.queue_timeout.tv_usec = 100000;
+    config.timer_resolution.tv_usec = 50000;
+    config.ready_fn = &timeout_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Aborting queries: a queued query is dropped, a coalesced one leaves its leader running, and a running one is
+ * cancelled on the server, and none of their query_fn's are called
+ */
+void abort_fail_res (struct evsql_result *res, void *arg) {
+    const char *what = arg;
+
+    FATAL("[evsql_test.abort_fail_res] got result for aborted %s query: %s", what, evsql_result_error(res));
+}
+
+void abort_leader_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    if (val != 1 + 5)
+        FATAL("[evsql_test.abort_leader_res] got wrong result: %lu", (unsigned long) val);
+
+    INFO("[evsql_test.abort_leader_res] coalesced query's leader completed");
+}
+
+void abort_after_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    if (val != 2 + 5)
+        FATAL("[evsql_test.abort_after_res] got wrong result: %lu", (unsigned long) val);
+
+    INFO("[evsql_test.abort_after_res] query after the aborted ones completed");
+}
+
+void abort_ready (struct evsql *db, void *arg) {
+    struct evsql_query_opts opts = { 0 };
+    struct evsql_query *running, *coalesced, *queued;
+
+    static struct evsql_query_info sleep_info = {
+        .sql    = "SELECT pg_sleep(2)",
+
+        .params = {
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    // one on each conn
+    assert((running = evsql_query_exec(db, NULL, &sleep_info, &abort_fail_res, "running")) != NULL);
+
+    opts.coalesce = true;
+
+    assert(evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &abort_leader_res, db, (uint32_t) 1) != NULL);
+    assert((coalesced = evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &abort_fail_res, "coalesced", (uint32_t) 1)) != NULL);
+
+    // both conns are busy
+    assert((queued = evsql_query(db, NULL, "SELECT 1", &abort_fail_res, "queued")) != NULL);
+
+    evsql_query_abort(NULL, queued);
+    evsql_query_abort(NULL, coalesced);
+    evsql_query_abort(NULL, running);
+
+    // goes after the cancel
+    assert(evsql_query_exec(db, NULL, &add_query_info, &abort_after_res, db, (uint32_t) 2) != NULL);
+
+    INFO("[evsql_test.abort_ready] aborted queries");
+}
+
+struct evsql *abort_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    // two conns, one for the running query and one for the rest, which can then send the cancel
+    config.max_conns = 2;
+    config.prewarm = 2;
+    config.prewarm_ready = 2;
+    config.ready_fn = &abort_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Statement cache: with room for just one statement, alternating between two queries evicts the other one each time,
+ * and a statement that was deallocated behind our back fails once with SQLSTATE 26000, and is then prepared again
+ */
+static struct evsql_query_info stmt_a_info = {
+    .sql    = "SELECT $1::int4 + 5",
+
+    .params = {
+        {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+        {   0,                  0                   }
+    }
+};
+
+static struct evsql_query_info stmt_b_info = {
+    .sql    = "SELECT $1::int4 + 6",
+
+    .params = {
+        {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+        {   0,                  0                   }
+    }
+};
+
+static int stmt_step;
+
+void stmt_next (struct evsql *db);
+
+void stmt_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+    uint32_t val = result_uint32(res);
+    int step = stmt_step - 1;
+
+    // A, B, A, (DEALLOCATE), (A fails), A
+    if (val != (step == 1 ? 7 : 6))
+        FATAL("[evsql_test.stmt_res] step %d: got wrong result: %lu", step, (unsigned long) val);
+
+    INFO("[evsql_test.stmt_res] step %d: ok", step);
+
+    stmt_next(db);
+}
+
+void stmt_dealloc_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+
+    if (evsql_result_check(res))
+        FATAL("[evsql_test.stmt_dealloc_res] DEALLOCATE ALL failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    stmt_next(db);
+}
+
+void stmt_missing_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+
+    if (evsql_result_check(res) != EIO)
+        FATAL("[evsql_test.stmt_missing_res] deallocated statement did not fail");
+
+    INFO("[evsql_test.stmt_missing_res] deallocated statement failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    stmt_next(db);
+}
+
+void stmt_next (struct evsql *db) {
+    switch (stmt_step++) {
+        case 0:
+        case 2:
+        case 5:
+            assert(evsql_query_exec(db, NULL, &stmt_a_info, &stmt_res, db, (uint32_t) 1) != NULL);
+            break;
+
+        case 1:
+            assert(evsql_query_exec(db, NULL, &stmt_b_info, &stmt_res, db, (uint32_t) 1) != NULL);
+            break;
+
+        case 3:
+            assert(evsql_query(db, NULL, "DEALLOCATE ALL", &stmt_dealloc_res, db) != NULL);
+            break;
+
+        case 4:
+            assert(evsql_query_exec(db, NULL, &stmt_a_info, &stmt_missing_res, db, (uint32_t) 1) != NULL);
+            break;
+
+        default:
+            INFO("[evsql_test.stmt_next] done");
+    }
+}
+
+void stmt_ready (struct evsql *db, void *arg) {
+    (void) arg;
+
+    stmt_next(db);
+}
+
+struct evsql *stmt_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.max_conns = 1;
+    config.stmt_cache = 1;
+    config.ready_fn = &stmt_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Prepare-on-connect: the registered statement is prepared on each conn as it connects, so it can be executed on
+ * either of them right away
+ */
+static struct evsql_query_info prepare_info = {
+    .sql    = "SELECT $1::int4 + 5",
+
+    .params = {
+        {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+        {   0,                  0                   }
+    }
+};
+
+void prepare_res (struct evsql_result *res, void *arg) {
+    uint32_t val = result_uint32(res);
+
+    (void) arg;
+
+    if (val != 3 + 5)
+        FATAL("[evsql_test.prepare_res] got wrong result: %lu", (unsigned long) val);
+
+    INFO("[evsql_test.prepare_res] prepared statement executed");
+}
+
+void prepare_ready (struct evsql *db, void *arg) {
+    int i;
+
+    (void) arg;
+
+    // one on each conn
+    for (i = 0; i < 2; i++)
+        assert(evsql_query_exec(db, NULL, &prepare_info, &prepare_res, db, (uint32_t) 3) != NULL);
+
+    INFO("[evsql_test.prepare_ready] sent prepared queries");
+}
+
+struct evsql *prepare_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+    struct evsql *db;
+
+    config.max_conns = 2;
+    config.prewarm = 2;
+    config.prewarm_ready = 2;
+    config.ready_fn = &prepare_ready;
+
+    if ((db = evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL)) == NULL)
+        return NULL;
+
+    // before the conns are connected
+    if (evsql_prepare(db, &prepare_info))
+        FATAL("evsql_prepare failed");
+
+    return db;
+}
+
+/*
+ * Result layout: evsql_result_begin rejects a result_info with the wrong number of columns or a wrongly sized column,
+ * and the rows can then be read using the right one
+ */
+void layout_res (struct evsql_result *res, void *arg) {
+    uint64_t id;
+    const char *str;
+    err_t err;
+
+    static struct evsql_result_info short_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT64   },
+            {   0,                  0                   }
+        }
+    };
+
+    static struct evsql_result_info size_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_STRING   },
+            {   0,                  0                   }
+        }
+    };
+
+    static struct evsql_result_info result_info = {
+        0, {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT64   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_STRING   },
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    if ((err = evsql_result_begin(&short_info, res)) != EINVAL)
+        FATAL("[evsql_test.layout_res] wrong number of columns not rejected: %u", err);
+
+    if ((err = evsql_result_begin(&size_info, res)) != EINVAL)
+        FATAL("[evsql_test.layout_res] wrong column size not rejected: %u", err);
+
+    if ((err = evsql_result_begin(&result_info, res)))
+        EFATAL(err, "query failed: %s", err == EIO ? evsql_result_error(res) : "");
+
+    if (evsql_result_next(res, &id, &str) <= 0)
+        FATAL("evsql_result_next failed");
+
+    if (id != 1 || strcmp(str, "foo"))
+        FATAL("[evsql_test.layout_res] got wrong row: %lu %s", (unsigned long) id, str);
+
+    INFO("[evsql_test.layout_res] layout checked");
+
+    evsql_result_end(res);
+}
+
+void layout_ready (struct evsql *db, void *arg) {
+    static struct evsql_query_info query_info = {
+        .sql    = "SELECT 1::int8, 'foo'::text",
+
+        .params = {
+            {   0,                  0                   }
+        }
+    };
+
+    (void) arg;
+
+    assert(evsql_query_exec(db, NULL, &query_info, &layout_res, db) != NULL);
+}
+
+struct evsql *layout_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.ready_fn = &layout_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Many params: queries with more params than fit inline in the query, using both a query_info and explicit params
+ */
+#define MANY_SQL "SELECT $1::int4 + $2::int4 + $3::int4 + $4::int4 + $5::int4 + $6::int4 + $7::int4 + $8::int4 + $9::int4 + $10::int4"
+
+void many_res (struct evsql_result *res, void *arg) {
+    const char *what = arg;
+    uint32_t val = result_uint32(res);
+
+    if (val != 55)
+        FATAL("[evsql_test.many_res] %s: got wrong sum: %lu", what, (unsigned long) val);
+
+    INFO("[evsql_test.many_res] %s: ok", what);
+}
+
+void many_ready (struct evsql *db, void *arg) {
+    size_t i;
+
+    static struct evsql_query_info query_info = {
+        .sql    = MANY_SQL,
+
+        .params = {
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   EVSQL_FMT_BINARY,   EVSQL_TYPE_UINT32   },
+            {   0,                  0                   }
+        }
+    };
+
+    static struct evsql_query_params params = EVSQL_PARAMS(EVSQL_FMT_BINARY) {
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+        EVSQL_PARAM ( UINT32 ),
+
+        EVSQL_PARAMS_END
+    };
+
+    (void) arg;
+
+    assert(evsql_query_exec(db, NULL, &query_info, &many_res, "query_info",
+        (uint32_t) 1, (uint32_t) 2, (uint32_t) 3, (uint32_t) 4, (uint32_t) 5,
+        (uint32_t) 6, (uint32_t) 7, (uint32_t) 8, (uint32_t) 9, (uint32_t) 10
+    ) != NULL);
+
+    for (i = 0; i < 10; i++)
+        assert(evsql_param_uint32(&params, i, i + 1) == 0);
+
+    assert(evsql_query_params(db, NULL, MANY_SQL, &params, &many_res, "params") != NULL);
+
+    INFO("[evsql_test.many_ready] sent queries with many params");
+}
+
+struct evsql *many_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.ready_fn = &many_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Custom allocator: the evsql's objects come from the given allocator, and freed query objects are reused
+ */
+struct alloc_counts {
+    size_t allocs, frees, bytes;
+};
+
+static struct alloc_counts alloc_counts;
+
+void *alloc_test_alloc (size_t size, void *arg) {
+    struct alloc_counts *counts = arg;
+
+    counts->allocs++;
+    counts->bytes += size;
+
+    return malloc(size);
+}
+
+void alloc_test_free (void *ptr, size_t size, void *arg) {
+    struct alloc_counts *counts = arg;
+
+    counts->frees++;
+    counts->bytes -= size;
+
+    free(ptr);
+}
+
+void alloc_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+    struct evsql_stats stats;
+    uint32_t val = result_uint32(res);
+
+    if (val < 3 + 5) {
+        // the next one is allocated while this one is still in use
+        assert(evsql_query_exec(db, NULL, &add_query_info, &alloc_res, db, val - 5 + 1) != NULL);
+
+        return;
+    }
+
+    evsql_stats(db, &stats);
+
+    INFO("[evsql_test.alloc_res] %zu allocs, %zu frees, %zu bytes in use, %zu/%zu query objects allocated",
+        alloc_counts.allocs, alloc_counts.frees, alloc_counts.bytes, stats.queries.sys_allocs, stats.queries.allocs
+    );
+
+    if (alloc_counts.allocs < stats.conns.sys_allocs + stats.queries.sys_allocs)
+        FATAL("[evsql_test.alloc_res] allocator was not used");
+
+    // the third one reused the first one
+    if (stats.queries.sys_allocs >= stats.queries.allocs)
+        FATAL("[evsql_test.alloc_res] freed query objects were not reused");
+}
+
+void alloc_ready (struct evsql *db, void *arg) {
+    (void) arg;
+
+    assert(evsql_query_exec(db, NULL, &add_query_info, &alloc_res, db, (uint32_t) 1) != NULL);
+}
+
+struct evsql *alloc_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.allocator.alloc_fn = &alloc_test_alloc;
+    config.allocator.free_fn = &alloc_test_free;
+    config.allocator.arg = &alloc_counts;
+    config.ready_fn = &alloc_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Transaction scripts: the statements' query_fn's are called in order once the transaction has commited, and if one
+ * fails, only its query_fn is called
+ */
+static int script_seen;
+
+void script_res (struct evsql_result *res, void *arg) {
+    uint32_t expected = (uintptr_t) arg;
+    uint32_t val = result_uint32(res);
+
+    if (val != expected)
+        FATAL("[evsql_test.script_res] statement %d: got %lu, expected %lu", script_seen, (unsigned long) val, (unsigned long) expected);
+
+    script_seen++;
+}
+
+void script_done (struct evsql_script *script, evsql_err_t err, void *arg) {
+    (void) arg;
+
+    if (err)
+        EFATAL(err, "[evsql_test.script_done] script failed");
+
+    if (script_seen != 2)
+        FATAL("[evsql_test.script_done] done after %d of 2 statements", script_seen);
+
+    INFO("[evsql_test.script_done] done: script=%p", script);
+}
+
+void script_skipped_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    FATAL("[evsql_test.script_skipped_res] got result for statement of failed script: %s", evsql_result_error(res));
+}
+
+void script_failed_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    if (evsql_result_check(res) != EIO)
+        FATAL("[evsql_test.script_failed_res] statement did not fail");
+
+    INFO("[evsql_test.script_failed_res] statement failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+}
+
+void script_failed_done (struct evsql_script *script, evsql_err_t err, void *arg) {
+    (void) arg;
+
+    if (!err)
+        FATAL("[evsql_test.script_failed_done] failed script was commited");
+
+    INFO("[evsql_test.script_failed_done] done: script=%p: %u", script, err);
+}
+
+void script_ready (struct evsql *db, void *arg) {
+    static struct evsql_query_info two_info = {
+        .sql    = "SELECT 2::int4",
+
+        .params = {
+            {   0,                  0                   }
+        }
+    };
+
+    static struct evsql_query_info fail_info = {
+        .sql    = "SELECT 1 / 0",
+
+        .params = {
+            {   0,                  0                   }
+        }
+    };
+
+    static struct evsql_query_params params = EVSQL_PARAMS(EVSQL_FMT_BINARY) {
+        EVSQL_PARAM ( UINT32 ),
+
+        EVSQL_PARAMS_END
+    };
+
+    struct evsql_script_stmt stmts[] = {
+        { &add_query_info,  &params,    &script_res,            (void *) (uintptr_t) (1 + 5)    },
+        { &two_info,        NULL,       &script_res,            (void *) (uintptr_t) 2          },
+    };
+
+    struct evsql_script_stmt failed_stmts[] = {
+        { &add_query_info,  &params,    &script_skipped_res,    NULL                            },
+        { &fail_info,       NULL,       &script_failed_res,     NULL                            },
+        { &two_info,        NULL,       &script_skipped_res,    NULL                            },
+    };
+
+    (void) arg;
+
+    assert(evsql_param_uint32(&params, 0, 1) == 0);
+
+    assert(evsql_trans_script(db, EVSQL_TRANS_DEFAULT, stmts, 2, &script_done, db) != NULL);
+    assert(evsql_trans_script(db, EVSQL_TRANS_DEFAULT, failed_stmts, 3, &script_failed_done, db) != NULL);
+
+    INFO("[evsql_test.script_ready] started scripts");
+}
+
+struct evsql *script_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.ready_fn = &script_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Priorities: the queries queued behind a blocking one are sent in priority order, or taking turns by their weights
+ */
+struct prio_test {
+    // the expected order, by the first letter of each priority
+    const char *expect;
+
+    size_t seen;
+};
+
+void prio_res (struct evsql_result *res, void *arg) {
+    struct prio_test *test = arg;
+    char got = "NHL"[result_uint32(res) - 5];
+
+    if (got != test->expect[test->seen])
+        FATAL("[evsql_test.prio_res] %s: got %c at %zu", test->expect, got, test->seen);
+
+    if (!test->expect[++test->seen])
+        INFO("[evsql_test.prio_res] %s: done", test->expect);
+}
+
+void prio_block_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    if (evsql_result_check(res))
+        FATAL("[evsql_test.prio_block_res] query failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+}
+
+void prio_send (struct evsql *db, struct prio_test *test, const char *order) {
+    struct evsql_query_opts opts = { 0 };
+
+    // keep the only conn busy, so the rest are queued
+    assert(evsql_query(db, NULL, "SELECT pg_sleep(0.2)", &prio_block_res, test) != NULL);
+
+    for (; *order; order++) {
+        opts.priority = strchr("NHL", *order) - "NHL";
+
+        assert(evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &prio_res, test, (uint32_t) opts.priority) != NULL);
+    }
+}
+
+void prio_strict_ready (struct evsql *db, void *arg) {
+    static struct prio_test test = { "HNL", 0 };
+
+    (void) arg;
+
+    prio_send(db, &test, "LNH");
+}
+
+void prio_weighted_ready (struct evsql *db, void *arg) {
+    static struct prio_test test = { "HHNLHNL", 0 };
+
+    (void) arg;
+
+    prio_send(db, &test, "LLNNHHH");
+}
+
+struct evsql *prio_start (struct event_base *ev_base, const char *db_conninfo, bool weighted) {
+    struct evsql_config config = { 0 };
+
+    config.max_conns = 1;
+
+    if (weighted) {
+        config.priority_weights[EVSQL_PRIORITY_NORMAL] = 1;
+        config.priority_weights[EVSQL_PRIORITY_HIGH] = 2;
+        config.priority_weights[EVSQL_PRIORITY_LOW] = 1;
+        config.ready_fn = &prio_weighted_ready;
+
+    } else {
+        config.ready_fn = &prio_strict_ready;
+    }
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+/*
+ * Deadlines and admission: a query whose deadline has already passed is rejected right away, one whose deadline passes
+ * while queued expires, and once the queue is full, further queries are rejected with EAGAIN
+ */
+#define DEADLINE_MAX_QUEUE 3
+
+static int deadline_ok;
+
+void deadline_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+    struct evsql_stats stats;
+    err_t err;
+
+    if ((err = evsql_result_check(res)))
+        FATAL("[evsql_test.deadline_res] query failed: %u: %s", err, evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    if (++deadline_ok < 3)
+        // wait for the blocking query and both of the queued ones
+        return;
+
+    evsql_stats(db, &stats);
+
+    if (!stats.queue.rejected || !stats.queue.expired)
+        FATAL("[evsql_test.deadline_res] %zu queries rejected, %zu expired", stats.queue.rejected, stats.queue.expired);
+
+    INFO("[evsql_test.deadline_res] done: %zu queries rejected, %zu expired", stats.queue.rejected, stats.queue.expired);
+}
+
+void deadline_expired_res (struct evsql_result *res, void *arg) {
+    err_t err;
+
+    (void) arg;
+
+    if ((err = evsql_result_check(res)) != ETIMEDOUT)
+        FATAL("[evsql_test.deadline_expired_res] query did not expire: %u: %s", err, evsql_result_error(res));
+
+    INFO("[evsql_test.deadline_expired_res] query expired in the queue");
+
+    evsql_result_free(res);
+}
+
+void deadline_fail_res (struct evsql_result *res, void *arg) {
+    (void) arg;
+
+    FATAL("[evsql_test.deadline_fail_res] got result for rejected query: %s", evsql_result_error(res));
+}
+
+void deadline_ready (struct evsql *db, void *arg) {
+    struct event_base *ev_base = arg;
+    struct evsql_query_opts opts = { 0 };
+    struct timeval now, tv = { 0, 100000 };
+
+    assert(event_base_gettimeofday_cached(ev_base, &now) == 0);
+
+    // keep the only conn busy, so the rest are queued
+    assert(evsql_query(db, NULL, "SELECT pg_sleep(0.5)", &deadline_res, db) != NULL);
+
+    // already passed
+    evutil_timersub(&now, &tv, &opts.deadline);
+
+    if (evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &deadline_fail_res, db, (uint32_t) 1) || errno != ETIMEDOUT)
+        FATAL("[evsql_test.deadline_ready] query past its deadline was not rejected");
+
+    // passes while queued
+    evutil_timeradd(&now, &tv, &opts.deadline);
+
+    assert(evsql_query_exec_opts(db, NULL, &add_query_info, &opts, &deadline_expired_res, db, (uint32_t) 1) != NULL);
+
+    // fill up the queue
+    assert(evsql_query_exec(db, NULL, &add_query_info, &deadline_res, db, (uint32_t) 1) != NULL);
+    assert(evsql_query_exec(db, NULL, &add_query_info, &deadline_res, db, (uint32_t) 1) != NULL);
+
+    if (evsql_query_exec(db, NULL, &add_query_info, &deadline_fail_res, db, (uint32_t) 1) || errno != EAGAIN)
+        FATAL("[evsql_test.deadline_ready] query was not rejected from a full queue");
+
+    INFO("[evsql_test.deadline_ready] queries rejected");
+}
+
+struct evsql *deadline_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.max_conns = 1;
+    config.max_queue = DEADLINE_MAX_QUEUE;
+    config.ready_fn = &deadline_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, ev_base);
+}
+
+/*
+ * Pressure: queueing up to queue_high puts the evsql under pressure, and it is relieved once the queue has drained down
+ * to queue_low, with pressure_fn called once for each
+ */
+#define PRESSURE_QUEUED 3
+
+static int pressure_changes, pressure_done;
+
+void pressure_changed (struct evsql *db, bool high, void *arg) {
+    (void) arg;
+
+    // high, then low
+    if (high != !pressure_changes++)
+        FATAL("[evsql_test.pressure_changed] unexpected change %d: high=%d", pressure_changes, high);
+
+    if (evsql_pressure(db, NULL) != high)
+        FATAL("[evsql_test.pressure_changed] evsql_pressure disagrees");
+
+    INFO("[evsql_test.pressure_changed] high=%d", high);
+}
+
+void pressure_res (struct evsql_result *res, void *arg) {
+    struct evsql *db = arg;
+    struct evsql_pressure pressure;
+
+    if (evsql_result_check(res))
+        FATAL("[evsql_test.pressure_res] query failed: %s", evsql_result_error(res));
+
+    evsql_result_free(res);
+
+    if (++pressure_done <= PRESSURE_QUEUED)
+        // the blocking query and the queued ones before the last
+        return;
+
+    if (evsql_pressure(db, &pressure) || pressure_changes != 2)
+        FATAL("[evsql_test.pressure_res] still under pressure after %d changes: %zu queued", pressure_changes, pressure.queued);
+
+    INFO("[evsql_test.pressure_res] done");
+}
+
+void pressure_ready (struct evsql *db, void *arg) {
+    struct evsql_pressure pressure;
+    int i;
+
+    (void) arg;
+
+    // keep the only conn busy, so the rest are queued
+    assert(evsql_query(db, NULL, "SELECT pg_sleep(0.2)", &pressure_res, db) != NULL);
+
+    for (i = 0; i < PRESSURE_QUEUED; i++)
+        assert(evsql_query(db, NULL, "SELECT 1", &pressure_res, db) != NULL);
+
+    // right away, even though pressure_fn is only called from the event loop
+    if (!evsql_pressure(db, &pressure) || pressure.queued != PRESSURE_QUEUED)
+        FATAL("[evsql_test.pressure_ready] not under pressure with %zu queued", pressure.queued);
+
+    INFO("[evsql_test.pressure_ready] under pressure");
+}
+
+struct evsql *pressure_start (struct event_base *ev_base, const char *db_conninfo) {
+    struct evsql_config config = { 0 };
+
+    config.max_conns = 1;
+    config.queue_high = PRESSURE_QUEUED;
+    config.queue_low = 1;
+    config.pressure_fn = &pressure_changed;
+    config.ready_fn = &pressure_ready;
+
+    return evsql_new_pq_config(ev_base, db_conninfo, &config, NULL, NULL);
+}
+
+int main (int argc, char **argv) {
+    struct evsql_test_ctx ctx;
+    struct event_base *ev_base = NULL;
+    struct signals *signals = NULL;
+
+    const char *db_conninfo;
+    
+    // parse args
+    db_conninfo = CONNINFO_DEFAULT;
+    
+    // init libevent
+    if ((ev_base = event_base_new()) == NULL)
+        ERROR("event_base_new");
+    
+    // setup signals
+    if ((signals = signals_default(ev_base)) == NULL)
+        ERROR("signals_default");
+
+    // setup evsql
+    if ((ctx.db = evsql_new_pq(ev_base, db_conninfo, NULL, NULL)) == NULL)
+        ERROR("evsql_new_pq");
+
+    // send query
+    query_send(ctx.db, NULL);
+
+    // being transaction
+    begin_transaction(&ctx);
+
+    // send query
+    query_send(ctx.db, NULL);
+
+    // start query timer
+    query_start(ev_base, ctx.db);
+
+    // queued transaction queries, without pipelining
+    queue_trans_start(ctx.db);
+
+    // pipelined transactions
+    if (pipeline_start(ev_base, db_conninfo) == NULL)
+        ERROR("pipeline_start");
+
+    // reconnecting with queued queries
+    if (reconnect_start(ev_base, db_conninfo) == NULL)
+        ERROR("reconnect_start");
+
+    // retrying serialization failures
+    if (retry_start(ev_base, db_conninfo) == NULL)
+        ERROR("retry_start");
+
+    // batches
+    if (batch_start(ev_base, db_conninfo) == NULL)
+        ERROR("batch_start");
+
+    // coalesced queries
+    if (coalesce_start(ev_base, db_conninfo) == NULL)
+        ERROR("coalesce_start");
+
+    // streamed results
+    if (stream_start(ev_base, db_conninfo) == NULL)
+        ERROR("stream_start");
+
+    // cursors
+    if (cursor_start(ev_base, db_conninfo) == NULL)
+        ERROR("cursor_start");
+
+    // timeouts
+    if (timeout_start(ev_base, db_conninfo) == NULL)
+        ERROR("timeout_start");
+
+    // aborting queries
+    if (abort_start(ev_base, db_conninfo) == NULL)
+        ERROR("abort_start");
+
+    // statement cache eviction
+    if (stmt_start(ev_base, db_conninfo) == NULL)
+        ERROR("stmt_start");
+
+    // prepare-on-connect
+    if (prepare_start(ev_base, db_conninfo) == NULL)
+        ERROR("prepare_start");
+
+    // result layout checks
+    if (layout_start(ev_base, db_conninfo) == NULL)
+        ERROR("layout_start");
+
+    // many params
+    if (many_start(ev_base, db_conninfo) == NULL)
+        ERROR("many_start");
+
+    // custom allocator
+    if (alloc_start(ev_base, db_conninfo) == NULL)
+        ERROR("alloc_start");
+
+    // transaction scripts
+    if (script_start(ev_base, db_conninfo) == NULL)
+        ERROR("script_start");
+
+    // strict and weighted priorities
+    if (prio_start(ev_base, db_conninfo, false) == NULL)
+        ERROR("prio_start");
+
+    if (prio_start(ev_base, db_conninfo, true) == NULL)
+        ERROR("prio_start");
+
+    // deadlines and admission
+    if (deadline_start(ev_base, db_conninfo) == NULL)
+        ERROR("deadline_start");
+
+    // backpressure
+    if (pressure_start(ev_base, db_conninfo) == NULL)
+        ERROR("pressure_start");
 
     // run libevent
     INFO("[evsql_test.main] running libevent loop");
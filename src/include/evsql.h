@@ -13,14 +13,16 @@
  *
  * The order of function calls and callbacks goes something like this:
  *
- *  -   evsql_new_pq()
+ *  -   evsql_set_allocator(), evsql_new_pq()
  *
- *  -   evsql_trans()
+ *  -   evsql_trans(), evsql_trans_replay()
  *      -   evsql_trans_abort()
  *      -   evsql_trans_error_cb()
  *      -   evsql_trans_ready_cb()
  *
- *  -   evsql_query(), \ref evsql_param_ + evsql_query_params(), evsql_query_exec()
+ *  -   evsql_prepare()
+ *
+ *  -   evsql_query(), \ref evsql_param_ + evsql_query_params(), evsql_query_exec(), evsql_query_exec_opts()
  *      -   evsql_query_abort()
  *      -   evsql_query_cb()
  *          -   \ref evsql_result_
@@ -29,11 +31,27 @@
  *  -   evsql_trans_commit()
  *      -   evsql_trans_done_cb()
  *
+ *  -   evsql_batch(), evsql_batch_exec()/evsql_batch_params(), evsql_batch_submit()
+ *      -   evsql_query_cb()
+ *      -   evsql_batch_done_cb()
+ *
+ *  -   evsql_trans_script()
+ *      -   evsql_script_abort()
+ *      -   evsql_query_cb()
+ *      -   evsql_script_done_cb()
+ *
+ *  -   evsql_cursor()
+ *      -   evsql_cursor_abort()
+ *      -   evsql_cursor_page_cb()
+ *          -   \ref evsql_result_
+ *      -   evsql_cursor_done_cb()
+ *
  */
 
 /**
  * System includes
  */
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <event2/event.h>
@@ -70,6 +88,33 @@ struct evsql_trans;
  */
 struct evsql_query;
 
+/**
+ * @struct evsql_batch
+ *
+ * Opaque batch handle returned by evsql_batch() and used for the \ref evsql_batch_ functions
+ *
+ * @see \ref evsql_batch_
+ */
+struct evsql_batch;
+
+/**
+ * @struct evsql_cursor
+ *
+ * Opaque cursor handle returned by evsql_cursor() and used for evsql_cursor_abort()
+ *
+ * @see \ref evsql_cursor_
+ */
+struct evsql_cursor;
+
+/**
+ * @struct evsql_script
+ *
+ * Opaque transaction script handle returned by evsql_trans_script() and used for evsql_script_abort()
+ *
+ * @see \ref evsql_script_
+ */
+struct evsql_script;
+
 /**
  * @struct evsql_result
  *
@@ -93,6 +138,30 @@ enum evsql_trans_type {
     EVSQL_TRANS_READ_UNCOMMITTED,
 };
 
+/**
+ * Priority classes for queued transactionless queries, each of which has a queue of its own.
+ *
+ * The priority can only be given using evsql_query_exec_opts(). Transactionless queries from every other entry point,
+ * including the ones in an evsql_batch(), are always EVSQL_PRIORITY_NORMAL. Transactions, including the ones used by
+ * evsql_cursor() and evsql_trans_script(), wait for a connection of their own instead, and have no priority.
+ *
+ * @see evsql_query_opts
+ * @see evsql_config
+ */
+enum evsql_priority {
+    /** The default */
+    EVSQL_PRIORITY_NORMAL,
+
+    /** Latency-sensitive queries, sent ahead of the others */
+    EVSQL_PRIORITY_HIGH,
+
+    /** Background queries, sent after the others, and optionally on a limited number of connections */
+    EVSQL_PRIORITY_LOW,
+
+    /** Number of priority classes */
+    EVSQL_PRIORITY_MAX
+};
+
 /**
  * An item can be in different formats, the classical text-based format (i.e. snprintf "1234") or a more low-level
  * binary format (i.e uint16_t 0x04F9 in network-byte order).
@@ -221,7 +290,10 @@ struct evsql_item {
  * @see evsql_query_exec
  */
 struct evsql_query_info {
-    /** The SQL query itself */
+    /**
+     * The SQL query itself. This is not copied, so it must remain valid until the queries executed using it have
+     * completed, typically it's a static string.
+     */
     const char *sql;
 
     /** 
@@ -333,12 +405,27 @@ struct evsql_result_info {
  */
 typedef void (*evsql_query_cb)(struct evsql_result *res, void *arg);
 
+/**
+ * Callback for handling streamed query results.
+ *
+ * Some more rows of the query's results have been received, and can be read using the \ref evsql_result_ functions.
+ * The evsql_result is only valid during the call, and is freed afterwards, so evsql_result_free() must NOT be called.
+ *
+ * @param res The result handle containing one or more rows
+ * @param arg The void* passed to \ref evsql_query_
+ *
+ * @see evsql_query_opts
+ */
+typedef void (*evsql_row_cb)(struct evsql_result *res, void *arg);
+
 /**
  * Callback for handling global-level errors.
  *
  * The evsql is not useable anymore.
  *
- * XXX: this is not actually called yet, as no retry logic is implemented, so an evsql itself never fails.
+ * This is only called if the evsql_config's prewarm connections could not be established and reconnecting is
+ * disabled. Otherwise, lost connections are reopened if the evsql_config enables reconnecting, or any queued queries
+ * are failed.
  *
  * @see evsql_new_pq
  */
@@ -379,8 +466,462 @@ typedef void (*evsql_trans_ready_cb)(struct evsql_trans *trans, void *arg);
  */
 typedef void (*evsql_trans_done_cb)(struct evsql_trans *trans, void *arg);
 
+/**
+ * Callback for when the evsql's initial set of connections has been established, and the evsql is ready to handle
+ * queries without having to wait for new connections to be opened.
+ *
+ * @param evsql the evsql in question
+ * @param arg the void* passed to evsql_new_pq_config
+ *
+ * @see evsql_config
+ */
+typedef void (*evsql_ready_cb)(struct evsql *evsql, void *arg);
+
+/**
+ * Callback for when the evsql's load crosses the watermarks given in its evsql_config. This is called from the event
+ * loop, and only once the state has actually changed.
+ *
+ * @param evsql the evsql in question
+ * @param high true once some high watermark has been reached, false once the load is back down to the low watermarks
+ * @param arg the void* passed to evsql_new_pq_config
+ *
+ * @see evsql_config
+ * @see evsql_pressure
+ */
+typedef void (*evsql_pressure_cb)(struct evsql *evsql, bool high, void *arg);
+
+/**
+ * Callback for when all of the queries in a submitted evsql_batch have completed, and their evsql_query_cb's have been
+ * called. The batch is freed after this returns.
+ *
+ * @param batch the batch in question
+ * @param arg the void* passed to evsql_batch
+ *
+ * @see evsql_batch
+ */
+typedef void (*evsql_batch_done_cb)(struct evsql_batch *batch, void *arg);
+
+/**
+ * Callback for handling a page of rows fetched from an evsql_cursor.
+ *
+ * Use evsql_result_begin()/evsql_result_next() to read the rows, and call evsql_result_free() (or equivalent) once
+ * done, as for evsql_query_cb(). The next page is already being fetched while this is called.
+ *
+ * @param cursor the cursor in question
+ * @param res The result handle that must be result_free'd after use
+ * @param arg the void* passed to evsql_cursor
+ *
+ * @see evsql_cursor
+ */
+typedef void (*evsql_cursor_page_cb)(struct evsql_cursor *cursor, struct evsql_result *res, void *arg);
+
+/**
+ * Callback for when an evsql_cursor is done, either because all of its rows have been fetched, or because something
+ * failed. The cursor is freed after this returns.
+ *
+ * @param cursor the cursor in question
+ * @param err zero if all rows were fetched, or an error code
+ * @param arg the void* passed to evsql_cursor
+ *
+ * @see evsql_cursor
+ */
+typedef void (*evsql_cursor_done_cb)(struct evsql_cursor *cursor, evsql_err_t err, void *arg);
+
+/**
+ * Callback for when an evsql_script is done, either because its transaction was commited, or because something failed.
+ * The script is freed after this returns.
+ *
+ * @param script the script in question
+ * @param err zero if the transaction was commited, or an error code
+ * @param arg the void* passed to evsql_trans_script
+ *
+ * @see evsql_trans_script
+ */
+typedef void (*evsql_script_done_cb)(struct evsql_script *script, evsql_err_t err, void *arg);
+
+/**
+ * One statement of a transaction script
+ *
+ * @see evsql_trans_script
+ */
+struct evsql_script_stmt {
+    /** The SQL query information */
+    const struct evsql_query_info *query_info;
+
+    /** The parameter values for the query_info's params, in the same order, or NULL if it doesn't have any */
+    const struct evsql_query_params *params;
+
+    /** Called with the statement's result once the transaction has been commited, may be NULL */
+    evsql_query_cb query_fn;
+
+    /** Passed to query_fn */
+    void *cb_arg;
+};
+
 // @}
 
+/**
+ * Optional per-query behaviour for evsql_query_exec_opts().
+ *
+ * A zero-initialized evsql_query_opts gives the same behaviour as evsql_query_exec().
+ *
+ * @see evsql_query_exec_opts
+ */
+struct evsql_query_opts {
+    /**
+     * Share the results of identical queries.
+     *
+     * If a transactionless query for the same evsql_query_info with the same parameter values is already in flight,
+     * and was also issued with coalesce set, then no new query is sent, and this query's query_fn gets the results of
+     * that one instead. The results are shared, and each query_fn must evsql_result_free() its own evsql_result as
+     * usual.
+     *
+     * This is only useful for read-only queries.
+     */
+    bool coalesce;
+
+    /**
+     * Stream the query's results.
+     *
+     * Instead of buffering the whole result set, row_fn is called with the rows as they are received, and then
+     * query_fn is called with the final result, which does not contain any rows. If the query fails half-way through,
+     * then query_fn gets the error instead.
+     *
+     * Streamed queries always get a connection of their own, and are not pipelined or coalesced.
+     */
+    evsql_row_cb row_fn;
+
+    /**
+     * How many rows to give to each row_fn call, if libpq supports chunked rows mode. Otherwise, or if zero, each row
+     * is given separately.
+     */
+    size_t chunk_rows;
+
+    /**
+     * Maximum time that this query may take, overriding the evsql_config's query_timeout. Zero to use the configured
+     * one.
+     *
+     * Queries that are coalesced with an identical one that is already in flight share its timeout instead.
+     */
+    struct timeval timeout;
+
+    /**
+     * The queue that the query waits in if it can't be sent right away, see evsql_config::priority_weights. Ignored
+     * for transaction queries.
+     */
+    enum evsql_priority priority;
+
+    /**
+     * Absolute time by which the query must complete, as given by event_base_gettimeofday_cached(), or zero for none.
+     *
+     * A query that is still queued once its deadline passes is failed with ETIMEDOUT without being sent, and one that
+     * is in flight times out as per timeout. If the deadline has already passed, the query is rejected right away,
+     * and NULL is returned with errno set to ETIMEDOUT.
+     */
+    struct timeval deadline;
+};
+
+/**
+ * Memory allocator used for the evsql handle and its connection, transaction and query objects.
+ *
+ * Not everything is covered: the evpq layer below evsql allocates its per-connection context and the bookkeeping for
+ * its internal prepare/deallocate queries using calloc/free, and libpq itself uses malloc/free for its PGconn and
+ * PGresult objects, which includes the results passed to the query callbacks.
+ *
+ * @see evsql_set_allocator
+ * @see evsql_config
+ */
+struct evsql_allocator {
+    /** Allocate \a size bytes, returning NULL on failure. The memory does not need to be zeroed */
+    void *(*alloc_fn)(size_t size, void *arg);
+
+    /** Release memory returned by alloc_fn, \a size is the same as was given to alloc_fn */
+    void (*free_fn)(void *ptr, size_t size, void *arg);
+
+    /** Passed to the above */
+    void *arg;
+};
+
+/**
+ * Allocation statistics for one type of object
+ *
+ * @see evsql_stats
+ */
+struct evsql_slab_stats {
+    /** Total number of objects allocated and freed */
+    size_t allocs, frees;
+
+    /** Number of objects currently in use */
+    size_t in_use;
+
+    /** Number of freed objects kept around for reuse */
+    size_t cached;
+
+    /** Number of times the evsql_allocator's alloc_fn/free_fn was called for these objects */
+    size_t sys_allocs, sys_frees;
+
+    /** Number of allocations that failed */
+    size_t failed;
+};
+
+/**
+ * Query queue statistics, see evsql_config::max_queue
+ *
+ * @see evsql_stats
+ */
+struct evsql_queue_stats {
+    /** Total number of queries that had to wait in the queue */
+    size_t queued;
+
+    /** Total number of queries that were rejected because of max_queue or max_queue_wait */
+    size_t rejected;
+
+    /** Total number of queued queries that were failed because their deadline or queue_timeout passed */
+    size_t expired;
+};
+
+/**
+ * Transaction retry statistics, see evsql_config::trans_retries
+ *
+ * @see evsql_stats
+ */
+struct evsql_retry_stats {
+    /** Total number of retries */
+    size_t retries;
+
+    /** Number of retried transactions that were then commited, or that failed or were aborted anyways */
+    size_t committed, failed;
+
+    /** Total time spent by the retried transactions, from their first retryable failure until commited or failed */
+    struct timeval time;
+};
+
+/**
+ * Statistics for an evsql handle, returned by evsql_stats()
+ */
+struct evsql_stats {
+    /** Allocation statistics for each type of object */
+    struct evsql_slab_stats conns, trans, queries;
+
+    /** Queued queries */
+    struct evsql_queue_stats queue;
+
+    /** Transaction retries */
+    struct evsql_retry_stats retries;
+};
+
+/**
+ * The current load on the evsql, as returned by evsql_pressure().
+ */
+struct evsql_pressure {
+    /** Number of queries waiting in the queue */
+    size_t queued;
+
+    /** Number of queries that have been sent and are waiting for their results, including transaction queries */
+    size_t in_flight;
+
+    /** Number of transactions waiting for a connection */
+    size_t trans_waiting;
+
+    /** Number of open connections, and how many of those are idle */
+    size_t conns, idle;
+};
+
+/**
+ * Connection pool configuration, passed to evsql_new_pq_config().
+ *
+ * Zero-initialize this and set the fields you care about; a zero value gives the default (unlimited) behaviour, which
+ * is also what evsql_new_pq() uses.
+ *
+ * @see evsql_new_pq_config
+ */
+struct evsql_config {
+    /** Number of idle connections to keep open, these are also opened at startup */
+    size_t min_idle;
+
+    /** Maximum number of connections to open, including those owned by transactions. Zero for no limit */
+    size_t max_conns;
+
+    /** Maximum number of transactions that may wait for a connection once max_conns is reached. Zero for no limit */
+    size_t max_trans_waiting;
+
+    /**
+     * Delay before opening a new connection once the connections that queued queries and waiting transactions were
+     * relying on have failed. Zero disables reconnecting, and such queries/transactions are failed instead.
+     *
+     * Each consecutive failed connection attempt doubles the delay, up to reconnect_max, and the actual delay is
+     * randomly picked from between half and all of this.
+     */
+    struct timeval reconnect_min;
+
+    /** Upper limit for the reconnect delay, if zero, the delay will not grow past reconnect_min */
+    struct timeval reconnect_max;
+
+    /** 
+     * Maximum time that a query may wait in the queue before being sent. Queries that expire are failed with
+     * ETIMEDOUT. Zero for no limit.
+     */
+    struct timeval queue_timeout;
+
+    /**
+     * Maximum number of queries that may wait in the queue. Once it is full, further queries that would have to be
+     * queued are rejected right away: the evsql_query functions return NULL with errno set to EAGAIN, and their
+     * query_fn is not called. Batches are rejected as a whole, with evsql_batch_submit() returning nonzero. Zero for no
+     * limit.
+     */
+    size_t max_queue;
+
+    /**
+     * Reject further queries like for max_queue once the oldest query in the queue has waited for this long, as the
+     * queue is then not keeping up anyways. Zero for no limit.
+     */
+    struct timeval max_queue_wait;
+
+    /**
+     * Watermarks for the number of queued queries. Once queue_high is reached, the evsql is under pressure, and
+     * pressure_fn is called. The pressure is relieved once the queue is back down to queue_low, and the in-flight
+     * queries to in_flight_low. Zero queue_high to disable.
+     *
+     * The low watermarks must be below the high ones.
+     */
+    size_t queue_high, queue_low;
+
+    /** Watermarks for the number of queries in flight, like for queue_high/queue_low. Zero in_flight_high to disable */
+    size_t in_flight_high, in_flight_low;
+
+    /** Called when the pressure changes, with the cb_arg given to evsql_new_pq_config() */
+    evsql_pressure_cb pressure_fn;
+
+    /** Number of connections to open concurrently at startup, at least min_idle (and one) are always opened */
+    size_t prewarm;
+
+    /**
+     * Number of connections that must be established before ready_fn is called, at most prewarm. Zero for just one.
+     *
+     * If reconnecting is disabled, error_fn is called once this many can't be established anymore.
+     */
+    size_t prewarm_ready;
+
+    /** Called once prewarm_ready connections have been established, with the cb_arg given to evsql_new_pq_config() */
+    evsql_ready_cb ready_fn;
+
+    /** Close connections that have been idle for this long, as long as min_idle are left. Zero to keep them open */
+    struct timeval idle_timeout;
+
+    /** Close connections once they have been open for this long, after any query/transaction completes. Zero for no limit */
+    struct timeval max_lifetime;
+
+    /** Close connections once they have executed this many queries, after they complete. Zero for no limit */
+    size_t max_queries;
+
+    /** How often to check the above, defaults to one second if any of them are set */
+    struct timeval maintain_interval;
+
+    /**
+     * How many transactionless queries to send on a single connection before waiting for their results, using libpq's
+     * pipeline mode. Idle connections are used first, and then queries are spread out across the connections that have
+     * room left in their pipeline.
+     *
+     * Zero or one to disable pipeline mode. Note that in pipeline mode, each query may only contain a single SQL
+     * command.
+     */
+    size_t pipeline_depth;
+
+    /**
+     * How many prepared statements to keep on each connection. Zero to disable the statement cache.
+     *
+     * Queries executed using an evsql_query_info are prepared on the connection the first time, and then executed
+     * using the prepared statement, so that the server doesn't have to parse and plan them every time. The statements
+     * are keyed by the evsql_query_info pointer, so these should be static. The least-recently-used statements are
+     * deallocated once there are more than this many.
+     *
+     * This puts the connections into pipeline mode, like pipeline_depth, so each query may only contain a single SQL
+     * command.
+     *
+     * The statements are prepared without any param types, so the server must be able to infer the type of each param
+     * from the SQL itself, e.g. using an explicit "$1::int4" cast. This is the same as for unprepared queries, except
+     * that NULL params are given an arbitrary type there, whereas the prepared statement is shared with later
+     * executions whose params may not be NULL.
+     */
+    size_t stmt_cache;
+
+    /**
+     * Maximum time that a new connection may take to connect. Connections that expire are failed, as if the
+     * connection attempt itself had failed. Zero for no limit.
+     */
+    struct timeval connect_timeout;
+
+    /**
+     * Maximum time that a query may take, from when it is sent or queued until its results are received. Zero for no
+     * limit, this can also be set per-query using evsql_query_opts.
+     *
+     * A transactionless query that expires while in the queue is failed with ETIMEDOUT. If it has already been sent,
+     * then its connection is closed, as libpq can't cancel a query without blocking, so it is failed with ETIMEDOUT,
+     * and any other queries that were pipelined on the same connection with EIO. If the query is part of a
+     * transaction, then the transaction is failed.
+     */
+    struct timeval query_timeout;
+
+    /**
+     * Maximum time that a transaction may take, from evsql_trans() until its done_fn is called, including any time
+     * spent waiting for a connection. Transactions that expire are failed, and their connection is closed. Zero for no
+     * limit.
+     */
+    struct timeval trans_timeout;
+
+    /**
+     * The resolution of the above timeouts, they may expire up to this much late. Defaults to 100ms.
+     *
+     * All timeouts share a single timer, which only runs while some timeout is pending.
+     */
+    struct timeval timer_resolution;
+
+    /**
+     * Number of times to retry a replayable transaction that failed because of a serialization failure or deadlock
+     * (SQLSTATE 40001 or 40P01). Zero to disable. Transaction scripts are replayable, as are transactions given a
+     * replay_fn using evsql_trans_replay().
+     *
+     * The transaction is rolled back, and then started again on the same connection after waiting for trans_retry_min,
+     * which doubles for each further retry of the same transaction, up to trans_retry_max. The actual delay is randomly
+     * picked from between half and all of this.
+     */
+    unsigned int trans_retries;
+
+    /** Delay before retrying a transaction, defaults to 10ms */
+    struct timeval trans_retry_min;
+
+    /** Upper limit for the retry delay, if zero, the delay will not grow past trans_retry_min */
+    struct timeval trans_retry_max;
+
+    /**
+     * How queued transactionless queries are dispatched from the per-priority queues, indexed by evsql_priority.
+     *
+     * If all zero, strict priority is used: EVSQL_PRIORITY_HIGH queries are always sent first, and
+     * EVSQL_PRIORITY_LOW ones only once the other queues are empty. Otherwise, the queues take turns, with each one
+     * sending up to its weight's worth of queries before the next one gets its turn, so that lower priorities can't be
+     * starved. A zero weight then counts as one.
+     */
+    unsigned int priority_weights[EVSQL_PRIORITY_MAX];
+
+    /**
+     * Maximum number of connections that EVSQL_PRIORITY_LOW queries may occupy at once, so that they leave the rest
+     * for more important work. Zero for no limit.
+     */
+    size_t low_priority_conns;
+
+    /**
+     * The allocator to use for this evsql, if both alloc_fn and free_fn are set. Defaults to the one set using
+     * evsql_set_allocator().
+     */
+    struct evsql_allocator allocator;
+
+    /**
+     * Freed connection, transaction and query objects are kept around for reuse, instead of being released using the
+     * allocator right away. This is the maximum number of each type to keep. Defaults to 64.
+     */
+    size_t slab_max_free;
+};
+
 /**
  * Session functions
  *
@@ -415,6 +956,32 @@ struct evsql *evsql_new_pq (struct event_base *ev_base, const char *pq_conninfo,
     void *cb_arg
 );
 
+/**
+ * Create a new PostgreSQL/libpq (evpq) -based evsql using the given conninfo and connection pool \a config.
+ *
+ * Once \a max_conns connections are open, non-transactional queries are queued as usual, and new transactions are
+ * placed in an admission queue until some connection is released; their \a ready_fn is then called as normal. If
+ * the admission queue already holds \a max_trans_waiting transactions, evsql_trans() fails instead.
+ *
+ * The \a prewarm connections are opened concurrently, and the config's \a ready_fn is called once \a prewarm_ready
+ * of them are established. If they can't be established and reconnecting is disabled, \a error_fn is called instead.
+ *
+ * The \a config is copied, so it need not remain valid.
+ *
+ * @param ev_base the libevent base to use
+ * @param pq_conninfo the libpq connection information
+ * @param config the connection pool configuration, or NULL for defaults
+ * @param error_fn called if the prewarm connections fail, may be NULL
+ * @param cb_arg: argument for error_fn and the config's ready_fn
+ * @return the evsql context handle for use with other functions
+ * @see evsql_new_pq
+ */
+struct evsql *evsql_new_pq_config (struct event_base *ev_base, const char *pq_conninfo, 
+    const struct evsql_config *config,
+    evsql_error_cb error_fn, 
+    void *cb_arg
+);
+
 /**
  * Close the evsql handle. IMPORTANT: There are severe restrictions on the use of this function. It must *NOT* be
  * called from any evsql_*_cb callback, or the program will probably crash after the callback returns.
@@ -435,6 +1002,36 @@ void evsql_destroy (struct evsql *evsql);
  */
 evsql_err_t evsql_destroy_next (struct evsql *evsql);
 
+/**
+ * Set the default allocator for evsql handles created from now on, whose evsql_config doesn't give one. Pass NULL to
+ * go back to using malloc/free.
+ *
+ * Each evsql handle keeps using the allocator that it was created with until it is destroyed, so this only affects new
+ * ones. The default is a process global that is written without any locking, so this must be called before any evsql
+ * is created, and not while any other thread may be creating one.
+ *
+ * @param allocator the allocator to use, this is copied
+ */
+void evsql_set_allocator (const struct evsql_allocator *allocator);
+
+/**
+ * Get the current statistics for the evsql handle
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param stats returned statistics
+ */
+void evsql_stats (struct evsql *evsql, struct evsql_stats *stats);
+
+/**
+ * Check whether the evsql is under pressure, as given by the watermarks in its evsql_config, so that the caller can
+ * hold back new work. This is cheap enough to call for each new request.
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param pressure returns the current load, if not NULL
+ * @return true if some high watermark has been reached, and the load has not yet dropped back down to the low ones
+ */
+bool evsql_pressure (struct evsql *evsql, struct evsql_pressure *pressure);
+
 // @}
 
 /**
@@ -448,9 +1045,12 @@ evsql_err_t evsql_destroy_next (struct evsql *evsql);
 /**
  * Queue the given query for execution.
  *
- * If \a trans is given (i.e. not NULL), then the transaction must be idle, and the query will be executed in that
- * transaction's context. Otherwise, the query will be executed without a transaction using an idle connection, or
- * enqueued for later execution.
+ * If \a trans is given (i.e. not NULL), then the query will be executed in that transaction's context, even if the
+ * transaction's earlier queries have not completed yet, and the results are returned in order. If the transaction's
+ * connection is in pipeline mode (see evsql_config::pipeline_depth), the query is sent right away, and may then only
+ * contain a single SQL command. Otherwise, it waits in the transaction's own queue until the earlier queries have
+ * completed. If one of them fails, any later ones fail with ECANCELED. Without \a trans, the query will be executed
+ * without a transaction using an idle connection, or enqueued for later execution.
  *
  * Once the query is complete (got a result, got an error, the connection failed), then \a query_fn will be called.
  * The callback can use the \ref evsql_result_ functions to manipulate the query results.
@@ -508,15 +1108,63 @@ struct evsql_query *evsql_query_exec (struct evsql *evsql, struct evsql_trans *t
     ...
 );
 
+/**
+ * Like evsql_query_exec(), but with the extra behaviour given in \a opts.
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param trans the optional transaction handle from evsql_trans
+ * @param query_info the SQL query information
+ * @param opts the query options, or NULL for the defaults
+ * @param query_fn the evsql_query_cb() to call once the query is complete
+ * @param cb_arg the void* passed to the above
+ * @see evsql_query_exec
+ * @see evsql_query_opts
+ */
+struct evsql_query *evsql_query_exec_opts (struct evsql *evsql, struct evsql_trans *trans, 
+    const struct evsql_query_info *query_info, const struct evsql_query_opts *opts,
+    evsql_query_cb query_fn, void *cb_arg,
+    ...
+);
+
+/**
+ * Register the given \a query_info's statement to be prepared on every new connection as part of its connect sequence,
+ * before any other query is sent on it, so that the first evsql_query_exec() using it on a connection doesn't have to
+ * prepare it first. The statements are prepared in a pipeline, so this costs no extra round-trips.
+ *
+ * Connections that are already connected prepare the statement the first time it is used instead, so this should be
+ * called right after evsql_new_pq_config(), before returning to the event loop. The \a query_info must remain valid
+ * for the evsql's lifetime, and the registered statements are never evicted from the evsql_config::stmt_cache.
+ *
+ * This puts the connections into pipeline mode, like evsql_config::stmt_cache.
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param query_info the SQL query information
+ * @return zero on success, nonzero on failure
+ */
+int evsql_prepare (struct evsql *evsql, const struct evsql_query_info *query_info);
+
 /**
  * Abort a \a query returned by \ref evsql_query_ that has not yet completed (query_fn has not been called yet).
  *
  * The actual query itself may or may not be aborted (and hence may or may not be executed on the server), but \a query_fn
  * will not be called anymore, and the query will dispose of itself and any results returned.
  *
- * If the \a query is part of a transaction, then \a trans must be given, and the query must be the query that is currently
- * executing on that trans. The transaction's \a ready_fn will be called once the query has been aborted and the
- * transaction is now idle again.
+ * A transactionless query that is still queued is dropped right away. If it is already running on a connection of its
+ * own, then it is cancelled on the server, and the connection is reused once the server has acknowledged that. With
+ * libpq 17 or later, the cancel request is sent without blocking, using PQcancelStart(). Otherwise, it is sent as a
+ * "SELECT pg_cancel_backend(...)" query, which has some limitations:
+ *
+ *  -   it needs another connection, idle or newly opened, while the query's own connection is held
+ *  -   the role must be allowed to signal the query's backend, see pg_signal_backend
+ *  -   it is queued as EVSQL_PRIORITY_HIGH, and is not subject to evsql_config::max_queue/max_queue_wait, but may
+ *      still have to wait for a connection
+ *
+ * Queries that were pipelined along with others, or whose results are shared with coalesced queries, and queries that
+ * are part of a transaction are never cancelled, and run to completion. If the cancel can't be sent, a warning is
+ * logged, and the query runs to completion as well.
+ *
+ * If the \a query is part of a transaction, then \a trans must be given, and the query must be executing on that trans.
+ * The transaction's \a ready_fn will be called once the query has been aborted, if the transaction is now idle again.
  *
  * @param trans if the query is part of a transaction, then it MUST be given here
  * @param query the in-progress query to abort
@@ -533,6 +1181,173 @@ void evsql_query_debug (const char *sql, const struct evsql_query_params *params
 
 // @}
 
+/**
+ * Batch API
+ *
+ * @defgroup evsql_batch_* Batch interface
+ * @see evsql.h
+ * @{
+ */
+
+/**
+ * Create a new batch of non-transactional queries, which are sent together on a single connection once the batch is
+ * submitted using evsql_batch_submit().
+ *
+ * If the evsql_config enables pipeline_depth, then all of the queries are sent in one go, and their results are
+ * received in a single round-trip. Depending on the version of libpq, the batch may then be executed as a single
+ * pipeline sync point, which means that if one of the queries fails, then the queries following it are not executed,
+ * and their query_fn's get an ECANCELED error. Otherwise, the queries are simply executed as if they were given to
+ * \ref evsql_query_ separately.
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param done_fn the evsql_batch_done_cb() to call once all queries have completed
+ * @param cb_arg the void* passed to the above
+ * @return the evsql_batch handle, or NULL on error
+ */
+struct evsql_batch *evsql_batch (struct evsql *evsql, evsql_batch_done_cb done_fn, void *cb_arg);
+
+/**
+ * Add a query to the batch, like evsql_query_params() does. The query is not executed before the batch is submitted.
+ *
+ * @param batch the batch handle from evsql_batch
+ * @param command the SQL command to bind the parameters to
+ * @param params the parameter types and values, scalar values are copied, but any other values must remain valid until
+ *  query_fn is called
+ * @param query_fn the evsql_query_cb() to call once the query is complete
+ * @param cb_arg the void* passed to the above
+ * @return the evsql_query handle, or NULL on error, which leaves the rest of the batch as it was
+ * @see evsql_query_params
+ */
+struct evsql_query *evsql_batch_params (struct evsql_batch *batch, 
+    const char *command, const struct evsql_query_params *params, 
+    evsql_query_cb query_fn, void *cb_arg
+);
+
+/**
+ * Add a query to the batch, like evsql_query_exec() does. The query is not executed before the batch is submitted.
+ *
+ * Note that any binary/string values are not copied, so they must remain valid until query_fn is called.
+ *
+ * @param batch the batch handle from evsql_batch
+ * @param query_info the SQL query information
+ * @param query_fn the evsql_query_cb() to call once the query is complete
+ * @param cb_arg the void* passed to the above
+ * @return the evsql_query handle, or NULL on error, which leaves the rest of the batch as it was
+ * @see evsql_query_exec
+ */
+struct evsql_query *evsql_batch_exec (struct evsql_batch *batch, 
+    const struct evsql_query_info *query_info,
+    evsql_query_cb query_fn, void *cb_arg,
+    ...
+);
+
+/**
+ * Submit the batch for execution. Each query's query_fn is called as it completes, in the order that they were added,
+ * and then the batch's done_fn. The evsql_query handles may be used with evsql_query_abort() until then.
+ *
+ * If this fails, then the whole batch is aborted as if by evsql_batch_abort().
+ *
+ * @param batch the batch handle from evsql_batch
+ * @return zero on success, nonzero on error
+ */
+int evsql_batch_submit (struct evsql_batch *batch);
+
+/**
+ * Abort a batch that has not yet been submitted, freeing all of its queries without calling any callbacks.
+ *
+ * @param batch the batch handle from evsql_batch
+ */
+void evsql_batch_abort (struct evsql_batch *batch);
+
+// @}
+
+/**
+ * Cursor API
+ *
+ * @defgroup evsql_cursor_* Cursor interface
+ * @see evsql.h
+ * @{
+ */
+
+/**
+ * Execute the given \a query_info's SQL query using a server-side cursor, and fetch its rows in pages of \a page_rows
+ * rows each, so that the whole result set never needs to be held in memory at once.
+ *
+ * The cursor runs in a transaction of its own. Once the query has been DECLARE'd, the rows are FETCH'd a page at a
+ * time, and \a page_fn is called for each page, while the next page is already being fetched. Once the last page has
+ * been handled, the transaction is commited, and \a done_fn is called.
+ *
+ * The parameter values are given as variable arguments, as for evsql_query_exec().
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param query_info the SQL query information, this must be a SELECT or VALUES query
+ * @param page_rows how many rows to fetch at a time
+ * @param page_fn the evsql_cursor_page_cb() to call for each page of rows
+ * @param done_fn the evsql_cursor_done_cb() to call once done
+ * @param cb_arg the void* passed to the above
+ * @return the evsql_cursor handle, or NULL on error
+ */
+struct evsql_cursor *evsql_cursor (struct evsql *evsql, const struct evsql_query_info *query_info, size_t page_rows,
+    evsql_cursor_page_cb page_fn, evsql_cursor_done_cb done_fn, void *cb_arg,
+    ...
+);
+
+/**
+ * Abort the cursor, rolling back its transaction. Neither page_fn nor done_fn will be called anymore, and the cursor
+ * will dispose of itself.
+ *
+ * @param cursor the cursor handle from evsql_cursor
+ */
+void evsql_cursor_abort (struct evsql_cursor *cursor);
+
+// @}
+
+/**
+ * Transaction script API
+ *
+ * @defgroup evsql_script_* Transaction script interface
+ * @see evsql.h
+ * @{
+ */
+
+/**
+ * Execute the given list of statements as a single transaction of the given \a type.
+ *
+ * Once the transaction has a connection, the BEGIN, all of the statements and the COMMIT are sent at once, without
+ * waiting for any of them to complete, so the whole transaction only costs a single round-trip. This requires the
+ * connections to be in pipeline mode (see evsql_config::pipeline_depth), without it the statements are sent one at a
+ * time.
+ *
+ * The results are held back until the transaction has been commited, and each statement's query_fn is then called
+ * with its result, in order, followed by \a done_fn. If a statement fails, the transaction is rolled back, and only the
+ * failed statement's query_fn is called, with its error, followed by \a done_fn with the error.
+ *
+ * The statements are copied, but the query_info's and param values are not, so they must remain valid until
+ * \a done_fn is called.
+ *
+ * @param evsql the context handle from \ref evsql_new_
+ * @param type the type of transaction to use
+ * @param stmts the statements to execute
+ * @param count the number of statements
+ * @param done_fn the evsql_script_done_cb() to call once done
+ * @param cb_arg the void* passed to the above
+ * @return the evsql_script handle, or NULL on error
+ */
+struct evsql_script *evsql_trans_script (struct evsql *evsql, enum evsql_trans_type type,
+    const struct evsql_script_stmt *stmts, size_t count,
+    evsql_script_done_cb done_fn, void *cb_arg
+);
+
+/**
+ * Abort the script. If the COMMIT has not yet been sent, the transaction is rolled back, otherwise it will still
+ * complete. Neither the statements' query_fn nor done_fn will be called anymore, and the script will dispose of itself.
+ *
+ * @param script the script handle from evsql_trans_script
+ */
+void evsql_script_abort (struct evsql_script *script);
+
+// @}
+
 /**
  * Transaction API
  *
@@ -554,6 +1369,18 @@ void evsql_query_debug (const char *sql, const struct evsql_query_params *params
  * will NOT be called), and the given \a error_fn will be called. Note that this includes some, but not all,
  * cases where \ref evsql_query_ returns an error.
  *
+ * If the connection pool is full (see evsql_config), the transaction will wait for a connection to be released
+ * before \a ready_fn is called. A transaction that is still waiting may be aborted using evsql_trans_abort().
+ *
+ * If the connection is in pipeline mode, the "BEGIN TRANSACTION ..." query is not sent until the first query, and the
+ * two are then sent together, so \a ready_fn is called without waiting for the server. If the BEGIN fails, the first
+ * query is dropped and \a error_fn is called. Likewise, the COMMIT may then be sent while queries are still pending.
+ *
+ * Connections are only put into pipeline mode when evsql_config::pipeline_depth is more than one,
+ * evsql_config::stmt_cache is set, or evsql_prepare() has been used, and a connection that is not already in pipeline
+ * mode is used as-is. So with the default configuration, the BEGIN, each query and the COMMIT each cost a round-trip of
+ * their own.
+ *
  * Once you are done with the transaction, call either evsql_trans_commit() or evsql_trans_abort().
  *
  * @param evsql the context handle from \ref evsql_new_
@@ -571,11 +1398,31 @@ struct evsql_trans *evsql_trans (struct evsql *evsql, enum evsql_trans_type type
     void *cb_arg
 );
 
+/**
+ * Make the transaction replayable, so that it is retried if it fails because of a serialization failure or deadlock,
+ * as configured using evsql_config::trans_retries.
+ *
+ * When a query fails like that, neither it nor any later queries sent on the transaction are given their results.
+ * Instead, the transaction is rolled back, and once it has been started again, \a replay_fn is called instead of
+ * \a ready_fn, and should then send all of the transaction's queries again. If there are no retries left, the query
+ * fails as normal instead.
+ *
+ * @param trans the transaction handle from evsql_trans
+ * @param replay_fn the evsql_trans_ready_cb() to call once the transaction has been started again, typically the same
+ * as its ready_fn
+ */
+void evsql_trans_replay (struct evsql_trans *trans, evsql_trans_ready_cb replay_fn);
+
 /**
  * Commit a transaction using "COMMIT TRANSACTION".
  *
- * The transaction must be idle, just like for evsql_query. Once the transaction has been commited, the transaction's
- * \a done_fn will be called, after which the transaction must not be used anymore.
+ * Once the transaction has been commited, the transaction's \a done_fn will be called, after which the transaction
+ * must not be used anymore.
+ *
+ * Just like for evsql_query, the COMMIT may be issued while the transaction's last queries are still pending, and is
+ * executed right behind them. The query's callback is still called first, but if the query fails, the COMMIT will roll
+ * back the transaction instead, and \a error_fn is then called instead of \a done_fn. No further queries can be sent
+ * after the COMMIT.
  *
  * You cannot abort a COMMIT, calling trans_abort() on trans after a succesful trans_commit is an error.
  *
@@ -589,8 +1436,8 @@ int evsql_trans_commit (struct evsql_trans *trans);
 /**
  * Abort a transaction, using "ROLLBACK TRANSACTION".
  *
- * No more transaction callbacks will be called. If there was a query running, it will be aborted, and the transaction
- * then rollback'd.
+ * No more transaction callbacks will be called. If there were queries running, they will be aborted, and the
+ * transaction then rollback'd.
  *
  * You cannot abort a COMMIT, calling trans_abort on \a trans after a call to trans_commit is an error.
  * 
@@ -672,7 +1519,8 @@ int evsql_params_clear (struct evsql_query_params *params);
  * Check the result for errors. Intended for use with non-data queries, i.e. CREATE, etc.
  *
  * Returns zero if the query was OK, err otherwise. EIO indicates an SQL error, the error message can be retrived
- * using evsql_result_error.
+ * using evsql_result_error. ETIMEDOUT indicates that the query waited in the queue for longer than the evsql_config's
+ * queue_timeout, and was never sent.
  *
  * @param res the result handle passed to evsql_query_cb()
  * @return zero on success, EIO on SQL error, positive error code otherwise
@@ -685,6 +1533,9 @@ evsql_err_t evsql_result_check (struct evsql_result *res);
  * Define an evsql_result_info struct that describes the columns returned by the query, and call evsql_result_begin on
  * the evsql_result. This verifies the query result, and then prepares it for iteration using evsql_result_next.
  *
+ * The number of columns, and the format and size of each column, are checked here once for the whole result, so
+ * evsql_result_next only needs to check each field for NULLs.
+ *
  * Call evsql_result_end once you've stopped iteration.
  *
  * Returns zero if the evsql_result is ready for iteration, err otherwise. EIO indicates an SQL error, the error
@@ -6,11 +6,14 @@
  */
 
 #include <sys/queue.h>
+#include <stdarg.h>
 
 #include <event2/event.h>
 
 #include "include/evsql.h"
 #include "evpq.h"
+#include "lib/err.h"
+#include "lib/wheel.h"
 
 /*
  * The engine type
@@ -20,35 +23,161 @@ enum evsql_type {
 };
 
 /*
- * Contains the type, engine configuration, list of connections and waiting query queue.
+ * The states that an evsql_conn can be in, each of these has its own list in the evsql.
+ */
+enum evsql_conn_state {
+    EVSQL_CONN_CONNECTING,  // not yet connected, and not used by anything
+    EVSQL_CONN_IDLE,        // connected, and not used by anything
+    EVSQL_CONN_PIPELINE,    // running transactionless queries, with room for more in the pipeline
+    EVSQL_CONN_BUSY,        // running as many transactionless queries as it can
+    EVSQL_CONN_TRANS,       // owned by a transaction, and possibly still connecting
+
+    EVSQL_CONN_STATE_MAX
+};
+
+// maximum length for a 'BEGIN TRANSACTION ...' query
+#define EVSQL_QUERY_BEGIN_BUF 512
+
+// maximum length for a cursor's 'FETCH ...' query
+#define EVSQL_QUERY_FETCH_BUF 64
+
+// maximum length for the 'SELECT pg_cancel_backend(...)' query for aborted queries
+#define EVSQL_QUERY_CANCEL_BUF 64
+
+// the name used for cursors, each one has a transaction of its own
+#define EVSQL_CURSOR_NAME "evsql_cursor"
+
+// number of hash buckets for coalescable queries
+#define EVSQL_COALESCE_BUCKETS 64
+
+// number of params that are stored inline in the evsql_query, queries with more params allocate storage for them
+#define EVSQL_QUERY_PARAMS_INLINE 8
+
+// size of the allocated storage for the param arrays of queries with more params than that
+#define EVSQL_QUERY_PARAMS_STORAGE(count) ((count) * (sizeof(union evsql_item_value) + sizeof(char *) + sizeof(Oid) + 2 * sizeof(int)))
+
+// default evsql_config.slab_max_free
+#define EVSQL_SLAB_MAX_FREE 64
+
+// number of hash buckets for each conn's prepared statements
+#define EVSQL_STMT_BUCKETS 32
+
+/*
+ * A freed object in a slab's freelist
+ */
+struct evsql_slab_free {
+    struct evsql_slab_free *next;
+};
+
+/*
+ * Allocates fixed-size objects using some evsql_allocator, keeping a freelist of freed objects for reuse.
+ */
+struct evsql_slab {
+    const struct evsql_allocator *allocator;
+
+    // size of each object, and how many free objects to keep
+    size_t size, max_free;
+
+    // free objects for reuse
+    struct evsql_slab_free *free_list;
+
+    // statistics, including the number of free objects
+    struct evsql_slab_stats stats;
+};
+
+/*
+ * Contains the type, engine configuration, lists of connections and waiting query queue.
  */
 struct evsql {
     // what event_base to use
     struct event_base *ev_base;
 
+    // what we, and our conns/transactions/queries, are allocated with
+    struct evsql_allocator allocator;
+    struct evsql_slab conn_slab, trans_slab, query_slab;
+
     // what engine we use
     enum evsql_type type;
 
     // callbacks
     evsql_error_cb error_fn;
     void *cb_arg;
+
+    // number of prewarm conns established so far, and have we called ready_fn/error_fn for them yet?
+    size_t warm_count;
+    int warm_done : 1;
     
     // engine-specific connection configuration
     union {
         const char *evpq;
     } engine_conf;
 
-    // list of connections that are open
-    LIST_HEAD(evsql_conn_list, evsql_conn) conn_list;
+    // connection pool configuration
+    struct evsql_config config;
+
+    // lists of connections that are open, per state, and how many there are in each. Idle conns are kept in
+    // most-recently-used order
+    TAILQ_HEAD(evsql_conn_list, evsql_conn) conn_lists[EVSQL_CONN_STATE_MAX];
+    size_t conn_counts[EVSQL_CONN_STATE_MAX];
+
+    // total number of connections, and how many of those are still connecting
+    size_t conn_count;
+    size_t conn_connecting;
    
-    // list of queries running or waiting to run
-    TAILQ_HEAD(evsql_query_queue, evsql_query) query_queue;
+    // queries waiting to run, per priority, and how many there are in total
+    TAILQ_HEAD(evsql_query_queue, evsql_query) query_queues[EVSQL_PRIORITY_MAX];
+    size_t queue_len;
+
+    // for weighted dispatch, the queue whose turn it is, in _evsql_queue_order, and how many more queries it may send
+    unsigned int queue_turn, queue_credit;
+
+    // number of conns with EVSQL_PRIORITY_LOW queries in flight
+    size_t low_conns;
+
+    // queued queries, for evsql_stats
+    struct evsql_queue_stats queue_stats;
+
+    // number of queries in flight on all conns
+    size_t query_depth;
+
+    // are we under pressure, and what was the pressure_fn last told, from ev_pressure
+    int pressure_high, pressure_reported;
+    struct event *ev_pressure;
+
+    // list of transactions waiting for a connection, and how many there are
+    TAILQ_HEAD(evsql_trans_queue, evsql_trans) trans_queue;
+    size_t trans_queue_len;
+
+    // transactions on pipelined conns whose ready_fn is still to be called, from ev_trans_ready
+    struct evsql_trans_queue trans_ready;
+    struct event *ev_trans_ready;
+
+    // timer for opening a new connection after failures, and the number of consecutive failed attempts
+    struct event *ev_reconnect;
+    unsigned int reconnect_attempt;
+
+    // periodic timer for closing idle and old connections
+    struct event *ev_maintain;
+
+    // coalescable queries in flight, hashed by query_info and params
+    LIST_HEAD(evsql_coalesce_bucket, evsql_query) coalesce[EVSQL_COALESCE_BUCKETS];
+
+    // the connect/query/transaction timeouts
+    struct wheel *wheel;
+
+    // transaction retries, for evsql_stats
+    struct evsql_retry_stats retry_stats;
+
+    // statements registered using evsql_prepare, hashed by query_info, and how many
+    LIST_HEAD(evsql_prepared_bucket, evsql_prepared) prepared[EVSQL_STMT_BUCKETS];
+    size_t prepared_count;
 };
 
 /*
  * A single connection to the server.
  *
- * Contains the engine connection, may have a transaction associated, and may have a query associated.
+ * Contains the engine connection, may have a transaction associated, and may have queries associated. In pipeline
+ * mode, there may be several transactionless queries in flight at once.
  */
 struct evsql_conn {
     // evsql we belong to
@@ -59,20 +188,87 @@ struct evsql_conn {
         struct evpq_conn *evpq;
     } engine;
 
-    // our position in the conn list
-    LIST_ENTRY(evsql_conn) entry;
+    // our position in the conn list for our state
+    enum evsql_conn_state state;
+    TAILQ_ENTRY(evsql_conn) entry;
 
     // are we running a transaction?
     struct evsql_trans *trans;
 
-    // are we running a transactionless query?
-    struct evsql_query *query;
+    // queries that have been sent and are waiting for results, in the order that they were sent, and how many
+    TAILQ_HEAD(evsql_conn_queries, evsql_query) queries;
+    size_t query_depth;
+
+    // has _evsql_evpq_connected been called?
+    int connected : 1;
+
+    // is the engine in pipeline mode?
+    int pipeline : 1;
+
+    // should we close the connection once it's idle?
+    int retire : 1;
+
+    // when the connection was opened, and when it last became idle
+    struct timeval created, idle_since;
+
+    // connect_timeout, until connected
+    struct wheel_timer timer;
+
+    // number of queries executed on this connection
+    size_t query_count;
+
+    // number of EVSQL_PRIORITY_LOW queries in flight
+    size_t low_depth;
+
+    // the pg_cancel_backend query for an aborted query, the conn doesn't take on new queries until it completes
+    struct evsql_query *cancel;
+
+    // likewise for a cancel request sent using evpq_cancel instead
+    int cancelling : 1;
+
+    // statements prepared on this conn, hashed by query_info, and the cached ones in most-recently-used order, and
+    // how many of those there are
+    LIST_HEAD(evsql_stmt_bucket, evsql_stmt) stmts[EVSQL_STMT_BUCKETS];
+    TAILQ_HEAD(evsql_stmt_list, evsql_stmt) stmt_lru;
+    size_t stmt_count;
+
+    // the statements registered using evsql_prepare, which are never evicted
+    struct evsql_stmt_list stmt_pinned;
+
+    // statements evicted while in a transaction, to be deallocated once outside of it, as that fails if it has aborted
+    struct evsql_stmt_list stmt_dealloc;
+
+    // used to name the statements
+    unsigned int stmt_seq;
+};
+
+/*
+ * A statement prepared on some conn for some query_info, see evsql_config.stmt_cache
+ */
+struct evsql_stmt {
+    // the query_info that this was prepared for, and a copy of its SQL, in case the query_info is not static
+    const struct evsql_query_info *info;
+    char *sql;
+
+    // the server-side name
+    char name[EVPQ_NAME_MAX + 1];
+
+    // registered using evsql_prepare?
+    int pinned : 1;
+
+    // evicted, and waiting in stmt_dealloc?
+    int dealloc : 1;
+
+    // our position in the conn's hash bucket, and in its LRU list, list of pinned statements or stmt_dealloc
+    LIST_ENTRY(evsql_stmt) hash_entry;
+    TAILQ_ENTRY(evsql_stmt) lru_entry;
 };
 
 /*
  * A single transaction.
  *
- * Has a connection associated and possibly a query (which will also be associated with the connection)
+ * Has a connection associated and possibly a query (which will also be associated with the connection), or no
+ * connection if it is still waiting in the evsql's trans_queue.
  */
 struct evsql_trans {
     // our evsql_conn/evsql
@@ -91,8 +287,43 @@ struct evsql_trans {
     // has evsql_trans_commit be called?
     int has_commit : 1;
 
-    // our current query
-    struct evsql_query *query;
+    // on a pipelined conn, the BEGIN is sent along with the first query, and ready_fn is called from ev_trans_ready
+    int begin_pending : 1;
+    int ready_pending : 1;
+
+    // has some query failed, so that any later ones are not executed?
+    int failed : 1;
+
+    // replay the transaction once the queries in flight are done, see evsql_trans_replay
+    int retry : 1;
+    evsql_trans_ready_cb replay_fn;
+
+    // has it been started again, so that replay_fn rather than ready_fn is due once it's ready?
+    int replaying : 1;
+
+    // how many times it has been retried, since when, and the timer for the next attempt
+    unsigned int retries;
+    struct timeval retry_start;
+    struct event *ev_retry;
+
+    // queries waiting for the earlier ones to complete, on a conn that isn't in pipeline mode
+    struct evsql_query_queue queries;
+
+    // our position in the trans_queue while waiting for a conn, or in trans_ready
+    TAILQ_ENTRY(evsql_trans) entry;
+
+    // trans_timeout
+    struct wheel_timer timer;
+};
+
+/*
+ * A statement registered using evsql_prepare
+ */
+struct evsql_prepared {
+    const struct evsql_query_info *info;
+
+    // our position in the evsql's hash bucket
+    LIST_ENTRY(evsql_prepared) entry;
 };
 
 /*
@@ -108,8 +339,19 @@ union evsql_result_handle {
  * Has the info needed to exec the query (as these may be queued), and the callback/result info.
  */
 struct evsql_query {
-    // the actual SQL query, this may or may not be ours, see _evsql_query_exec
-    char *command;
+    // the evsql we belong to
+    struct evsql *evsql;
+
+    // the conn we were sent on, NULL while still queued
+    struct evsql_conn *conn;
+
+    // the actual SQL query while waiting to be sent, this is either the query_info's static SQL, or our own copy in
+    // command_buf, see _evsql_query_command_set
+    const char *command;
+    char *command_buf;
+
+    // the query_info that the command came from, if any, for the statement cache
+    const struct evsql_query_info *info;
     
     // possible query params
     struct evsql_query_params_pq {
@@ -124,42 +366,233 @@ struct evsql_query {
         union evsql_item_value *item_vals;
 
         int result_format;
+
+        // the above arrays, if there are more than EVSQL_QUERY_PARAMS_INLINE params
+        void *storage;
     } params;
 
+    // the above arrays, if there are at most EVSQL_QUERY_PARAMS_INLINE params
+    struct evsql_query_params_inline {
+        union evsql_item_value item_vals[EVSQL_QUERY_PARAMS_INLINE];
+        const char *values[EVSQL_QUERY_PARAMS_INLINE];
+        Oid types[EVSQL_QUERY_PARAMS_INLINE];
+        int lengths[EVSQL_QUERY_PARAMS_INLINE];
+        int formats[EVSQL_QUERY_PARAMS_INLINE];
+    } params_inline;
+
     // our callback
     evsql_query_cb cb_fn;
     void *cb_arg;
+
+    // callback for streamed results, and how many rows to stream at a time
+    evsql_row_cb row_fn;
+    size_t chunk_rows;
         
     // the result we get
     union evsql_result_handle result;
 
-    // our position in the query list
+    // when the query expires while still in the queue, if timerisset, and when it was queued
+    struct timeval deadline, queued;
+
+    // our query_timeout, if timerisset, and the timer for it, which starts once we are sent or queued
+    struct timeval timeout;
+    struct wheel_timer timer;
+
+    // did the timer expire while we were in flight?
+    int timed_out : 1;
+
+    // sent by evsql itself, so never rejected because of max_queue/max_queue_wait
+    int internal : 1;
+
+    // which queue we wait in
+    enum evsql_priority priority;
+
+    // the batch that we are part of, if any
+    struct evsql_batch *batch;
+
+    // the query_info and params hash we are coalesced by, if we are in the evsql's coalesce table
+    const struct evsql_query_info *coalesce_info;
+    unsigned int coalesce_hash;
+    LIST_ENTRY(evsql_query) coalesce_entry;
+
+    // identical queries waiting for our result
+    struct evsql_query_queue waiters;
+
+    // the query whose result we are waiting for, if we are in its list of waiters
+    struct evsql_query *leader;
+
+    // the transaction whose queue of queries we are waiting in, if any
+    struct evsql_trans *trans;
+
+    // our position in the query_queues or a trans's queue, or the conn's list of queries once sent
     TAILQ_ENTRY(evsql_query) entry;
 };
 
+/*
+ * A batch of queries, sent together.
+ *
+ * The queries are kept in the batch's list until it is submitted, and then they are handled like any other
+ * transactionless query, except that _evsql_pump keeps them together.
+ */
+struct evsql_batch {
+    struct evsql *evsql;
+
+    // callback
+    evsql_batch_done_cb done_fn;
+    void *cb_arg;
+
+    // queries waiting to be submitted
+    struct evsql_query_queue queries;
+
+    // number of queries that have not yet been freed
+    size_t pending;
+};
+
+/*
+ * A result shared between coalesced queries, freed once all of them have freed it
+ */
+struct evsql_result_ref {
+    size_t refs;
+};
+
+/*
+ * A server-side cursor, running in its own transaction.
+ */
+struct evsql_cursor {
+    struct evsql *evsql;
+    struct evsql_trans *trans;
+
+    // callbacks
+    evsql_cursor_page_cb page_fn;
+    evsql_cursor_done_cb done_fn;
+    void *cb_arg;
+
+    // the DECLARE query, until the trans is ready and it is sent
+    struct evsql_query *declare;
+    char *declare_sql;
+
+    // the FETCH query
+    char fetch_sql[EVSQL_QUERY_FETCH_BUF];
+    size_t page_rows;
+
+    // has the COMMIT been sent?
+    int has_commit : 1;
+
+    // are we sending a query on the trans, so that a trans failure from within that is handled by us?
+    int busy : 1;
+};
+
 // the result
 struct evsql_result {
     struct evsql *evsql;
 
-    // possible error code
-    int error;
+    // possible error code, EIO for query/connection errors
+    err_t error;
     
     // the actual result
     union evsql_result_handle result;
 
+    // if the result is shared between coalesced queries
+    struct evsql_result_ref *ref;
+
     // result_* state
     struct evsql_result_info *info;
     size_t row_offset;
 };
 
+/*
+ * One statement of an evsql_script
+ */
+struct evsql_script_query {
+    // what to send, again if the script is retried
+    const struct evsql_query_info *info;
+    const struct evsql_query_params *params;
+
+    // the query, until it is sent
+    struct evsql_query *query;
+
+    // the user's callback
+    evsql_query_cb query_fn;
+    void *cb_arg;
+
+    // the result, held until the COMMIT is done
+    struct evsql_result res;
+};
+
+/*
+ * A list of statements, running in a transaction of their own.
+ */
+struct evsql_script {
+    struct evsql *evsql;
+    struct evsql_trans *trans;
+
+    // callback
+    evsql_script_done_cb done_fn;
+    void *cb_arg;
+
+    // how many statements have been sent, and how many have completed
+    size_t sent, done;
+
+    // the statement that failed first, or count
+    size_t failed;
+
+    // has the COMMIT been sent?
+    int has_commit : 1;
+
+    // are we sending a query on the trans, so that a trans failure from within that is handled by us?
+    int busy : 1;
+
+    // the statements
+    size_t count;
+    struct evsql_script_query stmts[];
+};
+
 
-// maximum length for a 'BEGIN TRANSACTION ...' query
-#define EVSQL_QUERY_BEGIN_BUF 512
 
 // the should the OID of some valid psql type... *ANY* valid psql type, doesn't matter, only used for NULLs
 // 16 = bool in 8.3
 #define EVSQL_PQ_ARBITRARY_TYPE_OID 16
 
+/*
+ * Get the allocator to use for a new evsql with the given config, which may be NULL.
+ */
+void _evsql_allocator_get (struct evsql_allocator *allocator, const struct evsql_config *config);
+
+/*
+ * Allocate zeroed memory using the given allocator, release it using its free_fn.
+ */
+void *_evsql_alloc (const struct evsql_allocator *allocator, size_t size);
+
+/*
+ * Release memory of the given size allocated using _evsql_alloc, NULL is ignored.
+ */
+void _evsql_free (const struct evsql_allocator *allocator, void *ptr, size_t size);
+
+/*
+ * Copy the string into memory allocated using _evsql_alloc, release it using _evsql_free with strlen() + 1.
+ */
+char *_evsql_strdup (const struct evsql_allocator *allocator, const char *str);
+
+/*
+ * Set up the given slab for objects of the given size, allocated using the given allocator, which must remain valid.
+ */
+void _evsql_slab_init (struct evsql_slab *slab, const struct evsql_allocator *allocator, size_t size, size_t max_free);
+
+/*
+ * Get a zeroed object from the slab, returns NULL on failure.
+ */
+void *_evsql_slab_alloc (struct evsql_slab *slab);
+
+/*
+ * Return an object to the slab, NULL is ignored.
+ */
+void _evsql_slab_free (struct evsql_slab *slab, void *obj);
+
+/*
+ * Release all of the slab's free objects.
+ */
+void _evsql_slab_deinit (struct evsql_slab *slab);
+
 /*
  * Core query-submission interface.
  *
@@ -171,6 +604,45 @@ struct evsql_result {
  */
 struct evsql_query *_evsql_query_new (struct evsql *evsql, struct evsql_trans *trans, evsql_query_cb query_fn, void *cb_arg);
 
+/*
+ * Set the command to send once the query is pumped from the queue. The query_info's SQL is assumed to be static, and is
+ * used as-is, anything else is copied.
+ *
+ * Returns zero on success, nonzero on failure.
+ */
+int _evsql_query_command_set (struct evsql_query *query, const char *command);
+
+/*
+ * Give the query the given absolute deadline, shortening its query_timeout to match if needed.
+ *
+ * Returns nonzero with errno set to ETIMEDOUT if the deadline has already passed.
+ */
+int _evsql_query_deadline (struct evsql_query *query, const struct timeval *deadline);
+
+/*
+ * Release the command once the query has been sent or dropped.
+ */
+void _evsql_query_command_free (struct evsql_query *query);
+
+/*
+ * Fill in the query's params from the given query_info and the values in vargs.
+ *
+ * Returns zero on success, nonzero on failure.
+ */
+int _evsql_query_info_fill (struct evsql_query *query, const struct evsql_query_info *query_info, va_list vargs);
+
+/*
+ * Fill in the query's params from the given evsql_query_params.
+ *
+ * Returns zero on success, nonzero on failure.
+ */
+int _evsql_query_params_fill (struct evsql_query *query, const struct evsql_query_params *params);
+
+/*
+ * No params, with the results in binary, for internal queries that are read using evsql_result_next.
+ */
+extern const struct evsql_query_params _evsql_no_params;
+
 /*
  * Begin processing the given query, which should now be fully filled out.
  *
@@ -184,8 +656,42 @@ int _evsql_query_enqueue (struct evsql *evsql, struct evsql_trans *trans, struct
 /*
  * Free the query and related resources, doesn't trigger any callbacks or remove from any queues.
  *
- * The command should already be taken care of (NULL).
+ * The command should already be taken care of (NULL). If the query is part of a batch, the batch is freed along with
+ * its last query, without calling its done_fn.
  */
 void _evsql_query_free (struct evsql_query *query);
 
+/*
+ * Look for an identical coalescable query that is already in flight, and attach the given query to it.
+ *
+ * Returns 1 if the query was attached and will complete along with the other one, or 0 if the query must be
+ * enqueued as normal, in which case it is added to the coalesce table for others to attach to.
+ */
+int _evsql_query_coalesce (struct evsql *evsql, struct evsql_query *query, const struct evsql_query_info *query_info);
+
+/*
+ * Remove the query from the coalesce table if it's in there, so that no further queries will be attached to it.
+ */
+void _evsql_query_uncoalesce (struct evsql_query *query);
+
+/*
+ * Try and cancel the aborted transactionless query, so that it doesn't needlessly run to completion.
+ *
+ * Queries that are still queued, or waiting for an identical query, are freed right away. A query that is already
+ * running on a conn by itself is cancelled on the server, using evpq_cancel if libpq supports that, or otherwise a
+ * high-priority pg_cancel_backend query on another conn, and the conn will not take on any new queries until the
+ * server has acknowledged that.
+ *
+ * Returns 1 if the query was freed, or 0 if it is still in flight, in which case the caller must strip its cb_fn.
+ */
+int _evsql_query_cancel (struct evsql_query *query);
+
+/*
+ * Begin processing the given batch's queries, which will be removed from the batch's list. They will either be executed
+ * directly or enqueued for future execution, but either way, they will be kept together.
+ *
+ * Returns zero on success, nonzero on failure, in which case the queries are left in the batch.
+ */
+int _evsql_batch_enqueue (struct evsql_batch *batch);
+
 #endif /* EVSQL_INTERNAL_H */
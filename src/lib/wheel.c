@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "wheel.h"
+#include "log.h"
+
+struct wheel {
+    struct event_base *ev_base;
+
+    // the tick event, only added while there are timers pending
+    struct event *ev;
+
+    // tick resolution, and when the wheel started ticking
+    struct timeval tick, start;
+    uint64_t tick_usec;
+
+    // the last tick that we have handled
+    uint64_t now;
+
+    // number of pending timers
+    size_t count;
+
+    // the timers, hashed by their expire tick
+    LIST_HEAD(wheel_slot, wheel_timer) slots[WHEEL_SLOTS];
+};
+
+/*
+ * The current tick, according to the ev_base's clock
+ */
+static uint64_t _wheel_now (struct wheel *wheel) {
+    struct timeval now, elapsed;
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(wheel->ev_base, &now);
+
+    if (timercmp(&now, &wheel->start, <))
+        // the clock went backwards
+        return wheel->now;
+
+    timersub(&now, &wheel->start, &elapsed);
+
+    return ((uint64_t) elapsed.tv_sec * 1000000 + elapsed.tv_usec) / wheel->tick_usec;
+}
+
+/*
+ * Handle all the slots since the last tick, and fire the expired timers
+ */
+static void _wheel_tick (evutil_socket_t fd, short what, void *arg) {
+    struct wheel *wheel = arg;
+    struct wheel_slot expired;
+    struct wheel_timer *timer, *next;
+    uint64_t target = _wheel_now(wheel), tick, end;
+
+    (void) fd;
+    (void) what;
+
+    LIST_INIT(&expired);
+
+    // no need to go around more than once
+    end = target - wheel->now > WHEEL_SLOTS ? wheel->now + WHEEL_SLOTS : target;
+
+    for (tick = wheel->now + 1; tick <= end; tick++) {
+        for (timer = LIST_FIRST(&wheel->slots[tick % WHEEL_SLOTS]); timer; timer = next) {
+            next = LIST_NEXT(timer, entry);
+
+            if (timer->expire > target)
+                // still has to go around again
+                continue;
+
+            LIST_REMOVE(timer, entry);
+            LIST_INSERT_HEAD(&expired, timer, entry);
+        }
+    }
+
+    wheel->now = target;
+
+    // the callbacks may add and remove timers, including the other expired ones
+    while ((timer = LIST_FIRST(&expired)) != NULL) {
+        LIST_REMOVE(timer, entry);
+        timer->wheel = NULL;
+        wheel->count--;
+
+        timer->fn(timer, timer->arg);
+    }
+
+    if (!wheel->count)
+        // nothing to wait for anymore
+        event_del(wheel->ev);
+}
+
+struct wheel *wheel_alloc (struct event_base *ev_base, const struct timeval *tick) {
+    struct wheel *wheel = NULL;
+    size_t slot;
+
+    if ((wheel = calloc(1, sizeof(*wheel))) == NULL)
+        ERROR("calloc");
+
+    // simple attributes
+    wheel->ev_base = ev_base;
+    wheel->tick = *tick;
+    wheel->tick_usec = (uint64_t) tick->tv_sec * 1000000 + tick->tv_usec;
+
+    if (!wheel->tick_usec)
+        ERROR("zero tick");
+
+    for (slot = 0; slot < WHEEL_SLOTS; slot++)
+        LIST_INIT(&wheel->slots[slot]);
+
+    // the tick event
+    if ((wheel->ev = event_new(ev_base, -1, EV_PERSIST, _wheel_tick, wheel)) == NULL)
+        ERROR("event_new");
+
+    // XXX: errors?
+    event_base_gettimeofday_cached(ev_base, &wheel->start);
+
+    // done
+    return wheel;
+
+error:
+    if (wheel)
+        wheel_free(wheel);
+
+    return NULL;
+}
+
+void wheel_timer_init (struct wheel_timer *timer, void (*fn)(struct wheel_timer *timer, void *arg), void *arg) {
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->wheel = NULL;
+}
+
+int wheel_add (struct wheel *wheel, struct wheel_timer *timer, const struct timeval *timeout) {
+    uint64_t usec = (uint64_t) timeout->tv_sec * 1000000 + timeout->tv_usec;
+    uint64_t ticks = (usec + wheel->tick_usec - 1) / wheel->tick_usec;
+
+    // reschedule
+    wheel_del(timer);
+
+    if (!wheel->count) {
+        // start ticking
+        if (event_add(wheel->ev, &wheel->tick))
+            ERROR("event_add");
+
+        // skip the slots that passed while we weren't ticking
+        wheel->now = _wheel_now(wheel);
+    }
+
+    // the current tick has already partially passed, so never fire early
+    timer->expire = _wheel_now(wheel) + ticks + 1;
+    timer->wheel = wheel;
+
+    LIST_INSERT_HEAD(&wheel->slots[timer->expire % WHEEL_SLOTS], timer, entry);
+    wheel->count++;
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+void wheel_del (struct wheel_timer *timer) {
+    struct wheel *wheel = timer->wheel;
+
+    if (!wheel)
+        return;
+
+    LIST_REMOVE(timer, entry);
+    timer->wheel = NULL;
+
+    if (--wheel->count == 0)
+        event_del(wheel->ev);
+}
+
+int wheel_pending (const struct wheel_timer *timer) {
+    return timer->wheel != NULL;
+}
+
+void wheel_free (struct wheel *wheel) {
+    if (wheel->ev)
+        event_free(wheel->ev);
+
+    free(wheel);
+}
@@ -0,0 +1,84 @@
+#ifndef LIB_WHEEL_H
+#define LIB_WHEEL_H
+
+/*
+ * A hashed timing wheel for handling large numbers of timeouts using a single libevent timer.
+ *
+ * Timeouts are rounded up to the wheel's tick resolution, so timers fire up to one tick late, but never early.
+ * Adding/removing a timer is O(1).
+ */
+
+#include <sys/queue.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+/*
+ * Number of slots in the wheel, timers further away than this many ticks just go around the wheel more than once
+ */
+#define WHEEL_SLOTS 256
+
+/*
+ * The wheel itself
+ */
+struct wheel;
+
+/*
+ * A single timer, to be embedded in whatever it is that needs a timeout.
+ *
+ * A zero-initialized timer is not pending, and can be passed to wheel_del.
+ */
+struct wheel_timer {
+    // the callback
+    void (*fn)(struct wheel_timer *timer, void *arg);
+    void *arg;
+
+    // the wheel we are in, if pending
+    struct wheel *wheel;
+
+    // the tick we expire at
+    uint64_t expire;
+
+    // our position in the wheel's slot
+    LIST_ENTRY(wheel_timer) entry;
+};
+
+/*
+ * Allocate a wheel that ticks at the given resolution on the given ev_base.
+ *
+ * The underlying event is only active while there are timers pending.
+ *
+ * Returns NULL on failure
+ */
+struct wheel *wheel_alloc (struct event_base *ev_base, const struct timeval *tick);
+
+/*
+ * Set up the callback for the given timer, this doesn't schedule it.
+ */
+void wheel_timer_init (struct wheel_timer *timer, void (*fn)(struct wheel_timer *timer, void *arg), void *arg);
+
+/*
+ * Schedule the given timer to fire once the given timeout has passed, rescheduling it if it's already pending.
+ *
+ * The timer is no longer pending once its callback is called.
+ *
+ * Returns zero on success, nonzero on failure.
+ */
+int wheel_add (struct wheel *wheel, struct wheel_timer *timer, const struct timeval *timeout);
+
+/*
+ * Unschedule the timer if it's pending.
+ */
+void wheel_del (struct wheel_timer *timer);
+
+/*
+ * Is the timer pending?
+ */
+int wheel_pending (const struct wheel_timer *timer);
+
+/*
+ * Free the wheel. Any pending timers are simply forgotten, and must not be passed to wheel_del anymore.
+ */
+void wheel_free (struct wheel *wheel);
+
+#endif /* LIB_WHEEL_H */
@@ -4,25 +4,36 @@
 #include "lib/misc.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 /*
- * Initialize params->types/values/lengths/formats, params->count, params->result_format based on the given args
+ * Initialize params->types/values/lengths/formats, params->count, params->result_format based on the given args, using
+ * the given inline storage if there's room for them there.
  */
-static int _evsql_query_params_init_pq (struct evsql_query_params_pq *params, size_t param_count, enum evsql_item_format result_format) {
+static int _evsql_query_params_init_pq (const struct evsql_allocator *allocator, struct evsql_query_params_pq *params, struct evsql_query_params_inline *params_inline, size_t param_count, enum evsql_item_format result_format) {
     // set count
     params->count = param_count;
 
-    // allocate vertical storage for the parameters
-    if (0
-        
-        ||  !(params->types     = calloc(param_count, sizeof(Oid)))
-        ||  !(params->values    = calloc(param_count, sizeof(char *)))
-        ||  !(params->lengths   = calloc(param_count, sizeof(int)))
-        ||  !(params->formats   = calloc(param_count, sizeof(int)))
-        ||  !(params->item_vals = calloc(param_count, sizeof(union evsql_item_value)))
-    )
-        ERROR("calloc");
+    if (param_count <= EVSQL_QUERY_PARAMS_INLINE) {
+        // use the inline storage
+        params->item_vals   = params_inline->item_vals;
+        params->values      = params_inline->values;
+        params->types       = params_inline->types;
+        params->lengths     = params_inline->lengths;
+        params->formats     = params_inline->formats;
+
+    } else {
+        // allocate vertical storage for the parameters in one go, most-aligned first
+        if ((params->storage = _evsql_alloc(allocator, EVSQL_QUERY_PARAMS_STORAGE(param_count))) == NULL)
+            ERROR("_evsql_alloc");
+
+        params->item_vals   = params->storage;
+        params->values      = (const char **) (params->item_vals + param_count);
+        params->types       = (Oid *) (params->values + param_count);
+        params->lengths     = (int *) (params->types + param_count);
+        params->formats     = params->lengths + param_count;
+    }
 
     // result format
     switch (result_format) {
@@ -63,24 +74,17 @@ error:
     return NULL;
 }
 
-struct evsql_query *evsql_query_params (struct evsql *evsql, struct evsql_trans *trans, 
-    const char *command, const struct evsql_query_params *params, 
-    evsql_query_cb query_fn, void *cb_arg
-) {
-    struct evsql_query *query = NULL;
+int _evsql_query_params_fill (struct evsql_query *query, const struct evsql_query_params *params) {
     const struct evsql_item *param;
     size_t count = 0, idx;
-    
-    // alloc new query
-    if ((query = _evsql_query_new(evsql, trans, query_fn, cb_arg)) == NULL)
-        goto error;
 
     // count the params
     for (param = params->list; param->info.type; param++) 
         count++;
     
     // initialize params
-    _evsql_query_params_init_pq(&query->params, count, params->result_format);
+    if (_evsql_query_params_init_pq(&query->evsql->allocator, &query->params, &query->params_inline, count, params->result_format))
+        return -1;
 
     // transform
     for (param = params->list, idx = 0; param->info.type; param++, idx++) {
@@ -101,49 +105,20 @@ struct evsql_query *evsql_query_params (struct evsql *evsql, struct evsql_trans
         query->params.formats[idx] = param->info.format;
     }
 
-    // execute it
-    if (_evsql_query_enqueue(evsql, trans, query, command))
-        goto error;
-
-#ifdef DEBUG_ENABLED
-    // debug it?
-    DEBUG("evsql.%p: enqueued query=%p on trans=%p", evsql, query, trans);
-    evsql_query_debug(command, params);
-#endif /* DEBUG_ENABLED */
-
-    // ok
-    return query;
-
-error:
-    _evsql_query_free(query);
-    
-    return NULL;
+    return 0;
 }
 
-struct evsql_query *evsql_query_exec (struct evsql *evsql, struct evsql_trans *trans, 
-    const struct evsql_query_info *query_info,
-    evsql_query_cb query_fn, void *cb_arg,
-    ...
-) {
-    va_list vargs;
-    struct evsql_query *query = NULL;
+int _evsql_query_info_fill (struct evsql_query *query, const struct evsql_query_info *query_info, va_list vargs) {
     const struct evsql_item_info *param;
     size_t count = 0, idx;
-    err_t err = 1;
-
-    // varargs
-    va_start(vargs, cb_arg);
-    
-    // alloc new query
-    if ((query = _evsql_query_new(evsql, trans, query_fn, cb_arg)) == NULL)
-        goto error;
 
     // count the params
     for (param = query_info->params; param->type; param++) 
         count++;
     
     // initialize params
-    _evsql_query_params_init_pq(&query->params, count, EVSQL_FMT_BINARY);
+    if (_evsql_query_params_init_pq(&query->evsql->allocator, &query->params, &query->params_inline, count, EVSQL_FMT_BINARY))
+        goto error;
 
     // transform
     for (param = query_info->params, idx = 0; param->type; param++, idx++) {
@@ -222,10 +197,262 @@ struct evsql_query *evsql_query_exec (struct evsql *evsql, struct evsql_trans *t
         }
     }
 
+    return 0;
+
+error:
+    return -1;
+}
+
+struct evsql_query *evsql_query_params (struct evsql *evsql, struct evsql_trans *trans, 
+    const char *command, const struct evsql_query_params *params, 
+    evsql_query_cb query_fn, void *cb_arg
+) {
+    struct evsql_query *query = NULL;
+    
+    // alloc new query
+    if ((query = _evsql_query_new(evsql, trans, query_fn, cb_arg)) == NULL)
+        goto error;
+
+    // params
+    if (_evsql_query_params_fill(query, params))
+        goto error;
+
+    // execute it
+    if (_evsql_query_enqueue(evsql, trans, query, command))
+        goto error;
+
+#ifdef DEBUG_ENABLED
+    // debug it?
+    DEBUG("evsql.%p: enqueued query=%p on trans=%p", evsql, query, trans);
+    evsql_query_debug(command, params);
+#endif /* DEBUG_ENABLED */
+
+    // ok
+    return query;
+
+error:
+    _evsql_query_free(query);
+    
+    return NULL;
+}
+
+/*
+ * Common implementation of evsql_query_exec/evsql_query_exec_opts
+ */
+static struct evsql_query *_evsql_query_exec_va (struct evsql *evsql, struct evsql_trans *trans, 
+    const struct evsql_query_info *query_info, const struct evsql_query_opts *opts,
+    evsql_query_cb query_fn, void *cb_arg,
+    va_list vargs
+) {
+    struct evsql_query *query = NULL;
+
+    // alloc new query
+    if ((query = _evsql_query_new(evsql, trans, query_fn, cb_arg)) == NULL)
+        goto error;
+
+    // params
+    if (_evsql_query_info_fill(query, query_info, vargs))
+        goto error;
+
+    // for the statement cache
+    query->info = query_info;
+
+    if (opts && (unsigned) opts->priority >= EVSQL_PRIORITY_MAX)
+        ERROR("invalid priority: %d", opts->priority);
+
+    if (opts)
+        // use the given timeout instead of the configured one
+        query->timeout = opts->timeout;
+
+    if (opts && !trans)
+        // transaction queries are never queued
+        query->priority = opts->priority;
+
+    if (opts && timerisset(&opts->deadline) && _evsql_query_deadline(query, &opts->deadline))
+        // already expired
+        goto error;
+
+    if (opts && opts->row_fn) {
+        // stream the results
+        query->row_fn = opts->row_fn;
+        query->chunk_rows = opts->chunk_rows;
+
+    } else if (opts && opts->coalesce && !trans && _evsql_query_coalesce(evsql, query, query_info)) {
+        // piggyback on an identical query
+        return query;
+
+    }
+
     // execute it
     if (_evsql_query_enqueue(evsql, trans, query, query_info->sql))
         goto error;
     
+    // ok
+    return query;
+
+error:
+    _evsql_query_free(query);
+
+    return NULL;
+}
+
+struct evsql_query *evsql_query_exec (struct evsql *evsql, struct evsql_trans *trans, 
+    const struct evsql_query_info *query_info,
+    evsql_query_cb query_fn, void *cb_arg,
+    ...
+) {
+    va_list vargs;
+    struct evsql_query *query;
+
+    // varargs
+    va_start(vargs, cb_arg);
+    
+    query = _evsql_query_exec_va(evsql, trans, query_info, NULL, query_fn, cb_arg, vargs);
+
+    // end varargs
+    va_end(vargs);
+    
+    // return 
+    return query;
+}
+
+struct evsql_query *evsql_query_exec_opts (struct evsql *evsql, struct evsql_trans *trans, 
+    const struct evsql_query_info *query_info, const struct evsql_query_opts *opts,
+    evsql_query_cb query_fn, void *cb_arg,
+    ...
+) {
+    va_list vargs;
+    struct evsql_query *query;
+
+    // varargs
+    va_start(vargs, cb_arg);
+    
+    query = _evsql_query_exec_va(evsql, trans, query_info, opts, query_fn, cb_arg, vargs);
+
+    // end varargs
+    va_end(vargs);
+    
+    // return 
+    return query;
+}
+
+void evsql_query_abort (struct evsql_trans *trans, struct evsql_query *query) {
+    assert(query);
+
+    if (trans) {
+        // must be the right query, either sent or still in the trans's queue
+        assert(query->conn == trans->conn || query->trans == trans);
+    }
+
+    // the caller may free the param values now, so don't compare against them anymore, but any coalesced queries
+    // still get the results
+    _evsql_query_uncoalesce(query);
+
+    // transactionless queries can be dropped from the queue or cancelled, transactions roll back afterwards anyways
+    if (!trans && _evsql_query_cancel(query))
+        return;
+
+    // just strip the callback and wait for it to complete as normal
+    query->cb_fn = NULL;
+}
+
+
+struct evsql_batch *evsql_batch (struct evsql *evsql, evsql_batch_done_cb done_fn, void *cb_arg) {
+    struct evsql_batch *batch = NULL;
+
+    // allocate it
+    if ((batch = _evsql_alloc(&evsql->allocator, sizeof(*batch))) == NULL)
+        ERROR("_evsql_alloc");
+
+    // store
+    batch->evsql = evsql;
+    batch->done_fn = done_fn;
+    batch->cb_arg = cb_arg;
+
+    TAILQ_INIT(&batch->queries);
+
+    // ok
+    return batch;
+
+error:
+    return NULL;
+}
+
+/*
+ * Add a query with its params filled in to the batch, keeping the command for later execution.
+ */
+static int _evsql_batch_add (struct evsql_batch *batch, struct evsql_query *query, const char *command) {
+    // keep the command for later execution
+    if (_evsql_query_command_set(query, command))
+        goto error;
+
+    // add it
+    query->batch = batch;
+    batch->pending++;
+
+    TAILQ_INSERT_TAIL(&batch->queries, query, entry);
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+struct evsql_query *evsql_batch_params (struct evsql_batch *batch, 
+    const char *command, const struct evsql_query_params *params, 
+    evsql_query_cb query_fn, void *cb_arg
+) {
+    struct evsql_query *query = NULL;
+    
+    // alloc new query
+    if ((query = _evsql_query_new(batch->evsql, NULL, query_fn, cb_arg)) == NULL)
+        goto error;
+
+    // params
+    if (_evsql_query_params_fill(query, params))
+        goto error;
+
+    // add it
+    if (_evsql_batch_add(batch, query, command))
+        goto error;
+
+    // ok
+    return query;
+
+error:
+    _evsql_query_free(query);
+    
+    return NULL;
+}
+
+struct evsql_query *evsql_batch_exec (struct evsql_batch *batch, 
+    const struct evsql_query_info *query_info,
+    evsql_query_cb query_fn, void *cb_arg,
+    ...
+) {
+    va_list vargs;
+    struct evsql_query *query = NULL;
+    err_t err = 1;
+
+    // varargs
+    va_start(vargs, cb_arg);
+    
+    // alloc new query
+    if ((query = _evsql_query_new(batch->evsql, NULL, query_fn, cb_arg)) == NULL)
+        goto error;
+
+    // params
+    if (_evsql_query_info_fill(query, query_info, vargs))
+        goto error;
+
+    // for the statement cache
+    query->info = query_info;
+
+    // add it
+    if (_evsql_batch_add(batch, query, query_info->sql))
+        goto error;
+    
     // no error, fallthrough for va_end
     err = 0;
 
@@ -241,16 +468,44 @@ error:
     return err ? NULL : query;
 }
 
+int evsql_batch_submit (struct evsql_batch *batch) {
+    if (TAILQ_EMPTY(&batch->queries)) {
+        // nothing to do
+        if (batch->done_fn)
+            batch->done_fn(batch, batch->cb_arg);
 
-void evsql_query_abort (struct evsql_trans *trans, struct evsql_query *query) {
-    assert(query);
+        _evsql_free(&batch->evsql->allocator, batch, sizeof(*batch));
 
-    if (trans) {
-        // must be the right query
-        assert(trans->query == query);
+        return 0;
     }
 
-    // just strip the callback and wait for it to complete as normal
-    query->cb_fn = NULL;
+    // send them off
+    if (_evsql_batch_enqueue(batch))
+        goto error;
+
+    // ok
+    return 0;
+
+error:
+    evsql_batch_abort(batch);
+
+    return -1;
 }
 
+void evsql_batch_abort (struct evsql_batch *batch) {
+    struct evsql_query *query, *next;
+
+    if (TAILQ_EMPTY(&batch->queries)) {
+        _evsql_free(&batch->evsql->allocator, batch, sizeof(*batch));
+
+        return;
+    }
+
+    // the last one will also free the batch, so don't touch it after that
+    for (query = TAILQ_FIRST(&batch->queries); query; query = next) {
+        next = TAILQ_NEXT(query, entry);
+
+        _evsql_query_command_free(query);
+        _evsql_query_free(query);
+    }
+}
@@ -13,7 +13,7 @@ const char *evsql_result_error (const struct evsql_result *res) {
     switch (res->evsql->type) {
         case EVSQL_EVPQ:
             if (!res->result.pq)
-                return "unknown error (no result)";
+                return res->error == EIO ? "unknown error (no result)" : strerror(res->error);
             
             return PQresultErrorMessage(res->result.pq);
 
@@ -88,25 +88,96 @@ error:
 
 evsql_err_t evsql_result_check (struct evsql_result *res) {
     // so simple...
-    return res->error ? EIO : 0;
+    return res->error;
+}
+
+/*
+ * The size of the binary values of the given fixed-size type, or zero for variable-length types
+ */
+static size_t _evsql_item_size (enum evsql_item_type type) {
+    switch (type) {
+        case EVSQL_TYPE_UINT16:
+            return sizeof(uint16_t);
+
+        case EVSQL_TYPE_UINT32:
+            return sizeof(uint32_t);
+
+        case EVSQL_TYPE_UINT64:
+            return sizeof(uint64_t);
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Check that the result's columns match the result_info, so that evsql_result_next only needs to check each field for
+ * NULLs. Returns the number of columns in the result_info if they match, or -1.
+ */
+static ssize_t _evsql_result_layout (const struct evsql_result *res, const struct evsql_result_info *info) {
+    const struct evsql_item_info *col;
+    size_t cols = evsql_result_cols(res), col_idx;
+
+    for (col = info->columns, col_idx = 0; col->type; col++, col_idx++) {
+        size_t size = _evsql_item_size(col->type);
+
+        if (col_idx >= cols)
+            // just count the rest
+            continue;
+
+        switch (res->evsql->type) {
+            case EVSQL_EVPQ:
+                if (PQfformat(res->result.pq, col_idx) != 1)
+                    ERROR("c%zu: PQfformat is not binary: %d", col_idx, PQfformat(res->result.pq, col_idx));
+
+                // all of the values of a fixed-size type have the same length
+                if (size && PQfsize(res->result.pq, col_idx) != (int) size)
+                    ERROR("c%zu: wrong size for %zu-byte value: %d", col_idx, size, PQfsize(res->result.pq, col_idx));
+
+                break;
+
+            default:
+                FATAL("res->evsql->type");
+        }
+    }
+
+    // correct number of columns
+    if (cols != col_idx)
+        ERROR("wrong number of columns: %zu, should be %zu", cols, col_idx);
+
+    return col_idx;
+
+error:
+    return -1;
+}
+
+/*
+ * Get the field value for evsql_result_next, the format was already checked by _evsql_result_layout
+ */
+static void _evsql_result_value (const struct evsql_result *res, size_t row, size_t col, const char **ptr, size_t *size) {
+    switch (res->evsql->type) {
+        case EVSQL_EVPQ:
+            *size = PQgetlength(res->result.pq, row, col);
+            *ptr  = PQgetvalue(res->result.pq, row, col);
+
+            break;
+
+        default:
+            FATAL("res->evsql->type");
+    }
 }
 
 evsql_err_t evsql_result_begin (struct evsql_result_info *info, struct evsql_result *res) {
-    struct evsql_item_info *col;
-    size_t cols = 0, nrows;
+    size_t nrows;
     err_t err;
 
-    // count info columns
-    for (col = info->columns; col->type; col++)
-        cols++;
-
     // number of rows returned/affected
     nrows = evsql_result_rows(res) || evsql_result_affected(res);
 
     // did the query fail outright?
     if (res->error)
         // dump error message
-        NXERROR(err = EIO, evsql_result_error(res));
+        NXERROR(err = res->error, evsql_result_error(res));
 
 /*
     // SELECT/DELETE/UPDATE WHERE didn't match any rows -> ENOENT
@@ -114,9 +185,9 @@ evsql_err_t evsql_result_begin (struct evsql_result_info *info, struct evsql_res
         XERROR(err = ENOENT, "no rows returned/affected");
 */
 
-    // correct number of columns
-    if (evsql_result_cols(res) != cols)
-        XERROR(err = EINVAL, "wrong number of columns: %zu, should be %zu", evsql_result_cols(res), cols);
+    // check the columns once, rather than for each row
+    if (_evsql_result_layout(res, info) < 0)
+        SERROR(err = EINVAL);
     
     // assign
     res->info = info;
@@ -150,13 +221,13 @@ int evsql_result_next (struct evsql_result *res, ...) {
         const char *value = NULL;
         size_t length = 0;
         
-        // check for NULLs, then try and get the field value
+        // check for NULLs, then get the field value
         if (evsql_result_null(res, row_idx, col_idx)) {
             if (!col->flags.null_ok)
                 XERROR(err = EINVAL, "r%zu:c%zu: NULL", row_idx, col_idx);
 
-        } else if (evsql_result_field(res, row_idx, col_idx, &value, &length)) {
-            SERROR(err = EINVAL);
+        } else {
+            _evsql_result_value(res, row_idx, col_idx, &value, &length);
 
         }
         
@@ -185,8 +256,6 @@ int evsql_result_next (struct evsql_result *res, ...) {
 
                 if (!value) break;
 
-                if (length != sizeof(uint16_t)) XERROR(err = EINVAL, "r%zu:c%zu: wrong size for uint16_t: %zu", row_idx, col_idx, length);
-
                 int16_t sval = ntohs(*((int16_t *) value));
 
                 if (sval < 0) XERROR(err = ERANGE, "r%zu:c%zu: out of range for uint16_t: %hd", row_idx, col_idx, (signed short) sval);
@@ -199,8 +268,6 @@ int evsql_result_next (struct evsql_result *res, ...) {
 
                 if (!value) break;
 
-                if (length != sizeof(uint32_t)) XERROR(err = EINVAL, "r%zu:c%zu: wrong size for uint32_t: %zu", row_idx, col_idx, length);
-
                 int32_t sval = ntohl(*((int32_t *) value));
 
                 if (sval < 0) XERROR(err = ERANGE, "r%zu:c%zu: out of range for uint32_t: %ld", row_idx, col_idx, (signed long) sval);
@@ -213,8 +280,6 @@ int evsql_result_next (struct evsql_result *res, ...) {
 
                 if (!value) break;
 
-                if (length != sizeof(uint64_t)) XERROR(err = EINVAL, "r%zu:c%zu: wrong size for uint64_t: %zu", row_idx, col_idx, length);
-
                 int64_t sval = ntohq(*((int64_t *) value));
 
                 if (sval < 0) XERROR(err = ERANGE, "r%zu:c%zu: out of range for uint64_t: %lld", row_idx, col_idx, (signed long long) sval);
@@ -247,8 +312,19 @@ void evsql_result_free (struct evsql_result *res) {
     // in the case of internal-error results, these may be free'd multiple times!
     switch (res->evsql->type) {
         case EVSQL_EVPQ:
-            if (res->result.pq)
-                return PQclear(res->result.pq);
+            if (!res->result.pq)
+                return;
+
+            // shared with coalesced queries?
+            if (!res->ref || --res->ref->refs == 0) {
+                PQclear(res->result.pq);
+                _evsql_free(&res->evsql->allocator, res->ref, sizeof(*res->ref));
+            }
+            
+            res->result.pq = NULL;
+            res->ref = NULL;
+
+            return;
 
         default:
             FATAL("res->evsql->type");
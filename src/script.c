@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "lib/log.h"
+#include "lib/error.h"
+#include "lib/misc.h"
+
+/*
+ * Free the statements' queries and results, the ones that were sent are taken care of by the trans
+ */
+static void _evsql_script_clear (struct evsql_script *script) {
+    struct evsql_script_query *stmt;
+
+    for (stmt = script->stmts; stmt < script->stmts + script->count; stmt++) {
+        // never sent
+        _evsql_query_free(stmt->query); stmt->query = NULL;
+
+        // or never handed to the user
+        if (stmt->res.evsql)
+            evsql_result_free(&stmt->res);
+
+        ZINIT(stmt->res);
+    }
+}
+
+/*
+ * Free the script, the trans should already be taken care of
+ */
+static void _evsql_script_free (struct evsql_script *script) {
+    _evsql_script_clear(script);
+
+    _evsql_free(&script->evsql->allocator, script, sizeof(*script) + script->count * sizeof(*script->stmts));
+}
+
+/*
+ * Something went wrong with the script, so roll back the transaction if it hasn't already failed, and tell the user,
+ * along with the result of the statement that failed, if any
+ */
+static void _evsql_script_fail (struct evsql_script *script, err_t err) {
+    struct evsql_script_query *stmt;
+    struct evsql_result res;
+
+    if (script->trans) {
+        // errors are supressed
+        evsql_trans_abort(script->trans); script->trans = NULL;
+    }
+
+    if (script->failed < script->count) {
+        stmt = &script->stmts[script->failed];
+
+        // the statement's error is the interesting one
+        err = stmt->res.error;
+
+        // hand it over
+        res = stmt->res; ZINIT(stmt->res);
+
+        if (stmt->query_fn)
+            stmt->query_fn(&res, stmt->cb_arg);
+        else
+            evsql_result_free(&res);
+    }
+
+    if (script->done_fn)
+        script->done_fn(script, err, script->cb_arg);
+
+    _evsql_script_free(script);
+}
+
+/*
+ * Send all of the statements and the COMMIT, the trans queues them up if its conn isn't in pipeline mode.
+ *
+ * Returns nonzero on failure, in which case the script should be failed. If the trans failed, it will be gone.
+ */
+static int _evsql_script_send (struct evsql_script *script) {
+    struct evsql_script_query *stmt;
+    int err = 0;
+
+    script->busy = 1;
+
+    while (script->sent < script->count) {
+        stmt = &script->stmts[script->sent];
+
+        if (_evsql_query_enqueue(script->evsql, script->trans, stmt->query, stmt->query->info->sql)) {
+            WARNING("failed to send script statement %zu", script->sent);
+
+            err = -1;
+
+            break;
+        }
+
+        // the trans has it now
+        stmt->query = NULL;
+        script->sent++;
+    }
+
+    if (!err) {
+        // right behind the last statement
+        if ((err = evsql_trans_commit(script->trans)))
+            WARNING("evsql_trans_commit");
+        else
+            script->has_commit = 1;
+    }
+
+    script->busy = 0;
+
+    return err;
+}
+
+/*
+ * One of the statements is done, keep its result until the COMMIT is done
+ */
+static void _evsql_script_res (struct evsql_result *res, void *arg) {
+    struct evsql_script *script = arg;
+    struct evsql_script_query *stmt = &script->stmts[script->done++];
+
+    // take over the result
+    stmt->res = *res;
+
+    if (res->error && script->failed == script->count) {
+        WARNING("script statement %zu failed: %s", script->done - 1, evsql_result_error(res));
+
+        script->failed = script->done - 1;
+    }
+
+    if (script->failed < script->count && !script->has_commit)
+        // roll back without sending the rest
+        _evsql_script_fail(script, EIO);
+
+    // otherwise, the COMMIT will fail
+}
+
+/*
+ * Set up the queries for the statements, with their params, to be sent once the trans is ready.
+ *
+ * Returns nonzero on failure, the queries are then freed along with the script.
+ */
+static int _evsql_script_build (struct evsql_script *script) {
+    struct evsql_script_query *stmt;
+
+    script->sent = script->done = 0;
+    script->failed = script->count;
+    script->has_commit = 0;
+
+    for (stmt = script->stmts; stmt < script->stmts + script->count; stmt++) {
+        if ((stmt->query = _evsql_query_new(script->evsql, NULL, _evsql_script_res, script)) == NULL)
+            goto error;
+
+        if (_evsql_query_params_fill(stmt->query, stmt->params ? stmt->params : &_evsql_no_params))
+            goto error;
+
+        // for the statement cache
+        stmt->query->info = stmt->info;
+    }
+
+    // ok
+    return 0;
+
+error:
+    return -1;
+}
+
+/*
+ * The script's transaction failed because of a serialization failure or deadlock, and has been started again, so
+ * send everything again
+ */
+static void _evsql_script_trans_replay (struct evsql_trans *trans, void *arg) {
+    struct evsql_script *script = arg;
+
+    (void) trans;
+
+    // forget about the previous attempt
+    _evsql_script_clear(script);
+
+    if (_evsql_script_build(script) || _evsql_script_send(script))
+        _evsql_script_fail(script, EIO);
+}
+
+/*
+ * The script's transaction is ready, send everything
+ */
+static void _evsql_script_trans_ready (struct evsql_trans *trans, void *arg) {
+    struct evsql_script *script = arg;
+
+    (void) trans;
+
+    if (_evsql_script_send(script))
+        _evsql_script_fail(script, EIO);
+}
+
+/*
+ * The script's transaction failed
+ */
+static void _evsql_script_trans_error (struct evsql_trans *trans, void *arg) {
+    struct evsql_script *script = arg;
+
+    (void) trans;
+
+    // the trans is freed by evsql
+    script->trans = NULL;
+
+    if (script->busy)
+        // our caller will handle it
+        return;
+
+    _evsql_script_fail(script, EIO);
+}
+
+/*
+ * The script's transaction was commited, so hand out the results
+ */
+static void _evsql_script_trans_done (struct evsql_trans *trans, void *arg) {
+    struct evsql_script *script = arg;
+    struct evsql_script_query *stmt;
+    struct evsql_result res;
+
+    (void) trans;
+
+    script->trans = NULL;
+
+    for (stmt = script->stmts; stmt < script->stmts + script->count; stmt++) {
+        res = stmt->res; ZINIT(stmt->res);
+
+        if (stmt->query_fn)
+            stmt->query_fn(&res, stmt->cb_arg);
+        else
+            evsql_result_free(&res);
+    }
+
+    if (script->done_fn)
+        script->done_fn(script, 0, script->cb_arg);
+
+    _evsql_script_free(script);
+}
+
+struct evsql_script *evsql_trans_script (struct evsql *evsql, enum evsql_trans_type type,
+    const struct evsql_script_stmt *stmts, size_t count,
+    evsql_script_done_cb done_fn, void *cb_arg
+) {
+    struct evsql_script *script = NULL;
+    struct evsql_script_query *stmt;
+    size_t idx;
+
+    if (!count)
+        ERROR("no statements given");
+
+    // allocate it, along with the statements
+    if ((script = _evsql_alloc(&evsql->allocator, sizeof(*script) + count * sizeof(*script->stmts))) == NULL)
+        ERROR("_evsql_alloc");
+
+    // store
+    script->evsql = evsql;
+    script->done_fn = done_fn;
+    script->cb_arg = cb_arg;
+    script->count = count;
+
+    for (idx = 0; idx < count; idx++) {
+        stmt = &script->stmts[idx];
+
+        if (!stmts[idx].params && stmts[idx].query_info->params[0].type)
+            ERROR("script statement %zu: no params given", idx);
+
+        stmt->info = stmts[idx].query_info;
+        stmt->params = stmts[idx].params;
+        stmt->query_fn = stmts[idx].query_fn;
+        stmt->cb_arg = stmts[idx].cb_arg;
+    }
+
+    // the queries, sent once the trans is ready
+    if (_evsql_script_build(script))
+        goto error;
+
+    // and the transaction for them
+    if ((script->trans = evsql_trans(evsql, type, _evsql_script_trans_error, _evsql_script_trans_ready, _evsql_script_trans_done, script)) == NULL)
+        goto error;
+
+    // scripts can always be replayed
+    evsql_trans_replay(script->trans, _evsql_script_trans_replay);
+
+    // ok
+    return script;
+
+error:
+    if (script)
+        _evsql_script_free(script);
+
+    return NULL;
+}
+
+void evsql_script_abort (struct evsql_script *script) {
+    struct evsql_script_query *stmt;
+
+    if (script->has_commit) {
+        // too late to roll back, so just forget about the callbacks, and let the trans free the script
+        for (stmt = script->stmts; stmt < script->stmts + script->count; stmt++)
+            stmt->query_fn = NULL;
+
+        script->done_fn = NULL;
+
+        return;
+    }
+
+    // roll back, the trans won't call us anymore
+    evsql_trans_abort(script->trans); script->trans = NULL;
+
+    _evsql_script_free(script);
+}
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "internal.h"
+#include "lib/log.h"
+#include "lib/error.h"
+
+static void *_evsql_default_alloc (size_t size, void *arg) {
+    (void) arg;
+
+    return malloc(size);
+}
+
+static void _evsql_default_free (void *ptr, size_t size, void *arg) {
+    (void) size;
+    (void) arg;
+
+    free(ptr);
+}
+
+/*
+ * The allocator used by evsqls whose evsql_config doesn't give one, see evsql_set_allocator
+ */
+static struct evsql_allocator _evsql_allocator = {
+    .alloc_fn   = _evsql_default_alloc,
+    .free_fn    = _evsql_default_free,
+    .arg        = NULL,
+};
+
+void evsql_set_allocator (const struct evsql_allocator *allocator) {
+    if (allocator && allocator->alloc_fn && allocator->free_fn) {
+        _evsql_allocator = *allocator;
+
+    } else {
+        // back to malloc/free
+        _evsql_allocator.alloc_fn = _evsql_default_alloc;
+        _evsql_allocator.free_fn = _evsql_default_free;
+        _evsql_allocator.arg = NULL;
+    }
+}
+
+void _evsql_allocator_get (struct evsql_allocator *allocator, const struct evsql_config *config) {
+    if (config && config->allocator.alloc_fn && config->allocator.free_fn)
+        *allocator = config->allocator;
+    else
+        *allocator = _evsql_allocator;
+}
+
+void *_evsql_alloc (const struct evsql_allocator *allocator, size_t size) {
+    void *ptr;
+
+    if ((ptr = allocator->alloc_fn(size, allocator->arg)) == NULL)
+        return NULL;
+
+    // like calloc
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+void _evsql_free (const struct evsql_allocator *allocator, void *ptr, size_t size) {
+    if (!ptr)
+        return;
+
+    allocator->free_fn(ptr, size, allocator->arg);
+}
+
+char *_evsql_strdup (const struct evsql_allocator *allocator, const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy;
+
+    if ((copy = allocator->alloc_fn(size, allocator->arg)) == NULL)
+        return NULL;
+
+    memcpy(copy, str, size);
+
+    return copy;
+}
+
+void _evsql_slab_init (struct evsql_slab *slab, const struct evsql_allocator *allocator, size_t size, size_t max_free) {
+    // the freelist is kept in the free objects themselves
+    assert(size >= sizeof(struct evsql_slab_free));
+
+    slab->allocator = allocator;
+    slab->size = size;
+    slab->max_free = max_free;
+    slab->free_list = NULL;
+}
+
+void *_evsql_slab_alloc (struct evsql_slab *slab) {
+    void *obj;
+
+    if ((obj = slab->free_list) != NULL) {
+        // reuse a free one
+        slab->free_list = slab->free_list->next;
+        slab->stats.cached--;
+
+        memset(obj, 0, slab->size);
+
+    } else {
+        if ((obj = _evsql_alloc(slab->allocator, slab->size)) == NULL)
+            ERROR("alloc_fn: %zu bytes", slab->size);
+
+        slab->stats.sys_allocs++;
+    }
+
+    slab->stats.allocs++;
+    slab->stats.in_use++;
+
+    return obj;
+
+error:
+    slab->stats.failed++;
+
+    return NULL;
+}
+
+void _evsql_slab_free (struct evsql_slab *slab, void *obj) {
+    struct evsql_slab_free *item = obj;
+
+    if (!obj)
+        return;
+
+    assert(slab->stats.in_use > 0);
+
+    slab->stats.frees++;
+    slab->stats.in_use--;
+
+    if (slab->stats.cached >= slab->max_free) {
+        // enough of them around already
+        slab->allocator->free_fn(obj, slab->size, slab->allocator->arg);
+        slab->stats.sys_frees++;
+
+        return;
+    }
+
+    // keep it for reuse
+    item->next = slab->free_list;
+    slab->free_list = item;
+    slab->stats.cached++;
+}
+
+void _evsql_slab_deinit (struct evsql_slab *slab) {
+    struct evsql_slab_free *item;
+
+    // any objects still in use are leaked
+    if (slab->stats.in_use)
+        WARNING("%zu objects of %zu bytes still in use", slab->stats.in_use, slab->size);
+
+    while ((item = slab->free_list) != NULL) {
+        slab->free_list = item->next;
+
+        slab->allocator->free_fn(item, slab->size, slab->allocator->arg);
+        slab->stats.sys_frees++;
+        slab->stats.cached--;
+    }
+}